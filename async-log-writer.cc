@@ -0,0 +1,109 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "async-log-writer.h"
+
+#include <stdarg.h>
+
+#include <chrono>
+
+AsyncLogWriter::AsyncLogWriter(FILE *out, size_t buffer_size,
+                               bool drop_if_full, int flush_interval_ms)
+    : out_(out),
+      buffer_size_(buffer_size),
+      drop_if_full_(drop_if_full),
+      flush_interval_ms_(flush_interval_ms) {
+    pending_.reserve(buffer_size_);
+    writer_ = std::thread(&AsyncLogWriter::Run, this);
+}
+
+AsyncLogWriter::~AsyncLogWriter() {
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        stop_ = true;
+    }
+    wake_writer_.notify_one();
+    writer_.join();
+}
+
+void AsyncLogWriter::Printf(const char *format, ...) {
+    char local[1024];
+    va_list ap;
+    va_start(ap, format);
+    const int len = vsnprintf(local, sizeof(local), format, ap);
+    va_end(ap);
+    if (len < 0) return;
+    if ((size_t)len < sizeof(local)) {
+        Append(local, len);
+        return;
+    }
+    // Rare long message.
+    std::string message(len + 1, '\0');
+    va_start(ap, format);
+    vsnprintf(&message[0], message.size(), format, ap);
+    va_end(ap);
+    Append(message.data(), len);
+}
+
+void AsyncLogWriter::Append(const char *data, size_t len) {
+    std::unique_lock<std::mutex> l(mutex_);
+    // A message larger than the whole buffer is accepted once it is empty.
+    auto fits = [&]() {
+        return pending_.empty() || pending_.size() + len <= buffer_size_;
+    };
+    if (!fits()) {
+        if (drop_if_full_) {
+            ++dropped_;
+            return;
+        }
+        wake_writer_.notify_one();
+        space_available_.wait(l, fits);
+    }
+    pending_.append(data, len);
+    if (pending_.size() >= buffer_size_ / 2) wake_writer_.notify_one();
+}
+
+void AsyncLogWriter::Flush() {
+    std::unique_lock<std::mutex> l(mutex_);
+    flush_requested_ = true;
+    wake_writer_.notify_one();
+    space_available_.wait(l, [this]() {
+        return pending_.empty() && dropped_ == 0 && !writing_;
+    });
+}
+
+void AsyncLogWriter::Run() {
+    std::string batch;
+    batch.reserve(buffer_size_);
+    std::unique_lock<std::mutex> l(mutex_);
+    for (;;) {
+        wake_writer_.wait_for(
+            l, std::chrono::milliseconds(flush_interval_ms_), [this]() {
+                return stop_ || flush_requested_ ||
+                       pending_.size() >= buffer_size_ / 2;
+            });
+        flush_requested_ = false;
+        if (pending_.empty() && dropped_ == 0) {
+            if (stop_) break;
+            continue;
+        }
+        batch.swap(pending_);
+        const size_t dropped = dropped_;
+        dropped_ = 0;
+        writing_ = true;
+        l.unlock();
+        space_available_.notify_all();  // Blocked callers can append again.
+
+        fwrite(batch.data(), 1, batch.size(), out_);
+        if (dropped) {
+            fprintf(out_, "\n[... %zu log messages dropped ...]\n", dropped);
+        }
+        fflush(out_);
+        batch.clear();
+
+        l.lock();
+        writing_ = false;
+        space_available_.notify_all();  // Flush() waits for that.
+    }
+}
@@ -0,0 +1,57 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#ifndef ASYNC_LOG_WRITER_H
+#define ASYNC_LOG_WRITER_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Log writer that formats messages into a bounded buffer which a background
+// thread writes out in batches, so that logging does not cost a system call
+// per message and a slow terminal does not stall the caller.
+//
+// The buffer is written when it is half full, periodically every
+// "flush_interval_ms" or on Flush().
+// If the buffer is full, the message is either dropped (and the number of
+// dropped messages noted in the log) if "drop_if_full" is set, or the caller
+// blocks until there is space again.
+class AsyncLogWriter {
+   public:
+    AsyncLogWriter(FILE *out, size_t buffer_size, bool drop_if_full,
+                   int flush_interval_ms = 50);
+    ~AsyncLogWriter();  // Writes all remaining messages.
+
+    void Printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+    // Block until everything logged so far is written. Needed before
+    // anything else writes to the same output to keep the order.
+    void Flush();
+
+   private:
+    void Append(const char *data, size_t len);
+    void Run();
+
+    FILE *const out_;
+    const size_t buffer_size_;
+    const bool drop_if_full_;
+    const int flush_interval_ms_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_writer_;
+    std::condition_variable space_available_;
+    std::string pending_;  // Appended to by Printf(), guarded by mutex_.
+    size_t dropped_ = 0;
+    bool writing_ = false;  // Writer busy with a batch outside the lock.
+    bool flush_requested_ = false;
+    bool stop_ = false;
+    std::thread writer_;
+};
+
+#endif  // ASYNC_LOG_WRITER_H
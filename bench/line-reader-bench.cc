@@ -0,0 +1,126 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+// Microbenchmark of BufferedLineReader::ReadNextLines() with generated
+// gcode of various line lengths, line endings and comment densities, read
+// from a memory mapped file and through read() as from a pipe.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+
+#include "buffered-line-reader.h"
+
+static constexpr int kRepetitions = 3;  // Best of these.
+
+static double NowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Byte source that is never memory mapped.
+class ReadByteSource : public ByteSource {
+   public:
+    explicit ReadByteSource(int fd) : fd_(fd) {}
+    ssize_t Read(char *buffer, size_t len) override {
+        return read(fd_, buffer, len);
+    }
+
+   private:
+    const int fd_;
+};
+
+// Write a temporary gcode file of about "size" bytes, lines of about
+// "line_len" characters, every "comment_every"-th with a comment.
+static std::string CreateFile(size_t size, size_t line_len, bool crlf,
+                              int comment_every) {
+    char filename[] = "/tmp/line-reader-bench-XXXXXX";
+    const int fd = mkstemp(filename);
+    if (fd < 0) {
+        perror("mkstemp");
+        exit(1);
+    }
+    std::string content;
+    content.reserve(size + 256);
+    char line[256];
+    for (int n = 0; content.size() < size; ++n) {
+        int len = snprintf(line, sizeof(line), "G1 X%d.%03d Y%d.%03d", n % 200,
+                           n % 1000, (n * 7) % 200, (n * 13) % 1000);
+        while ((size_t)len + 8 < line_len && len < 200) {
+            len += snprintf(line + len, sizeof(line) - len, " E%d.%d", n % 10,
+                            len);
+        }
+        content.append(line, len);
+        if (comment_every && n % comment_every == 0) {
+            content.append(" ; comment");
+        }
+        content.append(crlf ? "\r\n" : "\n");
+    }
+    if (write(fd, content.data(), content.size()) != (ssize_t)content.size()) {
+        perror("write");
+        exit(1);
+    }
+    close(fd);
+    return filename;
+}
+
+static void Bench(const std::string &filename, bool mapped, const char *name) {
+    double best = 1e9;
+    size_t lines = 0;
+    off_t size = 0;
+    for (int i = 0; i < kRepetitions; ++i) {
+        const int fd = open(filename.c_str(), O_RDONLY);
+        size = lseek(fd, 0, SEEK_END);
+        lseek(fd, 0, SEEK_SET);
+        std::unique_ptr<ByteSource> source;
+        if (mapped) {
+            source.reset(new FDByteSource(fd));
+        } else {
+            source.reset(new ReadByteSource(fd));
+        }
+        const double start = NowSeconds();
+        BufferedLineReader reader(std::move(source), 1 << 20, true);
+        std::string_view batch[256];
+        lines = 0;
+        while (!reader.is_eof()) lines += reader.ReadNextLines(batch, 256);
+        best = std::min(best, NowSeconds() - start);
+        close(fd);
+    }
+    printf("%-36s %-5s %8.1f MB/s %7.2f Mlines/s\n", name,
+           mapped ? "mmap" : "read", size / best / 1e6, lines / best / 1e6);
+}
+
+int main() {
+    struct Config {
+        size_t size;
+        size_t line_len;
+        bool crlf;
+        int comment_every;
+    };
+    const Config configs[] = {
+        {64 << 20, 24, false, 0},  {64 << 20, 48, false, 0},
+        {64 << 20, 120, false, 0}, {64 << 20, 48, true, 0},
+        {64 << 20, 48, false, 4},  {64 << 20, 48, false, 1},
+        {1 << 20, 48, false, 0},
+    };
+    printf("BufferedLineReader::ReadNextLines()\n");
+    for (const Config &c : configs) {
+        char name[128];
+        snprintf(name, sizeof(name), "%3zuMB line %3zu %s comments %3d%%",
+                 c.size >> 20, c.line_len, c.crlf ? "CRLF" : "LF  ",
+                 c.comment_every ? 100 / c.comment_every : 0);
+        const std::string filename =
+            CreateFile(c.size, c.line_len, c.crlf, c.comment_every);
+        Bench(filename, true, name);
+        Bench(filename, false, name);
+        unlink(filename.c_str());
+    }
+}
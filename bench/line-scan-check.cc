@@ -0,0 +1,149 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+// Lines BufferedLineReader makes of generated inputs full of the cases the
+// vector line scanners handle in special ways: CRLF split across a chunk
+// boundary, ';' in the last lane, whitespace-only lines, lines of any
+// length and a final line without newline. Each input is read from a memory
+// mapped file and through read() with buffers of several sizes; the position
+// and text of each line is printed.
+//
+// This is built with the vector scanner of the target and with the scalar
+// one (-DUSE_SCALAR_LINE_SCAN); 'make check-line-scan' compares the output
+// of both byte for byte.
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "buffered-line-reader.h"
+
+// Buffer sizes for the read() inputs; the longest generated line fits.
+static constexpr size_t kBufferSizes[] = {512, 1000, 4096};
+
+// Byte source that is never memory mapped.
+class ReadByteSource : public ByteSource {
+   public:
+    explicit ReadByteSource(int fd) : fd_(fd) {}
+    ssize_t Read(char *buffer, size_t len) override {
+        return read(fd_, buffer, len);
+    }
+
+   private:
+    const int fd_;
+};
+
+// Lines of all lengths up to two chunks of the widest scanner, ending in
+// each of the interesting ways, in turn starting at every offset.
+static std::string EdgeCaseInput(const char *ending, char last, char fill) {
+    std::string content;
+    for (int offset = 0; offset < 64; ++offset) {
+        for (int len = 0; len <= 66; ++len) {
+            content.append(offset % 7, ' ');  // Shift within the chunk.
+            std::string line(len, fill);
+            if (len > 0) line[0] = 'G';
+            if (len > 1) line.back() = last;
+            content += line;
+            content += ending;
+        }
+        content.append(offset, 'X');
+        content += "\n";
+    }
+    return content;
+}
+
+// Random soup of the characters the scanners classify, in lines shorter
+// than the smallest buffer.
+static std::string RandomInput(unsigned seed, size_t size) {
+    static constexpr char kAlphabet[] = "G1X.; \t\r\n\v\f\r\n;\xb0";
+    srand(seed);
+    std::string content;
+    size_t line_start = 0;
+    while (content.size() < size) {
+        const char c = kAlphabet[rand() % (sizeof(kAlphabet) - 1)];
+        content += c;
+        if (c == '\n' || c == '\r') line_start = content.size();
+        if (rand() % 8 == 0) content.append(rand() % 40, "G1 X2 ;"[rand() % 7]);
+        if (content.size() - line_start > 200) {
+            content += '\n';
+            line_start = content.size();
+        }
+    }
+    return content;
+}
+
+static std::string WriteTempFile(const std::string &content) {
+    char filename[] = "/tmp/line-scan-check-XXXXXX";
+    const int fd = mkstemp(filename);
+    if (fd < 0 ||
+        write(fd, content.data(), content.size()) != (ssize_t)content.size()) {
+        perror("Writing temporary file");
+        exit(1);
+    }
+    close(fd);
+    return filename;
+}
+
+static void PrintLines(const std::string &filename, bool mapped,
+                       size_t buffer_size, bool remove_comments) {
+    const int fd = open(filename.c_str(), O_RDONLY);
+    std::unique_ptr<ByteSource> source;
+    if (mapped) {
+        source.reset(new FDByteSource(fd));
+    } else {
+        source.reset(new ReadByteSource(fd));
+    }
+    BufferedLineReader reader(std::move(source), buffer_size, remove_comments);
+    std::string_view lines[256];
+    uint64_t positions[256];
+    while (!reader.is_eof()) {
+        const size_t count = reader.ReadNextLines(lines, 256, positions);
+        for (size_t i = 0; i < count; ++i) {
+            printf("%" PRIu64 "\t%.*s", positions[i], (int)lines[i].size(),
+                   lines[i].data());
+        }
+    }
+    close(fd);
+}
+
+int main() {
+    std::vector<std::string> inputs;
+    for (const char *ending : {"\n", "\r\n", "\r"}) {
+        for (const char last : {';', ' ', '1'}) {
+            inputs.push_back(EdgeCaseInput(ending, last, '1'));
+            inputs.push_back(EdgeCaseInput(ending, last, ' '));
+            inputs.push_back(EdgeCaseInput(ending, last, '\t'));
+            inputs.push_back(EdgeCaseInput(ending, last, ';'));
+        }
+    }
+    for (unsigned seed = 1; seed <= 32; ++seed) {
+        inputs.push_back(RandomInput(seed, 1000 * seed));
+    }
+    inputs.push_back("");
+    inputs.push_back(" \t \r\n\n");
+
+    // Each one as is, and ending without newline.
+    size_t files = 0;
+    for (const std::string &input : inputs) {
+        for (const std::string &content :
+             {input, input + "G1 X1 ; no newline", input + "  ;\t"}) {
+            const std::string filename = WriteTempFile(content);
+            printf("---- input %zu\n", files++);
+            for (const bool remove_comments : {true, false}) {
+                PrintLines(filename, true, 4096, remove_comments);
+                for (const size_t buffer_size : kBufferSizes) {
+                    PrintLines(filename, false, buffer_size, remove_comments);
+                }
+            }
+            unlink(filename.c_str());
+        }
+    }
+    fprintf(stderr, "Lines of %zu inputs\n", files);
+}
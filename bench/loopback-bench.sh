@@ -0,0 +1,44 @@
+#!/bin/sh
+# End-to-end benchmark: stream a generated job with gcode-cli to the
+# simulated machine with different flow control settings and report
+# blocks/s and round-trip latency.
+#
+# Usage: loopback-bench.sh [<gcode-cli> [<mock-machine>]]
+
+GCODE_CLI=${1:-./gcode-cli}
+MOCK=${2:-bench/mock-machine}
+LINES=${LINES:-10000}
+
+JOB=$(mktemp /tmp/loopback-bench-XXXXXX)
+trap 'rm -f "$JOB"' EXIT
+awk -v n="$LINES" 'BEGIN { for (i = 0; i < n; ++i)
+    printf("G1 X%d.%03d Y%d.%03d F3000\n", i % 200, i % 1000, i * 7 % 200, i * 13 % 1000) }' > "$JOB"
+
+# Run label, mock-machine options, gcode-cli options and options of a
+# pseudo terminal connection.
+run() {
+    label="$1"; mock_opts="$2"; cli_opts="$3"; tty_opts="$4"
+    connection=-
+    case "$mock_opts" in *-t*) connection=@$tty_opts ;; esac
+    printf '%-34s ' "$label"
+    $MOCK $mock_opts -- $GCODE_CLI -q -s 100 -t $cli_opts "$JOB" $connection 2>&1 |
+        awk '/^Round-trip/ { p50 = $7; p99 = $9; sub(",", "", p50); sub(",", "", p99) }
+             /^mock-machine/ { rate = $6; overflow = $(NF-2) }
+             END { printf("%7s blocks/s  p50 %-9s p99 %-9s overflow %s\n",
+                          rate, p50, p99, overflow) }'
+}
+
+echo "Loopback with $LINES blocks; machine latency 100us per block"
+run "-b 1"                  "-l 100"                 "-b 1"
+run "-b 8"                  "-l 100"                 "-b 8"
+run "-b 32"                 "-l 100"                 "-b 32"
+run "-B 128 (Grbl buffer)"  "-l 100 -r 128"          "-B 128"
+run "-A (ADVANCED_OK)"      "-l 100 -s 8 -a"         "-A -b 32"
+echo "Serial link throttled to 115200 baud through a pty"
+run "tty -b 1"              "-t -l 100 -b 115200"    "-b 1"
+run "tty -B 128"            "-t -l 100 -b 115200 -r 128" "-B 128"
+run "tty -B 128 --minify"   "-t -l 100 -b 115200 -r 128" "-B 128 --minify"
+echo "Pseudo terminal writes: synchronous (O_SYNC) vs. asynchronous"
+run "tty -b 32 sync"        "-t -l 100"              "-b 32" ",sync"
+run "tty -b 32 async"       "-t -l 100"              "-b 32"
+run "tty -b 32 async outq=256" "-t -l 100"           "-b 32" ",outq=256"
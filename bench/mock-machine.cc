@@ -0,0 +1,285 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+// Simulated machine controller to benchmark the streaming path end to end.
+//
+// Runs a sender command connected to the simulated machine, either through
+// a socketpair on its stdin/stdout (connection string '-') or through a
+// pseudo terminal, whose path replaces a '@' at the start of an argument of
+// the command, so that connection options can follow: '@,b115200'.
+//
+// The machine receives bytes with the throughput of the given bit rate
+// into a receive buffer of limited size. Each complete line takes the
+// processing latency until it is acknowledged with 'ok' and its space in the
+// receive buffer is free again. Bytes that don't fit into the buffer are
+// dropped and counted as overflow, as a real controller would lose them.
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+// Free planner and buffer slots reported with ADVANCED_OK if not limited.
+static constexpr int kReportedFreeSlots = 16;
+static constexpr int kTypicalLineLength = 24;
+
+// Marlin says 'wait' this often while idle with an empty buffer.
+static constexpr int64_t kIdleWaitMicros = 1000000;
+
+static int64_t NowMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int usage(const char *progname) {
+    fprintf(stderr,
+            "Usage: %s [options] -- <sender-command> [args...]\n"
+            "Options:\n"
+            "\t-l <micros> : Processing latency per line until 'ok'. "
+            "Default 100\n"
+            "\t-r <bytes>  : Receive buffer size; 0: unlimited. Default 0\n"
+            "\t-s <lines>  : Lines the receive buffer holds; 0: unlimited.\n"
+            "\t-b <baud>   : Throttle to the throughput of this bit rate\n"
+            "\t              (10 bits per byte); 0: no limit. Default 0\n"
+            "\t-a          : Report free buffer space with each 'ok' as in\n"
+            "\t              Marlin ADVANCED_OK.\n"
+            "\t-P          : With -a, only report the free planner slots,\n"
+            "\t              not those of the receive buffer.\n"
+            "\t-w <line>   : Lose this line: never acknowledge it. While\n"
+            "\t              idle, say 'wait' every second as Marlin does.\n"
+            "\t-t          : Connect through a pseudo terminal; a '@' at\n"
+            "\t              the start of an argument of the command is\n"
+            "\t              replaced by its path.\n",
+            progname);
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    int64_t latency_us = 100;
+    size_t rx_bytes = 0;
+    size_t rx_lines = 0;
+    int64_t baud = 0;
+    bool advanced_ok = false;
+    bool planner_only = false;
+    bool use_pty = false;
+    uint64_t lost_line = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "l:r:s:b:aPtw:h")) != -1) {
+        switch (opt) {
+        case 'l': latency_us = atoll(optarg); break;
+        case 'r': rx_bytes = atoll(optarg); break;
+        case 's': rx_lines = atoll(optarg); break;
+        case 'b': baud = atoll(optarg); break;
+        case 'a': advanced_ok = true; break;
+        case 'P': planner_only = true; break;
+        case 't': use_pty = true; break;
+        case 'w': lost_line = atoll(optarg); break;
+        default: return usage(argv[0]);
+        }
+    }
+    if (optind >= argc) return usage(argv[0]);
+
+    std::vector<std::string> args(argv + optind, argv + argc);
+    int machine_fd;
+    int sender_fd;
+    int keep_open_fd = -1;
+    if (use_pty) {
+        machine_fd = posix_openpt(O_RDWR | O_NOCTTY);
+        if (machine_fd < 0 || grantpt(machine_fd) < 0 ||
+            unlockpt(machine_fd) < 0) {
+            perror("pty");
+            return 1;
+        }
+        // Raw terminal, so that the line discipline does not interfere.
+        struct termios tio;
+        tcgetattr(machine_fd, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(machine_fd, TCSANOW, &tio);
+        for (std::string &arg : args) {
+            if (!arg.empty() && arg[0] == '@') {
+                arg = ptsname(machine_fd) + arg.substr(1);  // '@,b115200'
+            }
+        }
+        // Keep the terminal open ourselves, so that there is no hangup
+        // before the sender opened it or after it closed it.
+        keep_open_fd = open(ptsname(machine_fd), O_RDWR | O_NOCTTY);
+        sender_fd = -1;
+    } else {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+            perror("socketpair");
+            return 1;
+        }
+        // Small socket buffers: bytes should queue up in the sender.
+        const int buffer_size = 4096;
+        setsockopt(fds[0], SOL_SOCKET, SO_RCVBUF, &buffer_size,
+                   sizeof(buffer_size));
+        setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &buffer_size,
+                   sizeof(buffer_size));
+        machine_fd = fds[0];
+        sender_fd = fds[1];
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    const pid_t sender = fork();
+    if (sender == 0) {
+        if (sender_fd >= 0) {
+            dup2(sender_fd, STDIN_FILENO);
+            dup2(sender_fd, STDOUT_FILENO);
+            close(sender_fd);
+        }
+        close(machine_fd);
+        if (keep_open_fd >= 0) close(keep_open_fd);
+        std::vector<char *> exec_args;
+        for (std::string &arg : args) exec_args.push_back(&arg[0]);
+        exec_args.push_back(nullptr);
+        execvp(exec_args[0], exec_args.data());
+        perror(exec_args[0]);
+        _exit(127);
+    }
+    if (sender_fd >= 0) close(sender_fd);
+
+    // Greeting as a freshly reset machine would.
+    const char kGreeting[] = "start\n";
+    if (write(machine_fd, kGreeting, strlen(kGreeting)) < 0) return 1;
+
+    std::string rx;                // Receive buffer.
+    std::deque<size_t> line_ends;  // Complete lines in the receive buffer.
+    size_t rx_max = 0;
+    uint64_t overflow_bytes = 0;
+    uint64_t lines = 0;
+    int64_t received_bytes = 0;     // Bytes taken, for the baud throttle.
+    int64_t first_byte_time = 0;    // Start of throttle and statistics.
+    int64_t last_ok_time = 0;
+    int64_t last_output_time = NowMicros();
+    int64_t processing_done = -1;   // Time the current line is done.
+    std::string out;
+    char buffer[4096];
+    bool sender_open = true;
+    int status = 0;
+
+    while (sender_open || !line_ends.empty()) {
+        if (sender_open && waitpid(sender, &status, WNOHANG) == sender) {
+            sender_open = false;  // Done; no one waits for the rest anymore.
+            break;
+        }
+        const int64_t now = NowMicros();
+
+        // Finish processing the oldest line.
+        if (processing_done >= 0 && now >= processing_done) {
+            const size_t len = line_ends.front() + 1;
+            rx.erase(0, len);
+            line_ends.pop_front();
+            for (size_t &end : line_ends) end -= len;
+            ++lines;
+            if (lines == lost_line) {
+                // Gone; as if it never arrived.
+            } else if (advanced_ok) {
+                // The planner is not simulated; always reported with room.
+                // Without a limit of lines, the free bytes are taken as
+                // lines of typical length.
+                int free_slots = kReportedFreeSlots;
+                if (rx_lines) {
+                    free_slots = rx_lines - line_ends.size();
+                } else if (rx_bytes) {
+                    free_slots = (rx_bytes - rx.size()) / kTypicalLineLength;
+                }
+                if (planner_only) {
+                    snprintf(buffer, sizeof(buffer), "ok P%d\n",
+                             kReportedFreeSlots);
+                } else {
+                    snprintf(buffer, sizeof(buffer), "ok P%d B%d\n",
+                             kReportedFreeSlots, free_slots);
+                }
+                out.append(buffer);
+            } else {
+                out.append("ok\n");
+            }
+            processing_done = -1;
+            last_ok_time = last_output_time = now;
+        }
+        if (lost_line && line_ends.empty() &&
+            now - last_output_time >= kIdleWaitMicros) {
+            out.append("wait\n");
+            last_output_time = now;
+        }
+        if (processing_done < 0 && !line_ends.empty()) {
+            processing_done = now + latency_us;
+        }
+        if (!out.empty()) {
+            const ssize_t w = write(machine_fd, out.data(), out.size());
+            if (w > 0) out.erase(0, w);
+        }
+
+        // How much we may receive now with the bit rate.
+        size_t allowed = (baud > 0) ? 1 : sizeof(buffer);
+        int64_t wait_us = (processing_done >= 0) ? processing_done - now : -1;
+        if (baud > 0 && first_byte_time > 0) {
+            const int64_t budget =
+                (now - first_byte_time) * baud / 10 / 1000000 - received_bytes;
+            allowed = std::clamp<int64_t>(budget, 0, sizeof(buffer));
+            if (allowed == 0) {
+                const int64_t next_byte = 10 * 1000000 / baud + 1;
+                wait_us = (wait_us < 0) ? next_byte : std::min(wait_us,
+                                                               next_byte);
+            }
+        }
+
+        struct pollfd pfd = {machine_fd, 0, 0};
+        if (sender_open && allowed > 0) pfd.events |= POLLIN;
+        if (!out.empty()) pfd.events |= POLLOUT;
+        if (wait_us < 0) wait_us = 100000;  // Check for exit of sender.
+        const struct timespec timeout = {(time_t)(wait_us / 1000000),
+                                         (long)(wait_us % 1000000) * 1000};
+        if (ppoll(&pfd, 1, &timeout, nullptr) < 0) break;
+        if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        if (!sender_open) continue;
+
+        const ssize_t r = read(machine_fd, buffer, allowed);
+        if (r <= 0) {
+            sender_open = false;  // Closed its end of the connection.
+            continue;
+        }
+        if (first_byte_time == 0) first_byte_time = NowMicros();
+        received_bytes += r;
+        for (ssize_t i = 0; i < r; ++i) {
+            const bool full = (rx_bytes && rx.size() >= rx_bytes) ||
+                              (rx_lines && line_ends.size() >= rx_lines);
+            if (full) {
+                ++overflow_bytes;
+                continue;
+            }
+            rx.push_back(buffer[i]);
+            if (buffer[i] == '\n') line_ends.push_back(rx.size() - 1);
+        }
+        rx_max = std::max(rx_max, rx.size());
+    }
+
+    if (sender_open || waitpid(sender, &status, WNOHANG) == 0) {
+        waitpid(sender, &status, 0);
+    }
+    const double seconds = (last_ok_time - first_byte_time) / 1e6;
+    fprintf(stderr,
+            "mock-machine: %llu lines in %.3fs: %.0f blocks/s; receive buffer "
+            "max %zu bytes, %llu bytes overflow\n",
+            (unsigned long long)lines, seconds,
+            seconds > 0 ? lines / seconds : 0.0, rx_max,
+            (unsigned long long)overflow_bytes);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,95 @@
+#!/bin/sh
+# Checks of what gcode-cli sends in corner cases that are easy to break:
+# the blocks of dry-runs are compared with the expected ones, and the
+# behavior with misbehaving simulated machines is checked. Exits non-zero if
+# any check fails.
+#
+# Usage: streaming-check.sh [<gcode-cli> [<mock-machine>]]
+
+GCODE_CLI=${1:-./gcode-cli}
+MOCK=${2:-bench/mock-machine}
+
+JOB=$(mktemp /tmp/streaming-check-XXXXXX)
+trap 'rm -f "$JOB"' EXIT
+failed=0
+
+# Check label, gcode-cli options; the job is on stdin, the blocks expected
+# in the dry-run in the file $JOB.expected.
+check_blocks() {
+    label="$1"; cli_opts="$2"
+    cat > "$JOB"
+    printf '%-50s ' "$label"
+    if $GCODE_CLI -n $cli_opts "$JOB" 2>&1 >/dev/null |
+           sed -n 's/^ *[0-9][0-9]*	\(.*[^ ]\) *$/\1/p' |
+           diff -u "$JOB.expected" - > "$JOB.diff"; then
+        echo "ok"
+    else
+        echo "FAILED"
+        cat "$JOB.diff"
+        failed=1
+    fi
+    rm -f "$JOB.expected" "$JOB.diff"
+}
+
+# After a linearized arc, the machine is in G1: modal arcs get their G2
+# spelled out, blocks with other commands are sent unchanged.
+cat > "$JOB.expected" <<'BLOCKS'
+G90
+G92 X0 Y0 E0
+G1 F1000
+G1 X2.5 Y4.3301
+G1 X7.5 Y4.3301
+G1 X10 Y0
+G92 E0
+G1 X7.5 Y-4.3301
+G1 X2.5 Y-4.3301
+G1 X0 Y0
+G28 X0
+M92 X80
+G2 X10 Y0 I5 J0
+BLOCKS
+check_blocks "--arc-tolerance: commands after an arc" \
+             "--arc-tolerance=1" <<'JOB'
+G90
+G92 X0 Y0 E0
+G1 F1000
+G2 X10 Y0 I5 J0
+G92 E0
+X0 Y0 I-5 J0
+G28 X0
+M92 X80
+X10 Y0 I5 J0
+JOB
+
+# Check label, mock-machine options, gcode-cli options, the exit code
+# expected and a message expected in the output. The job is on stdin.
+check_run() {
+    label="$1"; mock_opts="$2"; cli_opts="$3"; code="$4"; message="$5"
+    cat > "$JOB"
+    printf '%-50s ' "$label"
+    output=$($MOCK $mock_opts -- $GCODE_CLI -q -s 0 $cli_opts "$JOB" - 2>&1)
+    rc=$?
+    if [ "$rc" = "$code" ] && echo "$output" | grep -qF -- "$message"; then
+        echo "ok"
+    else
+        echo "FAILED (exit code $rc)"
+        echo "$output"
+        failed=1
+    fi
+}
+
+# Marlin says 'wait' every second while idle, also when a block got lost:
+# not a sign of a busy machine, so the ack timeout still expires. The stall
+# timeout is the fallback if it does not.
+awk 'BEGIN { for (i = 0; i < 20; ++i) printf("G1 X%d F3000\n", i) }' |
+    check_run "--ack-timeout: lost block, machine says 'wait'" "-w 5" \
+              "--ack-timeout=2 --stall-timeout=8" 3 "(No 'ok' in time)"
+
+# Without the free slots of the receive buffer in the 'ok', -A has nothing
+# to learn the buffer size from and keeps to the -b window (default 1); the
+# free planner slots say nothing about the receive buffer.
+awk 'BEGIN { for (i = 0; i < 200; ++i) printf("G1 X%d F3000\n", i) }' |
+    check_run "-A: only planner slots reported, window stays" "-a -P -s 4" \
+              "-A --stall-timeout=5" 0 " 0 bytes overflow"
+
+exit $failed
@@ -0,0 +1,91 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+// Microbenchmark of MachineConnection::WriteBlocks() with various numbers
+// of blocks per call, writing into a socketpair drained by another thread.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "machine-connection.h"
+
+static constexpr int kBlocks = 1000000;
+static constexpr int kRepetitions = 3;  // Best of these.
+
+static double NowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main() {
+    // MachineConnection talks to the machine through stdin/stdout with the
+    // connection string '-'; keep the real stdout for the results.
+    FILE *const results = fdopen(dup(STDOUT_FILENO), "w");
+    const int null_fd = open("/dev/null", O_RDWR);
+    setvbuf(results, nullptr, _IOLBF, 0);
+
+    std::vector<std::string> blocks;
+    for (int i = 0; i < 256; ++i) {
+        blocks.push_back("G1 X" + std::to_string(i % 200) + ".125 Y" +
+                         std::to_string(i * 7 % 200) + ".5 F3000\n");
+    }
+
+    fprintf(results, "MachineConnection::WriteBlocks()\n");
+    for (const size_t per_call : {1, 8, 64, 256}) {
+        double best = 1e9;
+        size_t bytes = 0;
+        for (int r = 0; r < kRepetitions; ++r) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+                perror("socketpair");
+                return 1;
+            }
+            dup2(fds[0], STDIN_FILENO);
+            dup2(fds[0], STDOUT_FILENO);
+            close(fds[0]);
+            std::thread drain([fd = fds[1]]() {
+                char buffer[65536];
+                while (read(fd, buffer, sizeof(buffer)) > 0) {
+                }
+                close(fd);
+            });
+
+            std::unique_ptr<MachineConnection> machine(
+                MachineConnection::Open("-"));
+            std::vector<std::string_view> batch;
+            bytes = 0;
+            const double start = NowSeconds();
+            for (int sent = 0; sent < kBlocks; sent += per_call) {
+                batch.clear();
+                for (size_t i = 0; i < per_call; ++i) {
+                    batch.push_back(blocks[(sent + i) % blocks.size()]);
+                    bytes += batch.back().size();
+                }
+                machine->WriteBlocks(batch);
+            }
+            machine->Flush(-1);
+            best = std::min(best, NowSeconds() - start);
+            // Park stdin/stdout on /dev/null, so that the drain sees the end
+            // and the next socketpair does not land on them.
+            machine.reset();
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDIN_FILENO);
+            drain.join();
+        }
+        fprintf(results, "%3zu blocks per call %8.2f Mblocks/s %8.1f MB/s\n",
+                per_call, kBlocks / best / 1e6, bytes / best / 1e6);
+    }
+}
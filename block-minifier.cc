@@ -0,0 +1,246 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "block-minifier.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+static constexpr int64_t kScale = WordTable::kValueScale;
+
+static bool IsCode(int64_t value, int code) { return value == code * kScale; }
+static bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+static bool IsAxis(char letter) {
+    return letter != WordTable::kRawText && strchr("XYZABCUVWE", letter);
+}
+
+// M-codes that don't change positions or the meaning of coordinates.
+static bool IsHarmlessMCode(int64_t value) {
+    static constexpr int kCodes[] = {3,   4,   5,   7,   8,   9,   73,
+                                     104, 105, 106, 107, 109, 117, 140,
+                                     190, 204, 205, 220, 221, 400};
+    for (int code : kCodes) {
+        if (IsCode(value, code)) return true;
+    }
+    return false;
+}
+
+// Number "text" as in the source without redundant sign and zeros: the
+// exact same value, also beyond the precision of the parsed value.
+static void AppendShortNumber(std::string_view text, std::string *out) {
+    size_t p = 0;
+    const bool negative = (p < text.size() && text[p] == '-');
+    if (p < text.size() && (text[p] == '-' || text[p] == '+')) ++p;
+    size_t int_start = p;
+    while (p < text.size() && IsDigit(text[p])) ++p;
+    size_t int_end = p;
+    size_t frac_start = p, frac_end = p;
+    if (p < text.size() && text[p] == '.') {
+        frac_start = ++p;
+        while (p < text.size() && IsDigit(text[p])) ++p;
+        frac_end = p;
+    }
+    if (p != text.size()) {  // Not a plain number; leave it.
+        out->append(text);
+        return;
+    }
+    while (int_start < int_end && text[int_start] == '0') ++int_start;
+    while (frac_end > frac_start && text[frac_end - 1] == '0') --frac_end;
+    if (int_start == int_end && frac_start == frac_end) {
+        out->push_back('0');  // Also -0.
+        return;
+    }
+    if (negative) out->push_back('-');
+    out->append(text.substr(int_start, int_end - int_start));
+    if (frac_start < frac_end) {
+        out->push_back('.');
+        out->append(text.substr(frac_start, frac_end - frac_start));
+    }
+}
+
+BlockMinifier::BlockMinifier(const Options &options) : options_(options) {
+    ForgetPositions();
+}
+
+void BlockMinifier::ForgetPositions() {
+    std::fill(known_, known_ + 26, false);
+}
+
+void BlockMinifier::Process(const std::string_view *lines, size_t count,
+                            const WordTable *words) {
+    if (!words || words->block_count() != count) {
+        own_words_.Clear();
+        for (size_t i = 0; i < count; ++i) own_words_.Add(lines[i]);
+        words = &own_words_;
+    }
+    out_.resize(count);
+    arena_offset_.resize(count);
+    arena_.clear();
+    for (size_t b = 0; b < count; ++b) {
+        if (Minify(*words, b)) {
+            arena_offset_[b] = arena_.size();
+            out_[b] = std::string_view(nullptr, scratch_.size());
+            arena_.append(scratch_);
+        } else {
+            arena_offset_[b] = std::string::npos;
+            out_[b] = lines[b];
+        }
+        UpdateState(*words, b);
+    }
+    // Now that arena_ does not grow anymore.
+    for (size_t b = 0; b < count; ++b) {
+        if (arena_offset_[b] == std::string::npos) continue;
+        out_[b] = std::string_view(arena_.data() + arena_offset_[b],
+                                   out_[b].size());
+    }
+}
+
+bool BlockMinifier::Minify(const WordTable &words, size_t b) {
+    const std::string_view text = words.block_text(b);
+    if (text.find_first_of("(;") != std::string_view::npos) return false;
+
+    const size_t first = words.first_word(b);
+    const size_t end = words.first_word(b + 1);
+    if (first == end) return false;
+    int g_words = 0;
+    size_t motion_word = end;
+    for (size_t w = first; w < end; ++w) {
+        const char letter = words.letter(w);
+        if (letter == WordTable::kRawText || letter == 'M' || letter == 'T' ||
+            letter == 'N' || letter == 'O') {
+            return false;
+        }
+        if (letter != 'G') continue;
+        ++g_words;
+        const int64_t v = words.value(w);
+        if (v >= 0 && v <= 3 * kScale && v % kScale == 0) motion_word = w;
+    }
+
+    // Words are only redundant in a plain move without other G-codes that
+    // change their meaning.
+    const bool plain = (g_words == 0 || (g_words == 1 && motion_word != end));
+    const int motion =
+        (motion_word != end) ? words.value(motion_word) / kScale : motion_;
+    drop_.assign(end - first, false);
+    bool any_axis = false, any_axis_kept = false;
+    for (size_t w = first; w < end; ++w) {
+        if (!plain) break;
+        const char letter = words.letter(w);
+        const int64_t v = words.value(w);
+        bool drop = false;
+        if (w == motion_word) {
+            drop = options_.modal_motion && motion == motion_;
+        } else if (letter == 'F') {
+            drop = feed_per_minute_ && motion >= 0 &&
+                   feed_[motion == 0 ? 0 : 1] == v;
+        } else if (IsAxis(letter)) {
+            any_axis = true;
+            const bool absolute = absolute_ && !(letter == 'E' && relative_e_);
+            drop = absolute && (motion == 0 || motion == 1) &&
+                   known_[letter - 'A'] && pos_[letter - 'A'] == v;
+            any_axis_kept |= !drop;
+        }
+        drop_[w - first] = drop;
+    }
+    // A move needs an axis word left, and the block a word at all.
+    if (any_axis && !any_axis_kept) {
+        for (size_t w = first; w < end; ++w) {
+            if (IsAxis(words.letter(w))) {
+                drop_[w - first] = false;
+                break;
+            }
+        }
+    }
+    if (std::find(drop_.begin(), drop_.end(), false) == drop_.end()) {
+        drop_[0] = false;
+    }
+
+    scratch_.clear();
+    for (size_t w = first; w < end; ++w) {
+        if (drop_[w - first]) continue;
+        const std::string_view word = words.word_text(b, w);
+        size_t p = 1;  // Number after the letter and blanks.
+        while (p < word.size() && (word[p] == ' ' || word[p] == '\t')) ++p;
+        scratch_.push_back(words.letter(w));
+        AppendShortNumber(word.substr(p), &scratch_);
+    }
+    if (text.back() == '\n') scratch_.push_back('\n');
+    return scratch_.size() < text.size();
+}
+
+void BlockMinifier::UpdateState(const WordTable &words, size_t b) {
+    bool set_position = false;
+    bool forget = false;
+    const size_t end = words.first_word(b + 1);
+    for (size_t w = words.first_word(b); w < end; ++w) {
+        const char letter = words.letter(w);
+        const int64_t v = words.value(w);
+        if (letter == WordTable::kRawText || letter == 'T') {
+            forget = true;  // Expressions, tool offsets...
+        } else if (letter == 'M') {
+            if (IsCode(v, 82)) {
+                relative_e_ = false;
+            } else if (IsCode(v, 83)) {
+                relative_e_ = true;
+            } else if (!IsHarmlessMCode(v)) {
+                forget = true;
+            }
+        } else if (letter == 'G') {
+            if (v >= 0 && v <= 3 * kScale && v % kScale == 0) {
+                motion_ = v / kScale;
+            } else if (IsCode(v, 90) || IsCode(v, 91)) {
+                absolute_ = IsCode(v, 90);
+            } else if (IsCode(v, 93) || IsCode(v, 94)) {
+                feed_per_minute_ = IsCode(v, 94);
+                feed_[0] = feed_[1] = -1;
+            } else if (IsCode(v, 20) || IsCode(v, 21)) {
+                // Same numbers, different units.
+                feed_[0] = feed_[1] = -1;
+                forget = true;
+            } else if (IsCode(v, 92)) {
+                set_position = true;
+            } else if (IsCode(v, 4) || IsCode(v, 17) || IsCode(v, 18) ||
+                       IsCode(v, 19) || IsCode(v, 40) || IsCode(v, 49) ||
+                       IsCode(v, 61) || IsCode(v, 64)) {
+                // Doesn't change positions or motion.
+            } else {
+                // Homing, probing, canned cycles, coordinate systems...
+                motion_ = -1;
+                forget = true;
+            }
+        }
+    }
+
+    bool any_axis = false;
+    for (size_t w = words.first_word(b); w < end; ++w) {
+        const char letter = words.letter(w);
+        const int64_t v = words.value(w);
+        if (letter == 'F') {
+            if (motion_ < 0) {
+                feed_[0] = feed_[1] = -1;
+            } else {
+                // Some controllers share the feed of G0 and G1.
+                const int slot = (motion_ == 0) ? 0 : 1;
+                feed_[slot] = v;
+                feed_[1 - slot] = -1;
+            }
+        }
+        if (!IsAxis(letter)) continue;
+        any_axis = true;
+        const int axis = letter - 'A';
+        if (set_position) {
+            pos_[axis] = v;
+            known_[axis] = true;
+        } else if (motion_ < 0) {
+            known_[axis] = false;
+        } else if (absolute_ && !(letter == 'E' && relative_e_)) {
+            pos_[axis] = v;
+            known_[axis] = true;
+        } else {
+            pos_[axis] += v;
+        }
+    }
+    if (forget || (set_position && !any_axis)) ForgetPositions();
+}
@@ -0,0 +1,76 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#ifndef BLOCK_MINIFIER_H
+#define BLOCK_MINIFIER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "gcode-words.h"
+
+// Shortens blocks to the fewest bytes with the same meaning, as on a slow
+// serial link, every byte costs:
+//
+//  - No whitespace between words and numbers without redundant zeros or
+//    sign: "G01 X10.5000 Y-0.50" becomes "G1X10.5Y-.5".
+//  - F words that don't change the feed are dropped.
+//  - Axis words of G0/G1 moves in absolute mode that don't change the
+//    position are dropped.
+//  - With "modal_motion", also G0..G3 words that are already the modal
+//    motion; only for controllers that support that (Grbl, LinuxCNC; Marlin
+//    only with GCODE_MOTION_MODES).
+//
+// Only plain motion and parameter blocks are minified; blocks with M or T
+// words, comments, checksums or text are sent as they are, but their
+// effect on the modal state is followed. Always one block out per block in.
+class BlockMinifier {
+   public:
+    struct Options {
+        bool modal_motion = false;  // Drop repeated G0..G3.
+    };
+
+    explicit BlockMinifier(const Options &options);
+
+    // Minify "count" blocks "lines". "words" are their parsed words if
+    // available, otherwise they are parsed here. The blocks out are
+    // accessed with text(); valid until the next call.
+    void Process(const std::string_view *lines, size_t count,
+                 const WordTable *words);
+
+    std::string_view text(size_t i) const { return out_[i]; }
+
+   private:
+    // Minified text of block "b" into scratch_; false to keep it as is.
+    bool Minify(const WordTable &words, size_t b);
+
+    // Follow the modal state through block "b".
+    void UpdateState(const WordTable &words, size_t b);
+
+    void ForgetPositions();
+
+    const Options options_;
+    WordTable own_words_;  // If not given parsed words.
+
+    // Modal state; the same for source and machine as the meaning is kept.
+    int motion_ = -1;              // G0..G3; -1: unknown.
+    bool absolute_ = true;         // G90
+    bool relative_e_ = false;      // M83
+    bool feed_per_minute_ = true;  // G94; not G93 inverse time.
+    int64_t feed_[2] = {-1, -1};   // Of G0 and G1..G3 moves; -1: unknown.
+    int64_t pos_[26];              // By axis letter...
+    bool known_[26];               // ...if known.
+
+    std::vector<std::string_view> out_;
+    std::vector<size_t> arena_offset_;  // Of minified out_; npos: as is.
+    std::string arena_;
+    std::string scratch_;
+    std::vector<char> drop_;  // Words of the block to leave out.
+};
+
+#endif  // BLOCK_MINIFIER_H
@@ -0,0 +1,55 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "block-ring.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <thread>
+
+static size_t RoundUpPowerOfTwo(size_t n) {
+    size_t result = 1;
+    while (result < n) result <<= 1;
+    return result;
+}
+
+// Typical gcode blocks fit; longer ones allocate once when first seen.
+static constexpr size_t kInitialBlockCapacity = 64;
+
+BlockRing::BlockRing(size_t capacity)
+    : mask_(RoundUpPowerOfTwo(capacity) - 1), slots_(mask_ + 1) {
+    // Allocate upfront, not while streaming.
+    for (Block &slot : slots_) slot.copy.reserve(kInitialBlockCapacity);
+}
+
+bool BlockRing::Push(int line_no, uint64_t position, std::string_view text,
+                     bool stable) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) > mask_) {
+        return false;  // full
+    }
+    Block &slot = slots_[head & mask_];
+    slot.line_no = line_no;
+    slot.position = position;
+    if (stable) {
+        slot.text = text;
+    } else {
+        slot.copy.assign(text.data(), text.size());
+        slot.text = slot.copy;
+    }
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+void BlockRing::Close() { closed_.store(true, std::memory_order_release); }
+
+void BackoffWait(int *round) {
+    if (*round < 16) {
+        std::this_thread::yield();
+    } else {
+        usleep(std::min(*round, 500));
+    }
+    ++*round;
+}
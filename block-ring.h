@@ -0,0 +1,89 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#ifndef BLOCK_RING_H
+#define BLOCK_RING_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A gcode block as handed from the reading side to the sending side.
+struct Block {
+    int line_no = 0;        // Running number of the block in the input.
+    uint64_t position = 0;  // Input position after it (BlockSource::Seek())
+    std::string_view text;  // Block text including the terminating newline.
+    std::string copy;       // Of the text, unless it stays valid by itself.
+};
+
+// Bounded lock-free single-producer single-consumer queue of gcode blocks.
+//
+// The producer thread Push()es blocks it reads from the input. The consumer
+// (the thread talking to the machine) looks at the oldest blocks with at()
+// and only releases them with PopFront() once they are acknowledged. So
+// blocks that are sent but not acknowledged yet still live in the ring.
+//
+// Slots are re-used and pre-allocated for typical block lengths, so there are
+// no allocations in the steady state. Blocks straight out of a memory mapped
+// input are not copied at all: they are written from the mapping.
+class BlockRing {
+   public:
+    // Capacity is rounded up to the next power of two.
+    explicit BlockRing(size_t capacity);
+
+    // -- Producer side.
+
+    // Copy block into the ring, or with "stable" text that outlives the
+    // ring, only keep the view. Returns false if the ring is full.
+    bool Push(int line_no, uint64_t position, std::string_view text,
+              bool stable = false);
+
+    // Signal that no more blocks will be pushed.
+    void Close();
+
+    // -- Consumer side.
+
+    // Number of blocks currently available to the consumer.
+    size_t size() const {
+        return head_.load(std::memory_order_acquire) -
+               tail_.load(std::memory_order_relaxed);
+    }
+
+    // The i-th oldest block. Requires i < size().
+    const Block &at(size_t i) const {
+        return slots_[(tail_.load(std::memory_order_relaxed) + i) & mask_];
+    }
+
+    // Release the oldest block, so that its slot can be re-used.
+    void PopFront() {
+        tail_.store(tail_.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_release);
+    }
+
+    // Returns true if the producer is finished and all blocks are consumed.
+    bool at_end() const {
+        return closed_.load(std::memory_order_acquire) && size() == 0;
+    }
+
+    size_t capacity() const { return slots_.size(); }
+
+   private:
+    const size_t mask_;
+    std::vector<Block> slots_;
+
+    // Keep indices written by producer and consumer on separate cache lines.
+    alignas(64) std::atomic<size_t> head_{0};  // Written by producer.
+    alignas(64) std::atomic<size_t> tail_{0};  // Written by consumer.
+    std::atomic<bool> closed_{false};
+};
+
+// Wait a little while for the other side of the ring to make progress.
+// Starts with just yielding, then backs off to short sleeps with increasing
+// "round", which the caller resets to zero once there was progress.
+void BackoffWait(int *round);
+
+#endif  // BLOCK_RING_H
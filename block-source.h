@@ -0,0 +1,40 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#ifndef BLOCK_SOURCE_H
+#define BLOCK_SOURCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string_view>
+
+// A source of preprocessed gcode blocks, each terminated by exactly one
+// newline.
+class BlockSource {
+   public:
+    virtual ~BlockSource() {}
+
+    // Fill the caller-owned array "lines", which has space for at least
+    // "n" elements, with the next blocks. Might return less than "n".
+    // Returns the number of blocks read.
+    // Invalidates string_views returned by previous calls.
+    // If "positions" is given, it is filled with the position in the input
+    // after each block, to continue after it with Seek().
+    virtual size_t ReadNextLines(std::string_view *lines, size_t n,
+                                 uint64_t *positions = nullptr) = 0;
+
+    // Continue reading at "position" as reported by ReadNextLines(). Only
+    // valid before anything is read. Returns false if that is not possible.
+    virtual bool Seek(uint64_t position) = 0;
+
+    // Return if the full input has been processed.
+    virtual bool is_eof() const = 0;
+
+    // If true, the blocks returned stay valid as long as the source lives,
+    // as with memory mapped input, so they can be kept without a copy.
+    virtual bool blocks_stay_valid() const { return false; }
+};
+
+#endif  // BLOCK_SOURCE_H
@@ -0,0 +1,532 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "block-transform.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+// Longest run of coalesced moves; each new one is checked against all.
+static constexpr int kMaxCoalesced = 32;
+
+// Upper limit of segments of one arc.
+static constexpr int kMaxArcSegments = 1000;
+
+// Extrusion of coalesced moves has to be proportional to the length
+// within this fraction, plus the rounding of the source.
+static constexpr double kExtrusionTolerance = 0.02;
+static constexpr double kExtrusionRounding = 1e-5;
+
+static constexpr int64_t kScale = WordTable::kValueScale;
+
+static bool IsCode(int64_t value, int code) { return value == code * kScale; }
+
+// Exact decimal text of a fixed-point value, without trailing zeros.
+static void AppendFixed(int64_t value, std::string *out) {
+    char buffer[32];
+    const uint64_t magnitude = (value < 0) ? -(uint64_t)value : value;
+    int len = snprintf(buffer, sizeof(buffer), "%s%llu", value < 0 ? "-" : "",
+                       (unsigned long long)(magnitude / kScale));
+    uint64_t fraction = magnitude % kScale;
+    if (fraction) {
+        int digits = 6;
+        while (fraction % 10 == 0) {
+            fraction /= 10;
+            --digits;
+        }
+        len += snprintf(buffer + len, sizeof(buffer) - len, ".%0*llu", digits,
+                        (unsigned long long)fraction);
+    }
+    out->append(buffer, len);
+}
+
+// Decimal text of a computed value with "digits" fraction digits at most.
+static void AppendNumber(double value, int digits, std::string *out) {
+    const double scale = pow(10, 6 - digits);
+    AppendFixed((int64_t)llround(value * kScale / scale) * (int64_t)scale,
+                out);
+}
+
+static int AxisOf(char letter) {
+    switch (letter) {
+    case 'X': return 0;
+    case 'Y': return 1;
+    case 'Z': return 2;
+    case 'E': return 3;
+    default: return -1;
+    }
+}
+
+// Are the "points" (XYZ triples) between "start" and "end" within
+// "tolerance" of the straight line and in order along it ?
+static bool Collinear(const double *start, const std::vector<double> &points,
+                      const double *end, double tolerance) {
+    double u[3];
+    double length = 0;
+    for (int a = 0; a < 3; ++a) {
+        u[a] = end[a] - start[a];
+        length += u[a] * u[a];
+    }
+    length = sqrt(length);
+    if (length == 0) return false;
+    for (double &c : u) c /= length;
+    double previous = 0;
+    for (size_t i = 0; i < points.size(); i += 3) {
+        double d[3], along = 0;
+        for (int a = 0; a < 3; ++a) {
+            d[a] = points[i + a] - start[a];
+            along += d[a] * u[a];
+        }
+        if (along < previous - tolerance || along > length + tolerance) {
+            return false;  // Going back and forth.
+        }
+        double off = 0;
+        for (int a = 0; a < 3; ++a) {
+            const double c = d[a] - along * u[a];
+            off += c * c;
+        }
+        if (off > tolerance * tolerance) return false;
+        previous = along;
+    }
+    return true;
+}
+
+BlockTransform::BlockTransform(const Options &options,
+                               uint64_t start_position)
+    : options_(options), last_position_(start_position) {}
+
+size_t BlockTransform::Process(const std::string_view *lines,
+                               const uint64_t *positions, size_t count,
+                               int first_line_no, const WordTable *words) {
+    out_.clear();
+    arena_.clear();
+    if (!words || words->block_count() != count) {
+        own_words_.Clear();
+        for (size_t i = 0; i < count; ++i) own_words_.Add(lines[i]);
+        words = &own_words_;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        HandleBlock(*words, i, first_line_no + i, positions[i]);
+        last_position_ = positions[i];
+    }
+    // The source text of a held back block is gone with the next batch.
+    if (run_.active && run_.blocks == 1 &&
+        run_.first_text.data() != held_text_.data()) {
+        held_text_.assign(run_.first_text);
+        run_.first_text = held_text_;
+    }
+    return ResolveOutput();
+}
+
+size_t BlockTransform::Finish() {
+    out_.clear();
+    arena_.clear();
+    EmitRun();
+    return ResolveOutput();
+}
+
+size_t BlockTransform::ResolveOutput() {
+    for (Out &out : out_) {
+        if (out.generated) {
+            out.text = std::string_view(arena_.data() + out.arena_offset,
+                                        out.text.size());
+        }
+    }
+    return out_.size();
+}
+
+void BlockTransform::Emit(std::string_view text, int line_no,
+                          uint64_t position) {
+    out_.push_back({text, false, 0, line_no, position});
+}
+
+void BlockTransform::EmitGenerated(std::string_view text, int line_no,
+                                   uint64_t position) {
+    out_.push_back({std::string_view(nullptr, text.size()), true,
+                    arena_.size(), line_no, position});
+    arena_.append(text);
+}
+
+void BlockTransform::HandleBlock(const WordTable &words, size_t b,
+                                 int line_no, uint64_t position) {
+    if (Coalesce(words, b, line_no, position)) {
+        UpdateState(words, b);
+        machine_motion_ = 1;
+        return;
+    }
+    EmitRun();
+    if (Linearize(words, b, line_no, position)) {
+        UpdateState(words, b);
+        machine_motion_ = 1;
+        return;
+    }
+
+    // Pass through. After linearized arcs, the machine is in G1; moves
+    // relying on the modal arc need it spelled out. Not so blocks with
+    // another command (G92 E0, G28 X0, M92 X80...), whose axis words
+    // belong to that command: Marlin only runs the first G-code of a
+    // line, and Grbl rejects two commands using the axis words.
+    bool motion_word = false;
+    bool other_command = false;
+    bool move_words = false;
+    for (size_t w = words.first_word(b); w < words.first_word(b + 1); ++w) {
+        const char letter = words.letter(w);
+        if (letter == 'G' && words.value(w) >= 0 &&
+            words.value(w) <= 3 * kScale) {
+            motion_word = true;
+        } else if (letter == 'G' || letter == 'M') {
+            other_command = true;
+        }
+        if (AxisOf(letter) >= 0 || letter == 'I' || letter == 'J' ||
+            letter == 'R') {
+            move_words = true;
+        }
+    }
+    UpdateState(words, b);
+    if (move_words && !motion_word && !other_command &&
+        machine_motion_ != motion_ && motion_ >= 0) {
+        scratch_.assign("G");
+        scratch_.push_back('0' + motion_);
+        scratch_.push_back(' ');
+        scratch_.append(words.block_text(b));
+        EmitGenerated(scratch_, line_no, position);
+        machine_motion_ = motion_;
+    } else {
+        Emit(words.block_text(b), line_no, position);
+        // Unchanged unless the block sets the motion mode (or makes it
+        // unknown).
+        if (motion_word || motion_ < 0) machine_motion_ = motion_;
+    }
+}
+
+bool BlockTransform::Coalesce(const WordTable &words, size_t b, int line_no,
+                              uint64_t position) {
+    if (options_.coalesce_tolerance <= 0 || !absolute_) return false;
+
+    // Only plain G1 moves: G1 or modal G1, axis words and feed.
+    bool has[kAxes] = {false, false, false, false};
+    int64_t value[kAxes];
+    bool explicit_g1 = false;
+    int64_t feed = feed_;
+    bool has_feed = false;
+    for (size_t w = words.first_word(b); w < words.first_word(b + 1); ++w) {
+        const char letter = words.letter(w);
+        const int axis = AxisOf(letter);
+        if (axis >= 0) {
+            if (has[axis]) return false;
+            has[axis] = true;
+            value[axis] = words.value(w);
+        } else if (letter == 'G' && IsCode(words.value(w), 1) &&
+                   !explicit_g1) {
+            explicit_g1 = true;
+        } else if (letter == 'F' && !has_feed) {
+            has_feed = true;
+            feed = words.value(w);
+        } else {
+            return false;
+        }
+    }
+    if (!explicit_g1 && motion_ != 1) return false;
+    if (!has[kX] && !has[kY] && !has[kZ]) return false;  // E.g. retract.
+    for (int a = 0; a < kAxes; ++a) {
+        if (has[a] && !known_[a] && !(a == kE && relative_e_)) return false;
+    }
+
+    double end[3];
+    double length = 0;
+    for (int a = 0; a < 3; ++a) {
+        end[a] = has[a] ? WordTable::ToDouble(value[a]) : pos_[a];
+        length += (end[a] - pos_[a]) * (end[a] - pos_[a]);
+    }
+    length = sqrt(length);
+    if (length == 0) return false;
+    const double extrusion =
+        !has[kE] ? 0
+        : relative_e_ ? WordTable::ToDouble(value[kE])
+                      : WordTable::ToDouble(value[kE]) - pos_[kE];
+
+    bool extend = run_.active && run_.blocks < kMaxCoalesced &&
+                  feed == run_.feed &&
+                  fabs(extrusion - run_.e_per_length * length) <=
+                      kExtrusionTolerance * fabs(extrusion) +
+                          kExtrusionRounding;
+    if (extend) {
+        extend = Collinear(run_.start, run_.points, end,
+                           Tolerance(options_.coalesce_tolerance));
+    }
+    if (!extend) {
+        EmitRun();
+        run_.active = true;
+        run_.blocks = 0;
+        std::copy(pos_, pos_ + 3, run_.start);
+        run_.points.clear();
+        std::fill(run_.uses, run_.uses + kAxes, false);
+        run_.relative_e = 0;
+        run_.e_per_length = extrusion / length;
+        run_.feed = feed;
+        run_.has_feed = false;
+        run_.first_text = words.block_text(b);
+    }
+    ++run_.blocks;
+    run_.points.insert(run_.points.end(), end, end + 3);
+    for (int a = 0; a < kAxes; ++a) {
+        if (!has[a]) continue;
+        run_.uses[a] = true;
+        run_.last_value[a] = value[a];
+    }
+    if (has[kE] && relative_e_) run_.relative_e += value[kE];
+    run_.has_feed |= has_feed;
+    run_.line_no = line_no;
+    run_.position = position;
+    return true;
+}
+
+void BlockTransform::EmitRun() {
+    if (!run_.active) return;
+    run_.active = false;
+    if (run_.blocks == 1) {
+        if (run_.first_text.data() == held_text_.data()) {
+            EmitGenerated(held_text_, run_.line_no, run_.position);
+        } else {
+            Emit(run_.first_text, run_.line_no, run_.position);
+        }
+        return;
+    }
+    // Only the end of the run matters, in absolute coordinates.
+    scratch_.assign("G1");
+    for (int a = 0; a < kAxes; ++a) {
+        if (!run_.uses[a]) continue;
+        scratch_.push_back(' ');
+        scratch_.push_back("XYZE"[a]);
+        AppendFixed((a == kE && relative_e_) ? run_.relative_e
+                                             : run_.last_value[a],
+                    &scratch_);
+    }
+    if (run_.has_feed) {
+        scratch_.append(" F");
+        AppendFixed(run_.feed, &scratch_);
+    }
+    scratch_.push_back('\n');
+    EmitGenerated(scratch_, run_.line_no, run_.position);
+}
+
+bool BlockTransform::Linearize(const WordTable &words, size_t b, int line_no,
+                               uint64_t position) {
+    if (options_.arc_tolerance <= 0 || !absolute_ || !xy_plane_) return false;
+
+    int motion = motion_;
+    bool has[kAxes] = {false, false, false, false};
+    int64_t value[kAxes];
+    bool has_i = false, has_j = false, has_r = false;
+    double i = 0, j = 0, r = 0;
+    int64_t feed = 0;
+    bool has_feed = false;
+    for (size_t w = words.first_word(b); w < words.first_word(b + 1); ++w) {
+        const char letter = words.letter(w);
+        const double v = WordTable::ToDouble(words.value(w));
+        const int axis = AxisOf(letter);
+        if (axis >= 0) {
+            has[axis] = true;
+            value[axis] = words.value(w);
+            continue;
+        }
+        switch (letter) {
+        case 'G':
+            if (IsCode(words.value(w), 2)) {
+                motion = 2;
+            } else if (IsCode(words.value(w), 3)) {
+                motion = 3;
+            } else {
+                return false;
+            }
+            break;
+        case 'I': has_i = true; i = v; break;
+        case 'J': has_j = true; j = v; break;
+        case 'R': has_r = true; r = v; break;
+        case 'F':
+            has_feed = true;
+            feed = words.value(w);
+            break;
+        default: return false;
+        }
+    }
+    if (motion != 2 && motion != 3) return false;
+    if (!known_[kX] || !known_[kY] || (has[kZ] && !known_[kZ]) ||
+        (has[kE] && !known_[kE] && !relative_e_)) {
+        return false;
+    }
+    const bool clockwise = (motion == 2);
+    const double sx = pos_[kX], sy = pos_[kY];
+    const double ex = has[kX] ? WordTable::ToDouble(value[kX]) : sx;
+    const double ey = has[kY] ? WordTable::ToDouble(value[kY]) : sy;
+
+    double cx, cy;
+    if (has_r) {
+        // Center on the side given by direction and sign of the radius.
+        const double dx = ex - sx, dy = ey - sy;
+        const double d = hypot(dx, dy);
+        const double h2 = 4 * r * r - d * d;
+        if (d == 0 || h2 < 0) return false;
+        double h = -sqrt(h2) / d;
+        if (!clockwise) h = -h;
+        if (r < 0) h = -h;
+        cx = sx + 0.5 * (dx - dy * h);
+        cy = sy + 0.5 * (dy + dx * h);
+    } else if (has_i || has_j) {
+        cx = sx + i;
+        cy = sy + j;
+    } else {
+        return false;
+    }
+    const double radius = hypot(sx - cx, sy - cy);
+    if (radius == 0) return false;
+    const double a0 = atan2(sy - cy, sx - cx);
+    double sweep = atan2(ey - cy, ex - cx) - a0;
+    if (clockwise && sweep > -1e-9) sweep -= 2 * M_PI;  // Same point: circle.
+    if (!clockwise && sweep < 1e-9) sweep += 2 * M_PI;
+
+    const double tolerance = Tolerance(options_.arc_tolerance);
+    const double max_angle =
+        (tolerance >= radius) ? M_PI / 2 : 2 * acos(1 - tolerance / radius);
+    const int segments = std::clamp(
+        (int)ceil(fabs(sweep) / std::min(max_angle, M_PI / 2)), 1,
+        kMaxArcSegments);
+
+    const double sz = pos_[kZ];
+    const double dz = has[kZ] ? WordTable::ToDouble(value[kZ]) - sz : 0;
+    const double se = relative_e_ ? 0 : pos_[kE];
+    const double de = !has[kE] ? 0
+                      : relative_e_ ? WordTable::ToDouble(value[kE])
+                                    : WordTable::ToDouble(value[kE]) - se;
+    double e_sent = 0;  // With relative extrusion, as rounded.
+    for (int k = 1; k <= segments; ++k) {
+        const bool last = (k == segments);
+        const double f = (double)k / segments;
+        const double angle = a0 + sweep * f;
+        scratch_.assign("G1 X");
+        // The end of the arc exactly as given.
+        if (last && has[kX]) {
+            AppendFixed(value[kX], &scratch_);
+        } else {
+            AppendNumber(last ? ex : cx + radius * cos(angle), 4, &scratch_);
+        }
+        scratch_.append(" Y");
+        if (last && has[kY]) {
+            AppendFixed(value[kY], &scratch_);
+        } else {
+            AppendNumber(last ? ey : cy + radius * sin(angle), 4, &scratch_);
+        }
+        if (has[kZ]) {
+            scratch_.append(" Z");
+            if (last) {
+                AppendFixed(value[kZ], &scratch_);
+            } else {
+                AppendNumber(sz + dz * f, 4, &scratch_);
+            }
+        }
+        if (has[kE]) {
+            scratch_.append(" E");
+            if (relative_e_) {
+                const double e_total = round(de * f * 1e5) / 1e5;
+                AppendNumber(e_total - e_sent, 5, &scratch_);
+                e_sent = e_total;
+            } else if (last) {
+                AppendFixed(value[kE], &scratch_);
+            } else {
+                AppendNumber(se + de * f, 5, &scratch_);
+            }
+        }
+        if (k == 1 && has_feed) {
+            scratch_.append(" F");
+            AppendFixed(feed, &scratch_);
+        }
+        scratch_.push_back('\n');
+        if (last) {
+            EmitGenerated(scratch_, line_no, position);
+        } else {
+            EmitGenerated(scratch_, line_no - 1, last_position_);
+        }
+    }
+    return true;
+}
+
+void BlockTransform::UpdateState(const WordTable &words, size_t b) {
+    bool set_position = false;
+    bool home = false;
+    bool machine_command = false;
+    bool has[kAxes] = {false, false, false, false};
+    double value[kAxes];
+    for (size_t w = words.first_word(b); w < words.first_word(b + 1); ++w) {
+        const char letter = words.letter(w);
+        const int64_t v = words.value(w);
+        const int axis = AxisOf(letter);
+        if (axis >= 0) {
+            has[axis] = true;
+            value[axis] = WordTable::ToDouble(v);
+        } else if (letter == 'F') {
+            feed_ = v;
+        } else if (letter == 'M') {
+            machine_command = true;
+            if (IsCode(v, 82)) relative_e_ = false;
+            if (IsCode(v, 83)) relative_e_ = true;
+        } else if (letter == 'G') {
+            if (v >= 0 && v <= 3 * kScale && v % kScale == 0) {
+                motion_ = v / kScale;
+            } else if (IsCode(v, 90)) {
+                absolute_ = true;
+            } else if (IsCode(v, 91)) {
+                absolute_ = false;
+            } else if (IsCode(v, 20) || IsCode(v, 21)) {
+                if (inch_ != IsCode(v, 20)) {
+                    std::fill(known_, known_ + kAxes, false);  // Rescaled.
+                }
+                inch_ = IsCode(v, 20);
+            } else if (IsCode(v, 17)) {
+                xy_plane_ = true;
+            } else if (IsCode(v, 18) || IsCode(v, 19)) {
+                xy_plane_ = false;
+            } else if (IsCode(v, 92)) {
+                set_position = true;
+            } else if (IsCode(v, 28)) {
+                home = true;
+            } else if (!IsCode(v, 4) && !IsCode(v, 94)) {
+                // Coordinate systems, canned cycles, probing...: don't
+                // know where we are anymore.
+                std::fill(known_, known_ + kAxes, false);
+                motion_ = -1;
+            }
+        }
+    }
+
+    if (machine_command) return;  // Axis words are parameters: M92 X80.
+    if (set_position) {
+        for (int a = 0; a < kAxes; ++a) {
+            if (!has[a]) continue;
+            pos_[a] = value[a];
+            known_[a] = true;
+        }
+        return;
+    }
+    if (home) {
+        const bool all = !has[kX] && !has[kY] && !has[kZ];
+        for (int a = 0; a < 3; ++a) {
+            if (all || has[a]) known_[a] = false;
+        }
+        return;
+    }
+    if (motion_ < 0) return;
+    for (int a = 0; a < kAxes; ++a) {
+        if (!has[a]) continue;
+        const bool relative = !absolute_ || (a == kE && relative_e_);
+        if (relative) {
+            pos_[a] += value[a];
+        } else {
+            pos_[a] = value[a];
+            known_[a] = true;
+        }
+    }
+}
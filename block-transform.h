@@ -0,0 +1,134 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#ifndef BLOCK_TRANSFORM_H
+#define BLOCK_TRANSFORM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "gcode-words.h"
+
+// Geometric transforms of the blocks between reading and sending:
+//
+//  - Runs of collinear (within a tolerance) G1 moves are coalesced into one
+//    longer move, so that CAM output with lots of tiny segments does not
+//    need an 'ok' round trip per segment.
+//  - G2/G3 arcs are linearized into G1 segments with a maximum chord error,
+//    for controllers that don't handle arcs well.
+//
+// Every block out maps back to the source: a coalesced move carries the
+// block number and input position of the last block it replaces. The
+// segments of an arc, except the last, carry the block before the arc and
+// its position, so a job resumed from a checkpoint repeats the whole arc.
+//
+// Blocks are only transformed where the geometry is known: in absolute
+// mode (G90), in the XY plane (G17), and once the position is established
+// by moves or G92. Everything else is passed through unchanged.
+class BlockTransform {
+   public:
+    struct Options {
+        double coalesce_tolerance = 0;  // mm; 0: don't coalesce.
+        double arc_tolerance = 0;       // mm chord error; 0: keep arcs.
+    };
+
+    // "start_position" is the input position the first block follows.
+    BlockTransform(const Options &options, uint64_t start_position);
+
+    // Transform "count" source blocks "lines" with the input position after
+    // each; the first is source block "first_line_no". "words" are their
+    // parsed words if available, otherwise they are parsed here.
+    // A move that might be coalesced with the next is held back until the
+    // next call or Finish(). Returns the number of blocks out, accessed
+    // with text(), line_no() and position(); valid until the next call.
+    size_t Process(const std::string_view *lines, const uint64_t *positions,
+                   size_t count, int first_line_no, const WordTable *words);
+
+    // End of input: returns the number of blocks held back, now out.
+    size_t Finish();
+
+    std::string_view text(size_t i) const { return out_[i].text; }
+    int line_no(size_t i) const { return out_[i].line_no; }
+    uint64_t position(size_t i) const { return out_[i].position; }
+
+   private:
+    enum Axis { kX, kY, kZ, kE, kAxes };
+
+    struct Out {
+        std::string_view text;  // Its size only while generated text...
+        bool generated;         // ...is in arena_ at arena_offset.
+        size_t arena_offset;
+        int line_no;
+        uint64_t position;
+    };
+
+    // Collinear moves coalesced so far.
+    struct Run {
+        bool active = false;
+        int blocks = 0;
+        double start[3];             // XYZ before the run.
+        std::vector<double> points;  // XYZ at the end of each block.
+        bool uses[kAxes];            // Axes mentioned...
+        int64_t last_value[kAxes];   // ...with the last value.
+        int64_t relative_e;          // Sum with relative extrusion.
+        double e_per_length;         // Extrusion along the run.
+        int64_t feed;                // -1: not set yet.
+        bool has_feed;               // F given in the run.
+        std::string_view first_text;  // Of a run of one block.
+        int line_no;
+        uint64_t position;
+    };
+
+    void HandleBlock(const WordTable &words, size_t b, int line_no,
+                     uint64_t position);
+
+    // Returns true if block "b" is a G1 move added to the run.
+    bool Coalesce(const WordTable &words, size_t b, int line_no,
+                  uint64_t position);
+
+    // Returns true if block "b" is an arc that is replaced by segments.
+    bool Linearize(const WordTable &words, size_t b, int line_no,
+                   uint64_t position);
+
+    void EmitRun();
+    void Emit(std::string_view text, int line_no, uint64_t position);
+    void EmitGenerated(std::string_view text, int line_no, uint64_t position);
+
+    // Follow the modal state and position through block "b".
+    void UpdateState(const WordTable &words, size_t b);
+
+    // Tolerance in the current units.
+    double Tolerance(double mm) const { return inch_ ? mm / 25.4 : mm; }
+
+    // Make views of generated blocks once arena_ doesn't change anymore.
+    size_t ResolveOutput();
+
+    const Options options_;
+    WordTable own_words_;  // If not given parsed words.
+
+    // Modal state as of the source.
+    bool absolute_ = true;      // G90
+    bool relative_e_ = false;   // M83
+    bool inch_ = false;         // G20
+    bool xy_plane_ = true;      // G17
+    int motion_ = -1;           // G0..G3; -1: unknown...
+    int machine_motion_ = -1;   // ...and as sent to the machine.
+    double pos_[kAxes] = {0, 0, 0, 0};
+    bool known_[kAxes] = {false, false, false, false};
+    int64_t feed_ = -1;  // -1: not set yet.
+
+    uint64_t last_position_;  // Input position before the current block.
+
+    Run run_;
+    std::string held_text_;  // Run of one block kept over a batch boundary.
+    std::vector<Out> out_;
+    std::string arena_;  // Text of generated blocks.
+    std::string scratch_;
+};
+
+#endif  // BLOCK_TRANSFORM_H
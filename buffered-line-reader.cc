@@ -5,24 +5,268 @@
 #include "buffered-line-reader.h"
 
 #include <ctype.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <algorithm>
 
 BufferedLineReader::BufferedLineReader(int fd, size_t buffer_size,
                                        bool remove_comments)
-    : fd_(fd),
+    : BufferedLineReader(std::make_unique<FDByteSource>(fd), buffer_size,
+                         remove_comments) {}
+
+BufferedLineReader::BufferedLineReader(std::unique_ptr<ByteSource> source,
+                                       size_t buffer_size, bool remove_comments)
+    : source_(std::move(source)),
       buffer_size_(buffer_size),
-      buffer_(new char[buffer_size]),
+      remove_comments_(remove_comments) {
+    if (MapFile()) {
+        data_begin_ = mapped_;
+        data_end_ = mapped_ + mapped_size_;
+    } else {
+        buffer_ = new char[buffer_size_];
+        data_begin_ = data_end_ = buffer_;
+    }
+    position_base_ = data_begin_;
+}
+
+BufferedLineReader::BufferedLineReader(char *data, size_t size,
+                                       uint64_t position, bool remove_comments)
+    : buffer_size_(0),
       remove_comments_(remove_comments),
-      data_begin_(buffer_),
-      data_end_(buffer_) {}
+      mapped_(data),
+      mapped_size_(size),
+      mapped_position_(position) {
+    data_begin_ = mapped_;
+    data_end_ = mapped_ + mapped_size_;
+    position_base_ = data_begin_;
+    base_position_ = mapped_position_;
+}
+
+bool BufferedLineReader::Seek(uint64_t position) {
+    if (mapped_) {
+        position -= std::min(position, mapped_position_);
+        data_begin_ = mapped_ + std::min<uint64_t>(position, mapped_size_);
+        return true;
+    }
+    // Skip over the bytes. Remaining data after the position is kept.
+    while (base_position_ + (data_end_ - buffer_) < position) {
+        base_position_ += data_end_ - buffer_;
+        data_begin_ = data_end_ = buffer_;
+        const ssize_t r = source_->Read(buffer_, buffer_size_);
+        if (r <= 0) {
+            eof_ = true;
+            return r == 0;
+        }
+        data_end_ += r;
+    }
+    data_begin_ = buffer_ + (position - base_position_);
+    return true;
+}
+
+BufferedLineReader::~BufferedLineReader() {
+    if (owns_mapping_) munmap(mapped_, mapped_size_);
+    delete[] buffer_;
+}
+
+bool BufferedLineReader::MapFile() {
+    const int fd = source_->mappable_fd();
+    if (fd < 0) return false;  // Pipes, decompressors, ...: Read() them.
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) return false;
+    if (lseek(fd, 0, SEEK_CUR) != 0) return false;  // Not at start.
+    // Private writable mapping: we place fresh newlines into the buffer, but
+    // only where needed, so typically only few pages are ever copied.
+    void *const m = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED) return false;  // e.g. address space: fall back.
+    madvise(m, st.st_size, MADV_SEQUENTIAL);
+    mapped_ = (char *)m;
+    mapped_size_ = st.st_size;
+    owns_mapping_ = true;
+    return true;
+}
+
+// Result of scanning a line.
+struct LineScan {
+    char *end_of_line;    // The '\n' or '\r' terminating the line.
+    char *content_first;  // First non-space character; nullptr if empty line.
+    char *content_last;   // Last non-space character before comment.
+};
 
-BufferedLineReader::~BufferedLineReader() { delete[] buffer_; }
+// The scanner looks at a chunk of characters at a time and classifies them
+// into bit-masks of end-of-line, semicolon and space characters (as in
+// isspace() of the C locale).
+//
+// Depending on the architecture, a character is represented by one bit in
+// the mask (movemask on x86), or four bits (NEON, which doesn't have a
+// movemask, but narrowing to nibbles is cheap).
+// This way, all character classes are determined with a few instructions per
+// chunk instead of multiple passes with per-character checks.
+struct CharClassMasks {
+    uint64_t eol, semicolon, space;
+};
+
+#if defined(__AVX2__) && !defined(USE_SCALAR_LINE_SCAN)
+#include <immintrin.h>
+#define HAVE_VECTOR_LINE_SCAN
+static constexpr int kScanWidth = 32;
+static constexpr int kMaskBitsPerChar = 1;
+static inline CharClassMasks ClassifyChars(const char *p) {
+    const __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    auto eq = [v](char c) { return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)); };
+    const __m256i eol = _mm256_or_si256(eq('\n'), eq('\r'));
+    // isspace(): ' ' and the range '\t' (9) .. '\r' (13)
+    const __m256i ctrl_space =
+        _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(8)),
+                         _mm256_cmpgt_epi8(_mm256_set1_epi8(14), v));
+    const __m256i space = _mm256_or_si256(eq(' '), ctrl_space);
+    return {(uint32_t)_mm256_movemask_epi8(eol),
+            (uint32_t)_mm256_movemask_epi8(eq(';')),
+            (uint32_t)_mm256_movemask_epi8(space)};
+}
+#elif defined(__SSE2__) && !defined(USE_SCALAR_LINE_SCAN)
+#include <emmintrin.h>
+#define HAVE_VECTOR_LINE_SCAN
+static constexpr int kScanWidth = 16;
+static constexpr int kMaskBitsPerChar = 1;
+static inline CharClassMasks ClassifyChars(const char *p) {
+    const __m128i v = _mm_loadu_si128((const __m128i *)p);
+    auto eq = [v](char c) { return _mm_cmpeq_epi8(v, _mm_set1_epi8(c)); };
+    const __m128i eol = _mm_or_si128(eq('\n'), eq('\r'));
+    // isspace(): ' ' and the range '\t' (9) .. '\r' (13)
+    const __m128i ctrl_space =
+        _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(8)),
+                      _mm_cmplt_epi8(v, _mm_set1_epi8(14)));
+    const __m128i space = _mm_or_si128(eq(' '), ctrl_space);
+    return {(uint32_t)_mm_movemask_epi8(eol),
+            (uint32_t)_mm_movemask_epi8(eq(';')),
+            (uint32_t)_mm_movemask_epi8(space)};
+}
+#elif defined(__ARM_NEON) && !defined(USE_SCALAR_LINE_SCAN)
+#include <arm_neon.h>
+#define HAVE_VECTOR_LINE_SCAN
+static constexpr int kScanWidth = 16;
+static constexpr int kMaskBitsPerChar = 4;
+static inline uint64_t NibbleMask(uint8x16_t m) {
+    const uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+}
+static inline CharClassMasks ClassifyChars(const char *p) {
+    const uint8x16_t v = vld1q_u8((const uint8_t *)p);
+    auto eq = [v](char c) { return vceqq_u8(v, vdupq_n_u8(c)); };
+    const uint8x16_t eol = vorrq_u8(eq('\n'), eq('\r'));
+    // isspace(): ' ' and the range '\t' (9) .. '\r' (13)
+    const uint8x16_t ctrl_space =
+        vcleq_u8(vsubq_u8(v, vdupq_n_u8(9)), vdupq_n_u8(4));
+    const uint8x16_t space = vorrq_u8(eq(' '), ctrl_space);
+    return {NibbleMask(eol), NibbleMask(eq(';')), NibbleMask(space)};
+}
+#endif
+
+// Scan line starting at "begin" for its end, comment and non-space content.
+// Returns false if there is no end of line before "end".
+static bool ScanLine(char *begin, char *end, bool remove_comments,
+                     LineScan *result) {
+    result->content_first = nullptr;
+    result->content_last = nullptr;
+#ifdef HAVE_VECTOR_LINE_SCAN
+    bool in_comment = false;
+    char *pos = begin;
+    constexpr int kMaskBits = kScanWidth * kMaskBitsPerChar;
+    constexpr uint64_t kFullMask =
+        (kMaskBits == 64) ? ~uint64_t{0} : (uint64_t{1} << kMaskBits) - 1;
+    for (/**/; end - pos >= kScanWidth; pos += kScanWidth) {
+        const CharClassMasks m = ClassifyChars(pos);
+        // Content ends at the end of line or start of comment.
+        const uint64_t stop =
+            (in_comment || !remove_comments) ? m.eol : m.eol | m.semicolon;
+        const uint64_t first_stop = stop & -stop;
+        const uint64_t content =
+            in_comment ? 0 : (~m.space & kFullMask & (first_stop - 1));
+        if (content) {
+            if (!result->content_first) {
+                result->content_first =
+                    pos + __builtin_ctzll(content) / kMaskBitsPerChar;
+            }
+            result->content_last =
+                pos + (63 - __builtin_clzll(content)) / kMaskBitsPerChar;
+        }
+        if (first_stop & m.eol) {  // Reached end of line.
+            result->end_of_line = pos + __builtin_ctzll(stop) / kMaskBitsPerChar;
+            return true;
+        }
+        if (stop) {  // Start of comment; now only looking for end of line.
+            in_comment = true;
+            if (m.eol) {
+                result->end_of_line =
+                    pos + __builtin_ctzll(m.eol) / kMaskBitsPerChar;
+                return true;
+            }
+        }
+    }
+    // Remaining characters of less than a chunk.
+    for (/**/; pos < end; ++pos) {
+        const char c = *pos;
+        if (c == '\n' || c == '\r') {
+            result->end_of_line = pos;
+            return true;
+        }
+        if (in_comment) continue;
+        if (remove_comments && c == ';') {
+            in_comment = true;
+        } else if (!isspace(c)) {
+            if (!result->content_first) result->content_first = pos;
+            result->content_last = pos;
+        }
+    }
+    return false;
+#else
+    // Scalar fallback: find end of line and comment with the (typically
+    // optimized) library functions, then trim whitespace.
+    char *const eol = std::find_if(
+        begin, end, [](char c) { return c == '\n' || c == '\r'; });
+    if (eol == end) return false;
+    result->end_of_line = eol;
+    char *last = eol;
+    if (remove_comments) {
+        char *start_of_comment = (char *)memchr(begin, ';', eol - begin);
+        if (start_of_comment) last = start_of_comment;
+    }
+    --last;
+    while (begin <= last && isspace(*begin)) begin++;
+    while (last >= begin && isspace(*last)) last--;
+    if (last >= begin) {
+        result->content_first = begin;
+        result->content_last = last;
+    }
+    return true;
+#endif
+}
 
 bool BufferedLineReader::Refill() {
+    if (mapped_) {
+        // All is mapped; only left is possibly a final line without newline,
+        // which we can't close in the mapping.
+        if (eof_) return false;
+        eof_ = true;
+        if (remainder_.empty()) return false;
+        last_line_.assign(remainder_.data(), remainder_.size());
+        last_line_.push_back('\n');
+        base_position_ = mapped_position_ + (remainder_.data() - mapped_);
+        remainder_ = {};
+        data_begin_ = last_line_.data();
+        data_end_ = data_begin_ + last_line_.size();
+        position_base_ = data_begin_;
+        return true;
+    }
+    // Everything before the remainder is consumed.
+    base_position_ +=
+        (remainder_.empty() ? data_end_ : remainder_.data()) - buffer_;
     data_begin_ = buffer_;
     data_end_ = data_begin_;
     if (eof_) return false;
@@ -31,7 +275,8 @@ bool BufferedLineReader::Refill() {
         memmove(data_begin_, remainder_.data(), remainder_.size());
         data_end_ += remainder_.size();
     }
-    const ssize_t r = read(fd_, data_end_, buffer_size_ - remainder_.size());
+    const ssize_t r =
+        source_->Read(data_end_, buffer_size_ - remainder_.size());
     if (r > 0) {
         data_end_ += r;
     } else {
@@ -47,47 +292,48 @@ bool BufferedLineReader::Refill() {
 }
 
 std::vector<std::string_view> BufferedLineReader::ReadNextLines(size_t n) {
-    std::vector<std::string_view> result;
-    result.reserve(n);
+    std::vector<std::string_view> result(n);
+    result.resize(ReadNextLines(result.data(), n));
+    return result;
+}
+
+size_t BufferedLineReader::ReadNextLines(std::string_view *lines, size_t n,
+                                         uint64_t *positions) {
+    size_t count = 0;
+    if (parse_words_) words_.Clear();
     if (data_begin_ >= data_end_ && !Refill()) {
-        return result;
+        return count;
     }
-    char *end_line;
-    while ((end_line = std::find_if(data_begin_, data_end_, [](char c) {
-                return c == '\n' || c == '\r';
-            })) != data_end_) {
-        auto line = MakeCommentFreeLine(data_begin_, end_line);
-        if (!line.empty()) result.push_back(line);
-        data_begin_ = end_line + 1;
-        if (result.size() >= n) {
-            return result;
+    LineScan scan;
+    while (ScanLine(data_begin_, data_end_, remove_comments_, &scan)) {
+        if (scan.content_first) {
+            char *const last = scan.content_last + 1;
+            // Fresh newline behind resulting new last. Only write if needed
+            // to not touch an otherwise untouched memory mapped page.
+            if (*last != '\n') *last = '\n';
+            if (positions) {
+                positions[count] =
+                    base_position_ + (scan.end_of_line + 1 - position_base_);
+            }
+            lines[count++] = std::string_view(scan.content_first,
+                                              last - scan.content_first + 1);
+            if (parse_words_) words_.Add(lines[count - 1]);
+        }
+        data_begin_ = scan.end_of_line + 1;
+        if (count >= n) {
+            return count;
         }
     }
     remainder_ = std::string_view(data_begin_, data_end_ - data_begin_);
     data_begin_ = data_end_;  // consume all.
-    return result;
+    return count;
 }
 
 std::string_view BufferedLineReader::ReadLine() {
+    std::string_view line;
     while (!is_eof()) {
-        auto lines = ReadNextLines(1);
-        if (lines.empty()) continue;  // could happen at buffer switchover
-        return lines[0];
+        if (ReadNextLines(&line, 1) == 0) continue;  // at buffer switchover
+        return line;
     }
     return {};
 }
-
-// Note, 'last' points to the last character (typically the newline), not the
-// last character + 1 as one would assume in iterators.
-std::string_view BufferedLineReader::MakeCommentFreeLine(char *first,
-                                                         char *last) {
-    if (remove_comments_) {
-        char *start_of_comment = (char *)memchr(first, ';', last - first + 1);
-        if (start_of_comment) last = start_of_comment - 1;
-    }
-    while (first <= last && isspace(*first)) first++;
-    while (last >= first && isspace(*last)) last--;  // also removing newline
-    if (last < first) return {};
-    *++last = '\n';  // Fresh newline behind resulting new last.
-    return std::string_view(first, last - first + 1);
-}
@@ -5,23 +5,43 @@
 #ifndef GCODE_LINE_READER_H
 #define GCODE_LINE_READER_H
 
+#include <memory>
+#include <string>
 #include <string_view>
 #include <vector>
 
+#include "block-source.h"
+#include "byte-source.h"
+#include "gcode-words.h"
+
 // Reader of gcode input yielding preprocessed blocks without comments or
 // unnecesary whitespace.
 //
-// This reads in larger chunks (up to "buffer_size") from the file-descriptor
-// and provides an array of pre-tokenized lines.
+// This reads in larger chunks (up to "buffer_size") from the byte source
+// (file-descriptor or decompressor) and provides an array of pre-tokenized
+// lines.
+// If the source is a plain regular file, it is memory mapped instead and
+// tokenized straight from the page cache; there is no copy and
+// "buffer_size" is not used.
 //
 // If "remove_comments" is set, semicolon end-of-block comments are removed.
 // Leading and trailing whitespace removed.
 // Line-endings '\r\n' or '\n' are canonicalized to be exactly one '\n'.
 // Empty lines are removed.
-class BufferedLineReader {
+class BufferedLineReader : public BlockSource {
    public:
     BufferedLineReader(int fd, size_t buffer_size, bool remove_comments);
-    ~BufferedLineReader();
+    BufferedLineReader(std::unique_ptr<ByteSource> source, size_t buffer_size,
+                       bool remove_comments);
+
+    // Read the "size" bytes at "data" of a writable memory mapping owned
+    // by the caller, which are at input position "position". Newlines are
+    // only written within the lines of the range, so readers of
+    // neighboring ranges, each starting at the beginning of a line, can
+    // work on the same mapping at the same time.
+    BufferedLineReader(char *data, size_t size, uint64_t position,
+                       bool remove_comments);
+    ~BufferedLineReader() override;
 
     // Read at most 'n' next lines (= GCode blocks) from the input.
     // Might return less.
@@ -30,26 +50,58 @@ class BufferedLineReader {
     // Invalidates string_views returned by previous calls.
     std::vector<std::string_view> ReadNextLines(size_t n);
 
-    // Convenience: read a single line.
+    // Allocation-free variant of the above: fills the caller-owned array
+    // "lines", which has space for at least "n" elements.
+    // Returns the number of lines read.
+    // Positions are byte offsets in the (decompressed) input.
+    size_t ReadNextLines(std::string_view *lines, size_t n,
+                         uint64_t *positions = nullptr) override;
+
+    // Memory mapped files seek right away, other inputs are read up to the
+    // position (no tokenizing though).
+    bool Seek(uint64_t position) override;
+
+    // Convenience: read a single line. Does not allocate.
     std::string_view ReadLine();
 
     // Return if the full file has been processed.
-    inline bool is_eof() const { return eof_; }
+    bool is_eof() const override { return eof_; }
+
+    // Lines of a mapped file are views of the mapping.
+    bool blocks_stay_valid() const override { return mapped_ != nullptr; }
+
+    // Opt-in: also parse the words of the blocks returned by each
+    // ReadNextLines() call into words().
+    void set_parse_words(bool parse) { parse_words_ = parse; }
+
+    // Words of the blocks returned by the last ReadNextLines() call, valid
+    // as long as these are.
+    const WordTable &words() const { return words_; }
 
    private:
-    // May modify the content of the buffer to place a fresh newline.
-    std::string_view MakeCommentFreeLine(char *first, char *last);
     bool Refill();
+    bool MapFile();  // Attempt to memory map the whole file.
 
-    const int fd_;
+    const std::unique_ptr<ByteSource> source_;
     const size_t buffer_size_;
-    char *const buffer_;
     const bool remove_comments_;
+    char *buffer_ = nullptr;  // Buffer if we read() the file.
+    char *mapped_ = nullptr;  // Memory mapped file if possible.
+    size_t mapped_size_ = 0;
+    uint64_t mapped_position_ = 0;  // Input position of mapped_[0].
+    bool owns_mapping_ = false;
+    std::string last_line_;   // Last line of mapped file if no final newline.
 
     bool eof_ = false;
     char *data_begin_;
     char *data_end_;
+    // The input position of the data at "position_base_".
+    const char *position_base_;
+    uint64_t base_position_ = 0;
     std::string_view remainder_;  // incomplete line at end of buffer
+
+    bool parse_words_ = false;
+    WordTable words_;
 };
 
 #endif  // GCODE_LINE_READER_H
@@ -0,0 +1,210 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "byte-source.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// Size of input chunks handed to the decompressors.
+static constexpr size_t kCompressedChunkSize = 1 << 18;
+
+FDByteSource::FDByteSource(int fd, std::string prefix)
+    : fd_(fd), prefix_(std::move(prefix)) {}
+
+ssize_t FDByteSource::Read(char *buffer, size_t len) {
+    read_any_ = true;
+    if (prefix_pos_ < prefix_.size()) {
+        const size_t n = std::min(len, prefix_.size() - prefix_pos_);
+        memcpy(buffer, prefix_.data() + prefix_pos_, n);
+        prefix_pos_ += n;
+        return n;
+    }
+    for (;;) {
+        const ssize_t r = read(fd_, buffer, len);
+        if (r < 0 && errno == EINTR) continue;
+        return r;
+    }
+}
+
+int FDByteSource::mappable_fd() const {
+    struct stat st;
+    if (read_any_ || !prefix_.empty()) return -1;
+    if (fstat(fd_, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+    return fd_;
+}
+
+#ifdef HAVE_ZLIB
+// Decompress gzip (or zlib) stream; also handles concatenated gzip members.
+class GzipByteSource : public ByteSource {
+   public:
+    GzipByteSource(std::unique_ptr<ByteSource> compressed)
+        : compressed_(std::move(compressed)), in_(new char[kCompressedChunkSize]) {
+        memset(&stream_, 0, sizeof(stream_));
+        inflateInit2(&stream_, 15 + 32);  // 32: auto-detect gzip/zlib header
+    }
+    ~GzipByteSource() override {
+        inflateEnd(&stream_);
+        delete[] in_;
+    }
+
+    ssize_t Read(char *buffer, size_t len) override {
+        stream_.next_out = (Bytef *)buffer;
+        stream_.avail_out = len;
+        // Loop until we have something to return, as there might be input
+        // that does not result in output yet.
+        while (stream_.avail_out == len) {
+            if (stream_.avail_in == 0) {
+                if (input_eof_) return 0;
+                const ssize_t r = compressed_->Read(in_, kCompressedChunkSize);
+                if (r < 0) return -1;
+                if (r == 0) {
+                    input_eof_ = true;
+                    if (!at_stream_end_) {
+                        fprintf(stderr, "gzip: truncated input\n");
+                    }
+                    return 0;
+                }
+                stream_.next_in = (Bytef *)in_;
+                stream_.avail_in = r;
+            }
+            if (at_stream_end_) {  // Another member following.
+                inflateReset(&stream_);
+                at_stream_end_ = false;
+            }
+            const int ret = inflate(&stream_, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                at_stream_end_ = true;
+            } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                fprintf(stderr, "gzip: %s\n",
+                        stream_.msg ? stream_.msg : "decompression error");
+                errno = EINVAL;
+                return -1;
+            }
+        }
+        return len - stream_.avail_out;
+    }
+
+   private:
+    std::unique_ptr<ByteSource> compressed_;
+    char *const in_;
+    z_stream stream_;
+    bool input_eof_ = false;
+    bool at_stream_end_ = false;
+};
+#endif
+
+#ifdef HAVE_ZSTD
+class ZstdByteSource : public ByteSource {
+   public:
+    ZstdByteSource(std::unique_ptr<ByteSource> compressed)
+        : compressed_(std::move(compressed)),
+          in_(new char[kCompressedChunkSize]),
+          stream_(ZSTD_createDStream()) {
+        ZSTD_initDStream(stream_);
+        input_ = {in_, 0, 0};
+    }
+    ~ZstdByteSource() override {
+        ZSTD_freeDStream(stream_);
+        delete[] in_;
+    }
+
+    ssize_t Read(char *buffer, size_t len) override {
+        ZSTD_outBuffer output = {buffer, len, 0};
+        while (output.pos == 0) {
+            if (input_.pos == input_.size) {
+                if (input_eof_) return 0;
+                const ssize_t r = compressed_->Read(in_, kCompressedChunkSize);
+                if (r < 0) return -1;
+                if (r == 0) {
+                    input_eof_ = true;
+                    if (!at_frame_end_) fprintf(stderr, "zstd: truncated input\n");
+                    return 0;
+                }
+                input_ = {in_, (size_t)r, 0};
+            }
+            const size_t ret = ZSTD_decompressStream(stream_, &output, &input_);
+            if (ZSTD_isError(ret)) {
+                fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(ret));
+                errno = EINVAL;
+                return -1;
+            }
+            at_frame_end_ = (ret == 0);
+        }
+        return output.pos;
+    }
+
+   private:
+    std::unique_ptr<ByteSource> compressed_;
+    char *const in_;
+    ZSTD_DStream *const stream_;
+    ZSTD_inBuffer input_;
+    bool input_eof_ = false;
+    bool at_frame_end_ = true;
+};
+#endif
+
+std::unique_ptr<ByteSource> ByteSource::Create(int fd, std::string *error) {
+    // Look at the magic bytes. For regular files we can peek without
+    // consuming, so that they can still be memory mapped.
+    static constexpr uint8_t kGzipMagic[] = {0x1f, 0x8b};
+    static constexpr uint8_t kZstdMagic[] = {0x28, 0xb5, 0x2f, 0xfd};
+    static constexpr size_t kMagicLen = 4;
+    std::string magic(kMagicLen, '\0');
+    std::unique_ptr<ByteSource> raw;
+    ssize_t got = pread(fd, &magic[0], kMagicLen, 0);
+    if (got >= 0 && lseek(fd, 0, SEEK_CUR) == 0) {
+        magic.resize(got);
+        raw.reset(new FDByteSource(fd));
+    } else {
+        // Pipe or the like: need to read and hand the bytes on.
+        size_t len = 0;
+        ssize_t r;
+        while (len < kMagicLen &&
+               (r = read(fd, &magic[len], kMagicLen - len)) != 0) {
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            len += r;
+        }
+        magic.resize(len);
+        raw.reset(new FDByteSource(fd, magic));
+    }
+
+    auto has_magic = [&magic](const uint8_t *m, size_t len) {
+        return magic.size() >= len && memcmp(magic.data(), m, len) == 0;
+    };
+    if (has_magic(kGzipMagic, sizeof(kGzipMagic))) {
+#ifdef HAVE_ZLIB
+        return std::make_unique<GzipByteSource>(std::move(raw));
+#else
+        *error = "gzip compressed input, but compiled without zlib support";
+        return nullptr;
+#endif
+    }
+    if (has_magic(kZstdMagic, sizeof(kZstdMagic))) {
+#ifdef HAVE_ZSTD
+        return std::make_unique<ZstdByteSource>(std::move(raw));
+#else
+        *error = "zstd compressed input, but compiled without zstd support";
+        return nullptr;
+#endif
+    }
+    return raw;
+}
@@ -0,0 +1,53 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#ifndef BYTE_SOURCE_H
+#define BYTE_SOURCE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <memory>
+#include <string>
+
+// Source of raw bytes feeding the BufferedLineReader.
+class ByteSource {
+   public:
+    virtual ~ByteSource() {}
+
+    // Read up to "len" bytes into "buffer".
+    // Returns number of bytes read, 0 on end of input and -1 on error.
+    virtual ssize_t Read(char *buffer, size_t len) = 0;
+
+    // If the bytes come unmodified from a regular file descriptor that is
+    // not read yet, returns it, so that it can be memory mapped instead.
+    // Returns -1 otherwise.
+    virtual int mappable_fd() const { return -1; }
+
+    // Create byte source reading from "fd". If the content is compressed
+    // (gzip or zstd, recognized by their magic bytes), it is transparently
+    // decompressed.
+    // Returns nullptr and sets "error" if the compression is not supported.
+    static std::unique_ptr<ByteSource> Create(int fd, std::string *error);
+};
+
+// Plain bytes from a file descriptor.
+class FDByteSource : public ByteSource {
+   public:
+    explicit FDByteSource(int fd) : fd_(fd) {}
+    // Source that first returns the already read "prefix", then continues
+    // reading from "fd".
+    FDByteSource(int fd, std::string prefix);
+
+    ssize_t Read(char *buffer, size_t len) override;
+    int mappable_fd() const override;
+
+   private:
+    const int fd_;
+    std::string prefix_;
+    size_t prefix_pos_ = 0;
+    bool read_any_ = false;
+};
+
+#endif  // BYTE_SOURCE_H
@@ -0,0 +1,277 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "checkpoint.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+// Version 2 added the job stats, version 3 the file and the nanoseconds
+// of the source identity; older index files are rebuilt.
+static constexpr char kIndexMagic[8] = {'G', 'C', 'O', 'D', 'E', 'I', 'X', '3'};
+
+struct IndexFileHeader {
+    char magic[8];
+    uint64_t source_device;
+    uint64_t source_inode;
+    int64_t source_size;
+    int64_t source_mtime;
+    int64_t source_mtime_nsec;
+    uint32_t remove_comments;
+    uint32_t stride;
+    uint64_t count;
+    uint64_t blocks;
+    uint64_t bytes;
+    uint64_t longest_block;
+};
+
+SourceIdentity SourceIdentity::FromFd(int fd, bool remove_comments) {
+    SourceIdentity result;
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        result.device = st.st_dev;
+        result.inode = st.st_ino;
+        result.size = st.st_size;
+        result.mtime = st.st_mtime;
+#ifdef __APPLE__
+        result.mtime_nsec = st.st_mtimespec.tv_nsec;
+#else
+        result.mtime_nsec = st.st_mtim.tv_nsec;
+#endif
+    }
+    result.remove_comments = remove_comments;
+    return result;
+}
+
+// Write "content" to a temporary file first and rename, so that there is
+// never a partially written file.
+static bool WriteFileAtomically(const std::string &filename,
+                                const void *content, size_t len) {
+    const std::string tmp_file = filename + ".tmp";
+    const int fd = open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool success = (write(fd, content, len) == (ssize_t)len);
+#ifdef __APPLE__
+    success &= (fsync(fd) == 0);  // There is no fdatasync().
+#else
+    success &= (fdatasync(fd) == 0);
+#endif
+    success &= (close(fd) == 0);
+    if (!success || rename(tmp_file.c_str(), filename.c_str()) != 0) {
+        unlink(tmp_file.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool WriteCheckpoint(const char *filename, const Checkpoint &checkpoint) {
+    const SourceIdentity &source = checkpoint.source;
+    char content[512];
+    const int len = snprintf(
+        content, sizeof(content),
+        "# gcode-cli checkpoint\n"
+        "device %" PRIu64 "\ninode %" PRIu64 "\nsize %" PRId64
+        "\nmtime %" PRId64 ".%09" PRId64 "\ncomments-removed %d\n"
+        "block %d\nposition %" PRIu64 "\n",
+        source.device, source.inode, source.size, source.mtime,
+        source.mtime_nsec, source.remove_comments ? 1 : 0, checkpoint.block,
+        checkpoint.position);
+    return WriteFileAtomically(filename, content, len);
+}
+
+bool ReadCheckpoint(const char *filename, Checkpoint *checkpoint,
+                    std::string *error) {
+    FILE *in = fopen(filename, "r");
+    if (!in) {
+        *error = strerror(errno);
+        return false;
+    }
+    SourceIdentity *source = &checkpoint->source;
+    int remove_comments = 0;
+    const int fields =
+        fscanf(in,
+               "# gcode-cli checkpoint\n"
+               "device %" SCNu64 "\ninode %" SCNu64 "\nsize %" SCNd64
+               "\nmtime %" SCNd64 ".%" SCNd64 "\ncomments-removed %d\n"
+               "block %d\nposition %" SCNu64,
+               &source->device, &source->inode, &source->size,
+               &source->mtime, &source->mtime_nsec, &remove_comments,
+               &checkpoint->block, &checkpoint->position);
+    fclose(in);
+    if (fields != 8 || checkpoint->block < 0) {
+        *error = "Not a valid checkpoint file";
+        return false;
+    }
+    checkpoint->source.remove_comments = (remove_comments != 0);
+    return true;
+}
+
+CheckpointWriter::CheckpointWriter(const char *filename)
+    : filename_(filename) {
+    writer_ = std::thread(&CheckpointWriter::Run, this);
+}
+
+CheckpointWriter::~CheckpointWriter() {
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        stop_ = true;
+    }
+    wake_writer_.notify_one();
+    writer_.join();
+}
+
+void CheckpointWriter::Save(const Checkpoint &checkpoint) {
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        pending_ = checkpoint;
+        have_pending_ = true;
+    }
+    wake_writer_.notify_one();
+}
+
+bool CheckpointWriter::Flush() {
+    std::unique_lock<std::mutex> l(mutex_);
+    written_.wait(l, [this]() { return !have_pending_ && !writing_; });
+    return !failed_;
+}
+
+void CheckpointWriter::Run() {
+    std::unique_lock<std::mutex> l(mutex_);
+    for (;;) {
+        wake_writer_.wait(l, [this]() { return stop_ || have_pending_; });
+        if (!have_pending_) break;  // Stopped, all written.
+        const Checkpoint checkpoint = pending_;
+        have_pending_ = false;
+        writing_ = true;
+        l.unlock();
+
+        const bool success = WriteCheckpoint(filename_.c_str(), checkpoint);
+        if (!success && !failed_) perror(filename_.c_str());  // Once.
+
+        l.lock();
+        failed_ = !success;
+        writing_ = false;
+        written_.notify_all();  // Flush() waits for that.
+    }
+}
+
+void BlockIndex::Build(BlockSource *source) {
+    positions_.assign(1, 0);
+    stats_ = JobStats();
+    std::string_view lines[256];
+    uint64_t positions[256];
+    while (!source->is_eof()) {
+        Add(lines, positions, source->ReadNextLines(lines, 256, positions));
+    }
+}
+
+void BlockIndex::Add(const std::string_view *lines, const uint64_t *positions,
+                     size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        if (++stats_.blocks % kStride == 0) {
+            positions_.push_back(positions[i]);
+        }
+        stats_.bytes += lines[i].size();
+        stats_.longest_block =
+            std::max<uint64_t>(stats_.longest_block, lines[i].size());
+    }
+}
+
+bool BlockIndex::Load(const char *filename, const SourceIdentity &source) {
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+    IndexFileHeader header;
+    bool success = (read(fd, &header, sizeof(header)) == sizeof(header)) &&
+                   !memcmp(header.magic, kIndexMagic, sizeof(kIndexMagic)) &&
+                   header.source_device == source.device &&
+                   header.source_inode == source.inode &&
+                   header.source_size == source.size &&
+                   header.source_mtime == source.mtime &&
+                   header.source_mtime_nsec == source.mtime_nsec &&
+                   (header.remove_comments != 0) == source.remove_comments &&
+                   header.stride == kStride && header.count > 0 &&
+                   header.count <= (uint64_t)source.size + 1 &&
+                   header.count == header.blocks / kStride + 1;
+    if (success) {
+        positions_.resize(header.count);
+        const ssize_t len = header.count * sizeof(uint64_t);
+        success = (read(fd, positions_.data(), len) == len);
+    }
+    close(fd);
+    if (success) {
+        stats_.blocks = header.blocks;
+        stats_.bytes = header.bytes;
+        stats_.longest_block = header.longest_block;
+    } else {
+        positions_.assign(1, 0);
+        stats_ = JobStats();
+    }
+    return success;
+}
+
+bool BlockIndex::Save(const char *filename,
+                      const SourceIdentity &source) const {
+    IndexFileHeader header = {};
+    memcpy(header.magic, kIndexMagic, sizeof(kIndexMagic));
+    header.source_device = source.device;
+    header.source_inode = source.inode;
+    header.source_size = source.size;
+    header.source_mtime = source.mtime;
+    header.source_mtime_nsec = source.mtime_nsec;
+    header.remove_comments = source.remove_comments;
+    header.stride = kStride;
+    header.count = positions_.size();
+    header.blocks = stats_.blocks;
+    header.bytes = stats_.bytes;
+    header.longest_block = stats_.longest_block;
+    std::string content((const char *)&header, sizeof(header));
+    content.append((const char *)positions_.data(),
+                   positions_.size() * sizeof(uint64_t));
+    // Cache directory and its parent; mkdir() fails if they already exist.
+    if (const char *slash = strrchr(filename, '/')) {
+        const std::string dir(filename, slash - filename);
+        mkdir(dir.substr(0, dir.rfind('/')).c_str(), 0700);
+        mkdir(dir.c_str(), 0700);
+    }
+    return WriteFileAtomically(filename, content.data(), content.size());
+}
+
+uint64_t BlockIndex::Lookup(uint64_t skip_blocks, uint64_t *position) const {
+    const uint64_t i = std::min<uint64_t>(skip_blocks / kStride,
+                                          positions_.size() - 1);
+    *position = positions_[i];
+    return i * kStride;
+}
+
+std::string BlockIndexFile(const char *gcode_file) {
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    std::string dir;
+    if (cache_home && cache_home[0] == '/') {
+        dir = cache_home;
+    } else if (const char *home = getenv("HOME"); home && home[0] == '/') {
+        dir = std::string(home) + "/.cache";
+    } else {
+        return "";
+    }
+    char *const path = realpath(gcode_file, nullptr);
+    if (!path) return "";
+    uint64_t hash = 0xcbf29ce484222325;  // FNV-1a
+    for (const char *c = path; *c; ++c) {
+        hash = (hash ^ (uint8_t)*c) * 0x100000001b3;
+    }
+    const char *const basename = strrchr(path, '/') + 1;
+    char name[64];
+    snprintf(name, sizeof(name), "-%016" PRIx64 ".idx", hash);
+    const std::string result = dir + "/gcode-cli/" + basename + name;
+    free(path);
+    return result;
+}
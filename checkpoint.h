@@ -0,0 +1,137 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "block-source.h"
+
+// Identifies the input a checkpoint or index belongs to: the file (device
+// and inode) and its version (size and modification time to the
+// nanosecond), so that a file edited within the same second, or replaced
+// by another one of the same size, does not match. Block numbers depend
+// on comment removal (comment-only lines are dropped), so that is part
+// of it.
+struct SourceIdentity {
+    uint64_t device = 0;
+    uint64_t inode = 0;
+    int64_t size = 0;
+    int64_t mtime = 0;
+    int64_t mtime_nsec = 0;
+    bool remove_comments = true;
+
+    static SourceIdentity FromFd(int fd, bool remove_comments);
+    bool operator==(const SourceIdentity &other) const {
+        return device == other.device && inode == other.inode &&
+               size == other.size && mtime == other.mtime &&
+               mtime_nsec == other.mtime_nsec &&
+               remove_comments == other.remove_comments;
+    }
+};
+
+// Progress of a job: the last acknowledged block and the input position
+// after it, so that a resume can seek there directly.
+struct Checkpoint {
+    SourceIdentity source;
+    int block = 0;
+    uint64_t position = 0;
+};
+
+// Write checkpoint atomically (the file is always complete) and synced to
+// disk. Returns success.
+bool WriteCheckpoint(const char *filename, const Checkpoint &checkpoint);
+
+// Read checkpoint. Returns false and sets "error" on failure.
+bool ReadCheckpoint(const char *filename, Checkpoint *checkpoint,
+                    std::string *error);
+
+// Writes checkpoints with WriteCheckpoint() in a background thread, so that
+// syncing to disk never stalls the caller. Only the latest one matters: a
+// checkpoint not written yet is replaced by the next Save().
+class CheckpointWriter {
+   public:
+    explicit CheckpointWriter(const char *filename);
+    ~CheckpointWriter();  // Writes the last saved checkpoint.
+
+    void Save(const Checkpoint &checkpoint);
+
+    // Block until the last saved checkpoint is written, e.g. before
+    // stopping or removing the file. Returns success of that write.
+    bool Flush();
+
+   private:
+    void Run();
+
+    const std::string filename_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_writer_;
+    std::condition_variable written_;
+    Checkpoint pending_;        // Guarded by mutex_.
+    bool have_pending_ = false;
+    bool writing_ = false;  // Writer busy outside the lock.
+    bool failed_ = false;   // Last write failed.
+    bool stop_ = false;
+    std::thread writer_;
+};
+
+// Totals of a job, as its blocks are sent (without line numbers).
+struct JobStats {
+    uint64_t blocks = 0;
+    uint64_t bytes = 0;
+    uint64_t longest_block = 0;  // Bytes including the newline.
+};
+
+// Sparse index of the input position after every kStride-th block and the
+// totals of the job, kept in the cache directory (see BlockIndexFile()).
+// With it, starting at any block only needs to tokenize less than kStride
+// blocks, and repeated sends know the size of the job up front.
+class BlockIndex {
+   public:
+    static constexpr uint64_t kStride = 4096;
+
+    // Build index by reading all blocks from a fresh "source".
+    void Build(BlockSource *source);
+
+    // Add the next "count" blocks read from the start of the source, as
+    // returned by BlockSource::ReadNextLines(). Once the source is at its
+    // end, the index is complete.
+    void Add(const std::string_view *lines, const uint64_t *positions,
+             size_t count);
+
+    const JobStats &stats() const { return stats_; }
+
+    // Load index; returns false if it does not exist or belongs to a
+    // different source.
+    bool Load(const char *filename, const SourceIdentity &source);
+
+    // Save index, creating the cache directory if needed.
+    bool Save(const char *filename, const SourceIdentity &source) const;
+
+    // Closest indexed position to skip the first "skip_blocks" blocks.
+    // Returns the number of blocks before "position", at most "skip_blocks".
+    uint64_t Lookup(uint64_t skip_blocks, uint64_t *position) const;
+
+   private:
+    // positions_[i]: position after block number i * kStride.
+    std::vector<uint64_t> positions_{0};
+    JobStats stats_;
+};
+
+// Name of the index file for "gcode_file" in the cache directory of the
+// user ($XDG_CACHE_HOME/gcode-cli, or ~/.cache/gcode-cli), so that indexing
+// never writes next to the gcode files. The name is made from the base
+// name and a hash of the absolute path. Empty if there is no cache
+// directory.
+std::string BlockIndexFile(const char *gcode_file);
+
+#endif  // CHECKPOINT_H
@@ -0,0 +1,260 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "compiled-job.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "buffered-line-reader.h"
+#include "byte-source.h"
+
+static constexpr char kJobMagic[8] = {'G', 'C', 'O', 'D', 'E', 'J', 'O', 'B'};
+static constexpr uint32_t kJobVersion = 1;
+static constexpr uint32_t kFlagCommentsRemoved = 1 << 0;
+
+struct JobFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t block_count;
+    uint64_t payload_size;
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint64_t source_hash;
+    uint32_t source_path_len;
+    uint32_t reserved;
+};
+
+// FNV-1a hash of the whole content behind "fd" starting at the current
+// position. Returns false on read error.
+static bool HashFileContent(int fd, uint64_t *hash) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    char buffer[1 << 16];
+    ssize_t r;
+    while ((r = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t i = 0; i < r; ++i) {
+            h = (h ^ (uint8_t)buffer[i]) * 0x100000001b3ULL;
+        }
+    }
+    *hash = h;
+    return r == 0;
+}
+
+static bool HashFile(const char *filename, uint64_t *hash) {
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+    const bool success = HashFileContent(fd, hash);
+    close(fd);
+    return success;
+}
+
+static bool reliable_write(int fd, const void *data, size_t len) {
+    const char *buffer = (const char *)data;
+    while (len) {
+        const ssize_t w = write(fd, buffer, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        len -= w;
+        buffer += w;
+    }
+    return true;
+}
+
+bool CompileJob(const char *source_file, const char *job_file,
+                bool remove_comments, size_t buffer_size) {
+    const int source_fd = open(source_file, O_RDONLY);
+    struct stat st;
+    if (source_fd < 0 || fstat(source_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Can't compile '%s': need a regular gcode file.\n",
+                source_file);
+        if (source_fd >= 0) close(source_fd);
+        return false;
+    }
+
+    JobFileHeader header = {};
+    memcpy(header.magic, kJobMagic, sizeof(kJobMagic));
+    header.version = kJobVersion;
+    header.flags = remove_comments ? kFlagCommentsRemoved : 0;
+    header.source_size = st.st_size;
+    header.source_mtime = st.st_mtime;
+    if (!HashFileContent(source_fd, &header.source_hash) ||
+        lseek(source_fd, 0, SEEK_SET) != 0) {
+        perror("Reading source");
+        close(source_fd);
+        return false;
+    }
+    // Compressed sources are decompressed; the hash stays the one of the
+    // file as-is, which is what the stale check compares against.
+    std::string error;
+    std::unique_ptr<ByteSource> source = ByteSource::Create(source_fd, &error);
+    if (!source) {
+        fprintf(stderr, "%s: %s\n", source_file, error.c_str());
+        close(source_fd);
+        return false;
+    }
+
+    char *const abs_path = realpath(source_file, nullptr);
+    const std::string source_path = abs_path ? abs_path : source_file;
+    free(abs_path);
+    header.source_path_len = source_path.size();
+
+    // Write to temporary file first, so that an interrupted compile never
+    // leaves a truncated job behind.
+    const std::string tmp_file = std::string(job_file) + ".tmp";
+    const int out_fd = open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        fprintf(stderr, "Can't write %s: %s\n", tmp_file.c_str(),
+                strerror(errno));
+        close(source_fd);
+        return false;
+    }
+
+    bool success = reliable_write(out_fd, &header, sizeof(header)) &&
+                   reliable_write(out_fd, source_path.data(), source_path.size());
+
+    // Payload. Blocks are collected in a chunk to write larger pieces.
+    std::vector<uint64_t> offsets;
+    uint64_t payload_size = 0;
+    {
+        BufferedLineReader reader(std::move(source), buffer_size,
+                                  remove_comments);
+        std::string chunk;
+        std::string_view lines[256];
+        while (success && !reader.is_eof()) {
+            const size_t count = reader.ReadNextLines(lines, 256);
+            for (size_t i = 0; i < count; ++i) {
+                offsets.push_back(payload_size);
+                payload_size += lines[i].size();
+                chunk.append(lines[i].data(), lines[i].size());
+            }
+            if (chunk.size() > (1 << 20) || reader.is_eof()) {
+                success &= reliable_write(out_fd, chunk.data(), chunk.size());
+                chunk.clear();
+            }
+        }
+    }
+    close(source_fd);
+    offsets.push_back(payload_size);
+
+    header.block_count = offsets.size() - 1;
+    header.payload_size = payload_size;
+    success &= reliable_write(out_fd, offsets.data(),
+                              offsets.size() * sizeof(uint64_t));
+    success &= (pwrite(out_fd, &header, sizeof(header), 0) == sizeof(header));
+    success &= (close(out_fd) == 0);
+
+    if (!success || rename(tmp_file.c_str(), job_file) != 0) {
+        fprintf(stderr, "Failed writing %s: %s\n", job_file, strerror(errno));
+        unlink(tmp_file.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool IsCompiledJob(int fd) {
+    char magic[sizeof(kJobMagic)];
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+           memcmp(magic, kJobMagic, sizeof(magic)) == 0;
+}
+
+CompiledJobReader::CompiledJobReader(const char *mapped, size_t mapped_size)
+    : mapped_(mapped), mapped_size_(mapped_size) {}
+
+CompiledJobReader::~CompiledJobReader() {
+    munmap((void *)mapped_, mapped_size_);
+}
+
+CompiledJobReader *CompiledJobReader::Open(int fd, std::string *error) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(JobFileHeader)) {
+        *error = "Not a compiled job";
+        return nullptr;
+    }
+    void *const m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED) {
+        *error = strerror(errno);
+        return nullptr;
+    }
+    madvise(m, st.st_size, MADV_SEQUENTIAL);
+    CompiledJobReader *result = new CompiledJobReader((const char *)m,
+                                                      st.st_size);
+    JobFileHeader header;
+    memcpy(&header, m, sizeof(header));
+    const uint64_t table_size = (header.block_count + 1) * sizeof(uint64_t);
+    if (memcmp(header.magic, kJobMagic, sizeof(kJobMagic)) != 0 ||
+        header.version != kJobVersion ||
+        header.block_count >= (uint64_t)st.st_size ||
+        header.payload_size >= (uint64_t)st.st_size ||
+        sizeof(header) + header.source_path_len + header.payload_size +
+                table_size !=
+            (uint64_t)st.st_size) {
+        *error = "Not a compiled job or incompatible version";
+        delete result;
+        return nullptr;
+    }
+    result->removed_comments_ = (header.flags & kFlagCommentsRemoved) != 0;
+    result->block_count_ = header.block_count;
+    result->payload_size_ = header.payload_size;
+    const char *const path_start = result->mapped_ + sizeof(header);
+    result->payload_ = path_start + header.source_path_len;
+    result->offsets_ = result->payload_ + header.payload_size;
+
+    // Check if the source changed since. Size and modification time are
+    // quick to check; only if they differ, look at the content as it might
+    // have just been touched.
+    // If the source is not around anymore, we can't say; just use the job.
+    const std::string source_path(path_start, header.source_path_len);
+    struct stat source_st;
+    if (stat(source_path.c_str(), &source_st) == 0 &&
+        ((uint64_t)source_st.st_size != header.source_size ||
+         source_st.st_mtime != header.source_mtime)) {
+        uint64_t hash;
+        if (!HashFile(source_path.c_str(), &hash) ||
+            hash != header.source_hash) {
+            *error = "Source '" + source_path +
+                     "' changed since compile. Please re-compile.";
+            delete result;
+            return nullptr;
+        }
+    }
+    return result;
+}
+
+size_t CompiledJobReader::ReadNextLines(std::string_view *lines, size_t n,
+                                        uint64_t *positions) {
+    size_t count = 0;
+    uint64_t start;
+    memcpy(&start, offsets_ + next_block_ * sizeof(uint64_t), sizeof(start));
+    while (count < n && next_block_ < block_count_) {
+        uint64_t end;
+        ++next_block_;
+        memcpy(&end, offsets_ + next_block_ * sizeof(uint64_t), sizeof(end));
+        if (end < start || end > payload_size_) {
+            fprintf(stderr, "Corrupt offset table in compiled job.\n");
+            next_block_ = block_count_;
+            break;
+        }
+        if (positions) positions[count] = next_block_;
+        lines[count++] = std::string_view(payload_ + start, end - start);
+        start = end;
+    }
+    return count;
+}
+
+bool CompiledJobReader::Seek(uint64_t position) {
+    next_block_ = std::min(position, block_count_);
+    return true;
+}
@@ -0,0 +1,67 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#ifndef COMPILED_JOB_H
+#define COMPILED_JOB_H
+
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+
+#include "block-source.h"
+
+// A compiled job is a gcode file already preprocessed by the
+// BufferedLineReader, so that repeated sends don't need to tokenize again.
+//
+// File layout (all integers in host byte order):
+//   - JobFileHeader
+//   - path of the source file (header.source_path_len bytes)
+//   - payload: all blocks, each terminated by newline, back to back.
+//   - offset table: header.block_count + 1 uint64_t offsets of the start of
+//     each block relative to the payload start; the last is the payload end.
+//
+// The header contains size, modification time and a content hash of the
+// source, so that a stale compiled job of a changed source can be detected.
+
+// Compile the gcode file "source_file" into "job_file". Returns success;
+// prints errors to stderr.
+bool CompileJob(const char *source_file, const char *job_file,
+                bool remove_comments, size_t buffer_size);
+
+// Returns true if the file behind "fd" is a compiled job.
+bool IsCompiledJob(int fd);
+
+// Block source streaming the blocks of a memory mapped compiled job.
+class CompiledJobReader : public BlockSource {
+   public:
+    // Open compiled job from "fd". Checks if the source it was compiled from
+    // changed in the meantime. Returns nullptr on failure and sets "error".
+    static CompiledJobReader *Open(int fd, std::string *error);
+    ~CompiledJobReader() override;
+
+    // Positions are block numbers.
+    size_t ReadNextLines(std::string_view *lines, size_t n,
+                         uint64_t *positions = nullptr) override;
+    bool Seek(uint64_t position) override;
+    bool is_eof() const override { return next_block_ >= block_count_; }
+    bool blocks_stay_valid() const override { return true; }  // Mapped.
+
+    uint64_t block_count() const { return block_count_; }
+    bool removed_comments() const { return removed_comments_; }
+
+   private:
+    CompiledJobReader(const char *mapped, size_t mapped_size);
+
+    const char *const mapped_;
+    const size_t mapped_size_;
+    const char *payload_ = nullptr;
+    uint64_t payload_size_ = 0;
+    const char *offsets_ = nullptr;  // Possibly unaligned uint64_t table.
+    uint64_t block_count_ = 0;
+    uint64_t next_block_ = 0;
+    bool removed_comments_ = true;
+};
+
+#endif  // COMPILED_JOB_H
@@ -0,0 +1,118 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "control-socket.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  // Not available on macOS; SO_NOSIGPIPE instead.
+#endif
+
+// Longest command line accepted; clients sending longer are disconnected.
+static constexpr size_t kMaxCommandLength = 1024;
+
+ControlSocket *ControlSocket::Create(const char *path,
+                                     MachineConnection *machine,
+                                     CommandHandler handler) {
+    struct sockaddr_un address = {};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "%s: control socket path too long\n", path);
+        return nullptr;
+    }
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+
+    // A socket left behind by a previous run is in the way.
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("control socket");
+        return nullptr;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(fd, 4) < 0) {
+        perror(path);
+        close(fd);
+        return nullptr;
+    }
+    return new ControlSocket(path, fd, machine, std::move(handler));
+}
+
+ControlSocket::ControlSocket(const char *path, int listen_fd,
+                             MachineConnection *machine,
+                             CommandHandler handler)
+    : path_(path),
+      listen_fd_(listen_fd),
+      machine_(machine),
+      handler_(std::move(handler)) {
+    machine_->WatchReadable(listen_fd_, [this]() { Accept(); });
+}
+
+ControlSocket::~ControlSocket() {
+    while (!clients_.empty()) Disconnect(clients_.begin()->first);
+    machine_->WatchReadable(listen_fd_, nullptr);
+    close(listen_fd_);
+    unlink(path_.c_str());
+}
+
+void ControlSocket::Accept() {
+    const int fd = accept(listen_fd_, nullptr, nullptr);
+    if (fd < 0) return;  // Gone already, or interrupted.
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+    // A client gone away must not kill us with SIGPIPE.
+    const int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    clients_[fd].clear();
+    machine_->WatchReadable(fd, [this, fd]() { Serve(fd); });
+}
+
+void ControlSocket::Serve(int fd) {
+    char buffer[512];
+    const ssize_t r = read(fd, buffer, sizeof(buffer));
+    if (r < 0 && (errno == EINTR || errno == EAGAIN)) return;
+    if (r <= 0) {
+        Disconnect(fd);
+        return;
+    }
+    std::string &input = clients_[fd];
+    input.append(buffer, r);
+    size_t eol;
+    while ((eol = input.find('\n')) != std::string::npos) {
+        std::string_view command(input.data(), eol);
+        if (!command.empty() && command.back() == '\r') {
+            command.remove_suffix(1);
+        }
+        const std::string answer = handler_(command);
+        input.erase(0, eol + 1);
+        // Answers are short and fit the socket buffer of a client that
+        // reads them; one that doesn't is not waited for.
+        if (send(fd, answer.data(), answer.size(),
+                 MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)answer.size()) {
+            Disconnect(fd);
+            return;
+        }
+    }
+    if (input.size() > kMaxCommandLength) Disconnect(fd);
+}
+
+void ControlSocket::Disconnect(int fd) {
+    machine_->WatchReadable(fd, nullptr);
+    clients_.erase(fd);
+    close(fd);
+}
@@ -0,0 +1,50 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#ifndef CONTROL_SOCKET_H
+#define CONTROL_SOCKET_H
+
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+
+#include "machine-connection.h"
+
+// Unix domain socket to monitor and control a running job with a simple
+// line protocol: each line received is a command, answered with one line.
+//
+// It is served from the event loop of the machine connection, so it does
+// not need a thread of its own, and a slow client never stalls streaming:
+// a client that doesn't take its answers right away is disconnected.
+class ControlSocket {
+   public:
+    // Returns the answer to a command line, including the newline.
+    using CommandHandler = std::function<std::string(std::string_view)>;
+
+    // Listen on "path", replacing a stale socket there, and serve it in
+    // the event loop of "machine". Returns nullptr and prints an error on
+    // failure.
+    static ControlSocket *Create(const char *path, MachineConnection *machine,
+                                 CommandHandler handler);
+
+    // Closes all connections and removes the socket.
+    ~ControlSocket();
+
+   private:
+    ControlSocket(const char *path, int listen_fd, MachineConnection *machine,
+                  CommandHandler handler);
+
+    void Accept();
+    void Serve(int fd);
+    void Disconnect(int fd);
+
+    const std::string path_;
+    const int listen_fd_;
+    MachineConnection *const machine_;
+    const CommandHandler handler_;
+    std::map<int, std::string> clients_;  // Incomplete input by fd.
+};
+
+#endif  // CONTROL_SOCKET_H
@@ -0,0 +1,124 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "fd-poller.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+
+static uint32_t ToEpollEvents(uint32_t events) {
+    uint32_t result = 0;
+    if (events & FDPoller::kReadable) result |= EPOLLIN;
+    if (events & FDPoller::kWritable) result |= EPOLLOUT;
+    return result;
+}
+
+FDPoller::FDPoller() : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)) {
+    if (epoll_fd_ < 0) perror("epoll_create1()");
+}
+
+FDPoller::~FDPoller() { close(epoll_fd_); }
+
+bool FDPoller::Set(int fd, uint32_t events) {
+    if (auto found = always_ready_.find(fd); found != always_ready_.end()) {
+        if (events == 0) {
+            always_ready_.erase(found);
+        } else {
+            found->second = events;
+        }
+        return true;
+    }
+    auto found = watched_.find(fd);
+    if (events == 0) {
+        if (found == watched_.end()) return true;
+        watched_.erase(found);
+        return epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr) == 0;
+    }
+    struct epoll_event ev = {};
+    ev.events = ToEpollEvents(events);
+    ev.data.fd = fd;
+    const int op = (found == watched_.end()) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl(epoll_fd_, op, fd, &ev) < 0) {
+        if (errno == EPERM) {  // Regular file or similar; always ready.
+            always_ready_[fd] = events;
+            return true;
+        }
+        perror("epoll_ctl()");
+        return false;
+    }
+    watched_[fd] = events;
+    return true;
+}
+
+int FDPoller::Wait(int timeout_ms) {
+    if (!always_ready_.empty()) timeout_ms = 0;
+    struct epoll_event events[16];
+    const int count = epoll_wait(epoll_fd_, events, 16, timeout_ms);
+    ready_list_.clear();
+    if (count < 0 && errno != EINTR) return -1;
+
+    for (int i = 0; i < count; ++i) {
+        const uint32_t ev = events[i].events;
+        const int fd = events[i].data.fd;
+        ready_list_.emplace_back(
+            fd, ((ev & (EPOLLIN | EPOLLERR)) ? kReadable : 0) |
+                    ((ev & EPOLLOUT) ? kWritable : 0) |
+                    ((ev & (EPOLLHUP | EPOLLERR)) ? kHangup : 0));
+    }
+    return AddAlwaysReady();
+}
+
+#else
+
+FDPoller::FDPoller() {}
+FDPoller::~FDPoller() {}
+
+void FDPoller::RebuildPollSet() {
+    poll_set_.clear();
+    for (const auto &[fd, events] : watched_) {
+        struct pollfd p = {};
+        p.fd = fd;
+        p.events = ((events & kReadable) ? POLLIN : 0) |
+                   ((events & kWritable) ? POLLOUT : 0);
+        poll_set_.push_back(p);
+    }
+}
+
+// poll() has no trouble with regular files, so no need for always_ready_.
+bool FDPoller::Set(int fd, uint32_t events) {
+    if (events == 0) {
+        watched_.erase(fd);
+    } else {
+        watched_[fd] = events;
+    }
+    RebuildPollSet();
+    return true;
+}
+
+int FDPoller::Wait(int timeout_ms) {
+    const int count = poll(poll_set_.data(), poll_set_.size(), timeout_ms);
+    ready_list_.clear();
+    if (count < 0 && errno != EINTR) return -1;
+
+    for (int i = 0; count > 0 && i < (int)poll_set_.size(); ++i) {
+        const short ev = poll_set_[i].revents;
+        if (ev == 0) continue;
+        ready_list_.emplace_back(
+            poll_set_[i].fd,
+            ((ev & (POLLIN | POLLERR)) ? kReadable : 0) |
+                ((ev & POLLOUT) ? kWritable : 0) |
+                ((ev & (POLLHUP | POLLERR | POLLNVAL)) ? kHangup : 0));
+    }
+    return AddAlwaysReady();
+}
+#endif
+
+int FDPoller::AddAlwaysReady() {
+    for (const auto &[fd, ev] : always_ready_) ready_list_.emplace_back(fd, ev);
+    return ready_list_.size();
+}
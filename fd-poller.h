@@ -0,0 +1,67 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#ifndef FD_POLLER_H
+#define FD_POLLER_H
+
+#include <stdint.h>
+
+#include <map>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__) && !defined(USE_POLL)
+#define USE_EPOLL
+#else
+#include <poll.h>
+#endif
+
+// Readiness notification for a set of file descriptors.
+// Uses epoll() on Linux, poll() everywhere else. The set of watched file
+// descriptors is kept between calls, so waiting does not need to re-build
+// anything.
+//
+// File descriptors that epoll() can't watch (e.g. regular files when the
+// output is redirected) are always reported ready, just as poll() does.
+class FDPoller {
+   public:
+    // Event bits.
+    static constexpr uint32_t kReadable = 1 << 0;
+    static constexpr uint32_t kWritable = 1 << 1;
+    static constexpr uint32_t kHangup = 1 << 2;  // Reported, not requested.
+
+    FDPoller();
+    ~FDPoller();
+
+    FDPoller(const FDPoller &) = delete;
+    FDPoller &operator=(const FDPoller &) = delete;
+
+    // Set events to watch for on "fd". Adds fd if not yet watched.
+    // An "events" value of 0 stops watching the file descriptor.
+    bool Set(int fd, uint32_t events);
+
+    // Wait up to "timeout_ms" (-1: forever) for any of the watched events.
+    // Returns number of ready file descriptors, 0 on timeout, -1 on error.
+    int Wait(int timeout_ms);
+
+    // File descriptors with the events that occured in the last Wait().
+    using ReadyList = std::vector<std::pair<int, uint32_t>>;
+    const ReadyList &ready() const { return ready_list_; }
+
+   private:
+    // Add always_ready_ to ready_list_, return number of ready.
+    int AddAlwaysReady();
+
+    std::map<int, uint32_t> watched_;       // Regular pollable fds.
+    std::map<int, uint32_t> always_ready_;  // fds that can't be polled.
+    ReadyList ready_list_;
+#ifdef USE_EPOLL
+    int epoll_fd_;
+#else
+    void RebuildPollSet();
+    std::vector<struct pollfd> poll_set_;
+#endif
+};
+
+#endif  // FD_POLLER_H
@@ -0,0 +1,112 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "gcode-words.h"
+
+// More integer digits would overflow the fixed-point value.
+static constexpr int kMaxIntegerDigits = 12;
+static constexpr int kFractionDigits = 6;  // Digits of kValueScale.
+
+static bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+static bool IsBlank(char c) { return c == ' ' || c == '\t' || c == '\n'; }
+
+// Parse a number starting at "pos" into the fixed-point "value". Advances
+// "pos" behind it. Returns false if there is no valid number.
+static bool ParseFixedPoint(std::string_view text, size_t *pos,
+                            int64_t *value) {
+    size_t p = *pos;
+    bool negative = false;
+    if (p < text.size() && (text[p] == '-' || text[p] == '+')) {
+        negative = (text[p] == '-');
+        ++p;
+    }
+    int64_t result = 0;
+    int digits = 0;
+    for (; p < text.size() && IsDigit(text[p]); ++p, ++digits) {
+        if (digits >= kMaxIntegerDigits) return false;
+        result = result * 10 + (text[p] - '0');
+    }
+    int fraction_digits = 0;
+    bool round_up = false;
+    if (p < text.size() && text[p] == '.') {
+        for (++p; p < text.size() && IsDigit(text[p]); ++p, ++digits) {
+            if (fraction_digits < kFractionDigits) {
+                result = result * 10 + (text[p] - '0');
+                ++fraction_digits;
+            } else if (fraction_digits == kFractionDigits) {
+                round_up = (text[p] >= '5');  // First digit not kept.
+                ++fraction_digits;
+            }
+        }
+    }
+    if (digits == 0) return false;
+    for (; fraction_digits < kFractionDigits; ++fraction_digits) result *= 10;
+    if (round_up) ++result;
+    *value = negative ? -result : result;
+    *pos = p;
+    return true;
+}
+
+void WordTable::Clear() {
+    block_text_.clear();
+    first_word_.resize(1);
+    letters_.clear();
+    values_.clear();
+    word_offset_.clear();
+    word_length_.clear();
+}
+
+void WordTable::AddWord(char letter, int64_t value, size_t offset,
+                        size_t length) {
+    letters_.push_back(letter);
+    values_.push_back(value);
+    word_offset_.push_back(offset);
+    word_length_.push_back(length);
+}
+
+void WordTable::Add(std::string_view block) {
+    size_t pos = 0;
+    while (pos < block.size()) {
+        const char c = block[pos];
+        if (IsBlank(c)) {
+            ++pos;
+            continue;
+        }
+        if (c == ';') break;  // Comment up to the end of the block.
+        if (c == '(') {       // Comment up to closing parenthesis.
+            const size_t end = block.find(')', pos);
+            if (end == std::string_view::npos) break;
+            pos = end + 1;
+            continue;
+        }
+        const char upper = (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+        if (upper >= 'A' && upper <= 'Z') {
+            size_t number_pos = pos + 1;
+            while (number_pos < block.size() && IsBlank(block[number_pos]) &&
+                   block[number_pos] != '\n') {
+                ++number_pos;
+            }
+            int64_t value;
+            if (ParseFixedPoint(block, &number_pos, &value)) {
+                AddWord(upper, value, pos, number_pos - pos);
+                pos = number_pos;
+                continue;
+            }
+        }
+        // Not a letter with a number: keep the rest as it is.
+        size_t end = block.size();
+        while (end > pos && IsBlank(block[end - 1])) --end;
+        AddWord(kRawText, 0, pos, end - pos);
+        break;
+    }
+    block_text_.push_back(block);
+    first_word_.push_back(letters_.size());
+}
+
+size_t WordTable::Find(size_t b, char letter) const {
+    for (size_t w = first_word_[b]; w < first_word_[b + 1]; ++w) {
+        if (letters_[w] == letter) return w;
+    }
+    return word_count();
+}
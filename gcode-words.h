@@ -0,0 +1,72 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#ifndef GCODE_WORDS_H
+#define GCODE_WORDS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string_view>
+#include <vector>
+
+// Parsed words of a batch of gcode blocks, so that stages that need to
+// understand gcode don't have to re-parse the text.
+//
+// Stored as structure of arrays: per word the upper case letter, the value
+// as fixed-point number and the span of the word in the block text. The
+// arrays are kept between batches, so once they have grown to the batch
+// size, parsing does not allocate anymore.
+//
+// Everything of a block that is not a letter followed by a number, e.g. the
+// text of "M117 Hello", a checksum "*42" or expressions, ends up as one word
+// with the letter kRawText spanning to the end of the block.
+// Parenthesis and semicolon comments are skipped.
+class WordTable {
+   public:
+    // Values are in units of 1/kValueScale, rounded at the last digit.
+    static constexpr int64_t kValueScale = 1000000;
+
+    // Letter of the not further parsed rest of a block.
+    static constexpr char kRawText = '\0';
+
+    static double ToDouble(int64_t value) { return (double)value / kValueScale; }
+
+    void Clear();
+
+    // Parse "block" and append its words. The block text must stay valid as
+    // long as the table is used.
+    void Add(std::string_view block);
+
+    size_t block_count() const { return block_text_.size(); }
+    std::string_view block_text(size_t b) const { return block_text_[b]; }
+
+    // The words of block "b" are [first_word(b), first_word(b + 1)).
+    size_t first_word(size_t b) const { return first_word_[b]; }
+    size_t word_count() const { return letters_.size(); }
+
+    char letter(size_t w) const { return letters_[w]; }
+    int64_t value(size_t w) const { return values_[w]; }
+
+    // Text of word "w" of block "b" as in the source.
+    std::string_view word_text(size_t b, size_t w) const {
+        return block_text_[b].substr(word_offset_[w], word_length_[w]);
+    }
+
+    // Find the first word with "letter" in block "b". Returns the word
+    // index or word_count() if there is none.
+    size_t Find(size_t b, char letter) const;
+
+   private:
+    void AddWord(char letter, int64_t value, size_t offset, size_t length);
+
+    std::vector<std::string_view> block_text_;
+    std::vector<uint32_t> first_word_ = {0};  // One more than blocks.
+    std::vector<char> letters_;
+    std::vector<int64_t> values_;
+    std::vector<uint32_t> word_offset_;  // Relative to the block text.
+    std::vector<uint32_t> word_length_;
+};
+
+#endif  // GCODE_WORDS_H
@@ -0,0 +1,744 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "job-streamer.h"
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+// After a resend request, repeated requests for the same line caused by the
+// blocks in flight behind it are ignored. If it then stays silent this long,
+// a request was not a repetition after all, so the blocks are re-sent again.
+static constexpr int kResendSettleMs = 1000;
+
+// While paused, check the control socket and machine this often.
+static constexpr int kPausedPollMs = 100;
+
+// Interval to write the checkpoint file while streaming.
+static constexpr int64_t kCheckpointIntervalMicros = 1000000;
+
+// Times the ack timeout expires for a block, trying the timeout policy,
+// before giving up.
+static constexpr int kMaxTimeoutRetries = 3;
+
+// Format block as "N<line> <block>*<checksum>\n" with the RepRap checksum:
+// the XOR of all characters before the '*'.
+static void FormatNumberedBlock(int line_number, std::string_view block,
+                                std::string *out) {
+    if (!block.empty() && block.back() == '\n') block.remove_suffix(1);
+    char prefix[16];
+    out->assign(prefix, snprintf(prefix, sizeof(prefix), "N%d ", line_number));
+    out->append(block);
+    uint8_t checksum = 0;
+    for (const char c : *out) checksum ^= c;
+    char suffix[8];
+    out->append(suffix, snprintf(suffix, sizeof(suffix), "*%u\n", checksum));
+}
+
+// Probe query as sent: realtime commands without newline.
+static std::string ProbeLine(const char *query) {
+    const std::string line(query);
+    if (line.size() == 1 && !isalnum(line[0])) return line;
+    return line + "\n";
+}
+
+// Time on top of the ack timeout for blocks that take long until they are
+// acknowledged: the dwell time of G4 (S in seconds; P is milliseconds in
+// Marlin, but seconds in Grbl and LinuxCNC, so a dwell gets the longer of
+// the two readings), and the homing timeout for homing, bed leveling,
+// waiting for heat-up and waiting for moves to finish.
+static int64_t ExtraAllowanceMs(std::string_view block, int homing_ms) {
+    if (block.size() >= 2 && block[0] == '$' && toupper(block[1]) == 'H') {
+        return homing_ms;  // Grbl homing cycle.
+    }
+    bool dwell = false;
+    bool long_running = false;
+    double p = 0, s = 0;
+    size_t i = 0;
+    while (i < block.size()) {
+        const char letter = toupper(block[i++]);
+        if (letter == ';' || letter == '(') break;  // Comment.
+        if (!isalpha(letter)) continue;
+        double value = 0, divisor = 1;
+        bool fraction = false;
+        for (; i < block.size(); ++i) {
+            if (block[i] == '.' && !fraction) {
+                fraction = true;
+            } else if (isdigit(block[i])) {
+                value = value * 10 + (block[i] - '0');
+                if (fraction) divisor *= 10;
+            } else {
+                break;
+            }
+        }
+        value /= divisor;
+        switch (letter) {
+        case 'G':
+            if (value == 4) dwell = true;
+            if (value == 28 || value == 29) long_running = true;
+            break;
+        case 'M':
+            if (value == 109 || value == 190 || value == 191 || value == 400) {
+                long_running = true;
+            }
+            break;
+        case 'P': p = value; break;
+        case 'S': s = value; break;
+        }
+    }
+    if (long_running) return homing_ms;
+    if (dwell) return (p > 0) ? p * 1000 : s * 1000;
+    return 0;
+}
+
+JobStreamer::JobStreamer(const std::string &name, MachineConnection *machine,
+                         const StreamOptions &options, size_t ring_capacity,
+                         const Checkpoint &progress, AsyncLogWriter *log)
+    : name_(name),
+      machine_(machine),
+      options_(options),
+      use_ok_flow_control_(options.use_ok_flow_control && machine != nullptr),
+      classifier_(*options.classifier),
+      log_(log),
+      blocks_(std::max(options.max_window, ring_capacity)),
+      stats_(blocks_.capacity(), options.keep_trace),  // Any window.
+      progress_(progress),
+      // With adaptive flow control, start conservatively until the machine
+      // tells about its buffers.
+      max_window_(options.max_window),
+      window_(options.adaptive_window ? 1 : options.max_window),
+      wire_sizes_(blocks_.capacity()),
+      numbered_blocks_(options.use_line_numbers ? options.max_window : 0),
+      probe_line_(ProbeLine(options.probe_query)) {
+    to_send_.reserve(options_.max_window);  // Grows with a larger window.
+    if (options_.checkpoint_file) {
+        checkpoint_writer_ =
+            std::make_unique<CheckpointWriter>(options_.checkpoint_file);
+    }
+}
+
+bool JobStreamer::Connect(int squash_chatter_ms, FILE *echo_chatter) {
+    if (!machine_) return true;
+    if (!ResetLineNumber(squash_chatter_ms, echo_chatter)) {
+        done_.store(true, std::memory_order_release);  // Not going to Run().
+        return false;
+    }
+    return true;
+}
+
+bool JobStreamer::ResetLineNumber(int squash_chatter_ms, FILE *echo_chatter) {
+    // If there is some initial chatter, ignore it, until there is some time
+    // silence on the wire.
+    // That way, we only get OK responses to our requests.
+    // Even without OK flow control, we need to wait as machine might
+    // just reset on connect.
+    DiscardRemaining(squash_chatter_ms, echo_chatter);
+    if (!options_.use_line_numbers) return true;
+
+    // Tell the machine that the next block is N1.
+    std::string reset;
+    FormatNumberedBlock(0, "M110 N0", &reset);
+    const int timeout_ms =
+        (options_.ack_timeout_ms > 0) ? options_.ack_timeout_ms : -1;
+    if (!machine_->WriteBlocks({reset}) || !machine_->Flush(timeout_ms)) {
+        return false;
+    }
+    while (use_ok_flow_control_) {
+        std::string_view msg;
+        switch (ReadResponseLine(timeout_ms, &msg)) {
+        case ResponseType::kOk: return true;
+        case ResponseType::kError:
+            fprintf(stderr, "%s%sM110: %.*s\n", name_.c_str(),
+                    name_.empty() ? "" : ": ", (int)msg.size(), msg.data());
+            return false;
+        case ResponseType::kTimeout:
+            fprintf(stderr, "%s%sM110: No response\n", name_.c_str(),
+                    name_.empty() ? "" : ": ");
+            timed_out_ = true;
+            return false;
+        default: break;
+        }
+    }
+    return true;
+}
+
+void JobStreamer::DiscardRemaining(int timeout_ms, FILE *echo) {
+    if (!machine_) return;
+    // Not yet handled responses go, too.
+    for (; response_next_ < response_count_; ++response_next_) {
+        const std::string_view line = responses_[response_next_];
+        if (echo) fprintf(echo, "%.*s\n", (int)line.size(), line.data());
+    }
+    machine_->DiscardPendingInput(timeout_ms, echo);
+}
+
+// Read and classify response from machine. Lines starting with 'ok'
+// acknowledge a block, 'error' or 'alarm' report an error; keepalive
+// and status messages are recognized as such, everything else is a message
+// (e.g. output of current temperature values).
+ResponseType JobStreamer::ReadResponseLine(int timeout_ms,
+                                           std::string_view *message) {
+    if (!use_ok_flow_control_) {
+        return ResponseType::kOk;  // Don't read, always assume 'ok'.
+    }
+
+    if (response_next_ == response_count_) {
+        response_next_ = 0;
+        response_count_ =
+            machine_->ReadLines(timeout_ms, responses_, kResponseBatch);
+        if (response_count_ == 0) {
+            if (timeout_ms >= 0 && !machine_->is_closed()) {
+                return ResponseType::kTimeout;
+            }
+            *message = "Nothing received from machine: Connection closed";
+            return ResponseType::kError;
+        }
+        classifier_.Classify(responses_, response_count_, response_types_);
+    }
+    *message = responses_[response_next_];
+    return response_types_[response_next_++];
+}
+
+// Very crude error handling 'ui'. If this is an interactive session we can ask
+// the user to decide.
+bool JobStreamer::HandleError() {
+#define ALERT_ON  "\033[41m\033[30m"
+#define ALERT_OFF "\033[0m"
+
+    SaveProgress();
+    if (options_.ask_on_error) {
+        fprintf(stderr, ALERT_ON
+                "[ Didn't get OK. Continue: ENTER; stop: CTRL-C ]" ALERT_OFF
+                "\n");
+        getchar();
+        return true;
+    }
+    if (name_.empty()) {
+        fprintf(stderr,
+                "[ Received error. Non-interactive session "
+                "does not allow for user feedback. Bailing out.]"
+                "\n");
+    } else {
+        fprintf(stderr, "[ %s: Received error. Stopping this machine. ]\n",
+                name_.c_str());
+    }
+    return false;
+}
+
+void JobStreamer::SaveProgress() {
+    log_->Flush();
+    if (checkpoint_writer_) {
+        checkpoint_writer_->Save(progress_);
+        checkpoint_writer_->Flush();
+    }
+}
+
+JobStreamer::Outcome JobStreamer::TimedOut(const Block &request,
+                                           const char *what,
+                                           bool *request_printed) {
+    LogResponse(request, ResponseType::kError, what, request_printed);
+    if (name_.empty()) log_->Printf("\n");  // Complete the message line.
+    SaveProgress();
+    if (name_.empty()) {
+        fprintf(stderr, "[ Machine not responding. Bailing out. ]\n");
+    } else {
+        fprintf(stderr, "[ %s: Machine not responding. Stopping this "
+                "machine. ]\n", name_.c_str());
+    }
+    timed_out_ = true;
+    return Outcome::kFailed;
+}
+
+void JobStreamer::WaitWhilePaused() {
+    if (!machine_ || machine_->is_closed()) {
+        usleep(kPausedPollMs * 1000);
+    } else {
+        // Everything sent is out, so that what follows, e.g. a feed hold,
+        // doesn't wait behind it.
+        machine_->Drain(kPausedPollMs);
+        if (use_ok_flow_control_) {
+            // Nothing is in flight, but the machine might still answer,
+            // e.g. the requests to resend a block that we count.
+            std::string_view msg;
+            const ResponseType response = ReadResponseLine(kPausedPollMs, &msg);
+            if (response == ResponseType::kOk) {
+                if (swallow_oks_ > 0) --swallow_oks_;
+            } else if (response == ResponseType::kError ||
+                       response == ResponseType::kResend ||
+                       response == ResponseType::kMessage) {
+                if (options_.print_communication ||
+                    options_.print_unusual_messages ||
+                    response == ResponseType::kError) {
+                    log_->Printf("%s%s>> %s%.*s%s\n", name_.c_str(),
+                                 name_.empty() ? "" : ": ",
+                                 options_.message_on, (int)msg.size(),
+                                 msg.data(), options_.message_off);
+                }
+            }
+        } else {
+            machine_->Poll(kPausedPollMs);
+        }
+    }
+    last_progress_ = GetMonotonicMicros();  // The watchdog waits, too.
+}
+
+std::string JobStreamer::HandleCommand(std::string_view command) {
+    const size_t space = command.find(' ');
+    const std::string_view verb = command.substr(0, space);
+    std::string_view args = (space == std::string_view::npos)
+                                ? std::string_view()
+                                : command.substr(space + 1);
+    char answer[320];
+    if (verb == "status") {
+        const int64_t elapsed = GetMonotonicMicros() - stats_.start_time();
+        const double rate = (stats_.start_time() > 0 && elapsed > 0)
+                                ? stats_.blocks_acknowledged() * 1e6 / elapsed
+                                : 0.0;
+        int len = snprintf(
+            answer, sizeof(answer),
+            "ok block=%d position=%" PRIu64
+            " in_flight=%zu bytes_in_flight=%zu window=%zu "
+            "max_window=%zu blocks_per_second=%.1f paused=%d done=%d",
+            progress_.block, progress_.position, blocks_in_flight_,
+            bytes_in_flight_, window_, max_window_, rate, paused_, done());
+        const uint64_t total = options_.total_blocks;
+        if (total > 0) {
+            // Estimate of the remaining time at the rate so far; -1: none.
+            const uint64_t remaining =
+                total - std::min<uint64_t>(total, progress_.block);
+            len += snprintf(answer + len, sizeof(answer) - len,
+                            " total_blocks=%" PRIu64 " eta_seconds=%.0f",
+                            total, rate > 0 ? remaining / rate : -1.0);
+        }
+        snprintf(answer + len, sizeof(answer) - len, "\n");
+        return answer;
+    }
+    if (verb == "window") {
+        const long count = atol(std::string(args).c_str());
+        if (count < 1 || (size_t)count > blocks_.capacity()) {
+            snprintf(answer, sizeof(answer),
+                     "error window needs count 1..%zu\n", blocks_.capacity());
+            return answer;
+        }
+        max_window_ = count;
+        window_ = options_.adaptive_window ? std::min(window_, max_window_)
+                                           : max_window_;
+        if (options_.use_line_numbers &&
+            numbered_blocks_.size() < max_window_) {
+            numbered_blocks_.resize(max_window_);
+        }
+        return "ok\n";
+    }
+    if (verb == "pause" || verb == "resume") {
+        paused_ = (verb == "pause");
+        return "ok\n";
+    }
+    if (verb == "realtime") {
+        if (!machine_) return "error no machine\n";
+        std::string bytes;
+        while (!args.empty()) {
+            const size_t end = std::min(args.find(' '), args.size());
+            const std::string arg(args.substr(0, end));
+            args.remove_prefix(std::min(end + 1, args.size()));
+            if (arg.empty()) continue;
+            if (arg.size() == 1) {
+                bytes.push_back(arg[0]);
+            } else if (arg.size() > 2 && arg[0] == '0' &&
+                       tolower(arg[1]) == 'x') {
+                bytes.push_back((char)strtol(arg.c_str() + 2, nullptr, 16));
+            } else {
+                return "error realtime takes characters or 0x<hex>\n";
+            }
+        }
+        if (bytes.empty()) return "error nothing to send\n";
+        return machine_->SendRealtime(bytes) ? "ok\n" : "error failed\n";
+    }
+    return "error unknown command; try status, window <count>, pause, "
+           "resume, realtime <byte>...\n";
+}
+
+bool JobStreamer::Run() {
+    int idle_rounds = 0;
+    bool success = true;
+    stats_.Start();
+    last_progress_ = GetMonotonicMicros();
+    while (!blocks_.at_end()) {
+        if (!SendWindow()) {
+            SaveProgress();
+            fprintf(stderr, "%s%sCouldn't write!\n", name_.c_str(),
+                    name_.empty() ? "" : ": ");
+            success = false;
+            break;
+        }
+        if (paused_ && blocks_in_flight_ == 0) {
+            WaitWhilePaused();
+            continue;
+        }
+        if (blocks_in_flight_ == 0) {  // Waiting for input.
+            const int64_t wait_start = GetMonotonicMicros();
+            // Keep serving the control socket meanwhile.
+            if (machine_) machine_->Poll(0);
+            BackoffWait(&idle_rounds);
+            last_progress_ = GetMonotonicMicros();  // Not the machine's fault.
+            stats_.AddInputStall(last_progress_ - wait_start);
+            continue;
+        }
+        idle_rounds = 0;
+
+        const int64_t wait_start = GetMonotonicMicros();
+        AdvancedOk buffer_state;
+        const Outcome outcome = AwaitResponse(&buffer_state);
+        if (outcome == Outcome::kFailed) {
+            success = false;
+            break;
+        }
+        if (outcome == Outcome::kRewound) continue;  // Back to sending.
+        Acknowledged(wait_start, buffer_state);
+    }
+    // Without flow control, the end of the job is when all is transmitted.
+    if (success && machine_ &&
+        !machine_->Drain(options_.ack_timeout_ms > 0 ? options_.ack_timeout_ms
+                                                     : -1)) {
+        fprintf(stderr, "%s%sCouldn't write!\n", name_.c_str(),
+                name_.empty() ? "" : ": ");
+        success = false;
+    }
+    stats_.Finish();
+    // Nothing may write the checkpoint once the job is done and it is
+    // removed.
+    if (checkpoint_writer_) checkpoint_writer_->Flush();
+    done_.store(true, std::memory_order_release);
+    return success;
+}
+
+bool JobStreamer::SendWindow() {
+    // Sliding window: send as many of the not yet sent blocks as the
+    // window allows, so that every acknowledged block immediately makes
+    // room for the next one.
+    // With a byte budget, the sum of bytes in flight must not exceed the
+    // receive buffer of the machine. A single block larger than the
+    // budget is sent once nothing else is in flight.
+    to_send_.clear();
+    if (paused_) return true;
+    const size_t available = std::min(blocks_.size(), window_);
+    while (blocks_in_flight_ < available) {
+        std::string_view block = blocks_.at(blocks_in_flight_).text;
+        if (options_.use_line_numbers) {
+            std::string &numbered = numbered_blocks_[to_send_.size()];
+            FormatNumberedBlock(first_line_number_ + blocks_in_flight_, block,
+                                &numbered);
+            block = numbered;
+        }
+        if (options_.byte_budget > 0 && blocks_in_flight_ > 0 &&
+            bytes_in_flight_ + block.size() > (size_t)options_.byte_budget) {
+            break;
+        }
+        to_send_.push_back(block);
+        bytes_in_flight_ += block.size();
+        wire_size(blocks_in_flight_) = block.size();
+        ++blocks_in_flight_;
+    }
+    if (to_send_.empty()) return true;
+
+    const int64_t now = GetMonotonicMicros();
+    const size_t first_new = blocks_in_flight_ - to_send_.size();
+    for (size_t i = 0; i < to_send_.size(); ++i) {
+        stats_.BlockSent(blocks_.at(first_new + i).line_no, to_send_[i].size(),
+                         now);
+    }
+    if (!machine_) return true;
+
+    // Without flow control, there is no waiting for responses where
+    // the queued blocks are written, so do it here.
+    return machine_->WriteBlocks(to_send_) &&
+           (use_ok_flow_control_ ||
+            machine_->Flush(options_.ack_timeout_ms > 0
+                                ? options_.ack_timeout_ms
+                                : -1));
+}
+
+void JobStreamer::LogResponse(const Block &request, ResponseType response,
+                              std::string_view message,
+                              bool *request_printed) {
+    const int request_len = (int)request.text.size() - 1;
+    if (response != ResponseType::kOk) {
+        while (!message.empty() && isspace(*(message.end() - 1))) {
+            message.remove_suffix(1);
+        }
+    }
+
+    // With multiple machines, lines are printed complete at once, so that
+    // they don't get mixed up.
+    if (!name_.empty()) {
+        if (response == ResponseType::kOk) {
+            log_->Printf("%s: %6d\t%.*s%s\n", name_.c_str(), request.line_no,
+                         request_len, request.text.data(),
+                         use_ok_flow_control_ ? " << OK" : "");
+        } else {
+            log_->Printf("%s: %6d\t%.*s >> %s%.*s%s\n", name_.c_str(),
+                         request.line_no, request_len, request.text.data(),
+                         options_.message_on, (int)message.size(),
+                         message.data(), options_.message_off);
+        }
+        return;
+    }
+
+    const bool first = !*request_printed;
+    *request_printed = true;
+    if (response == ResponseType::kOk) {
+        const char *const ok = use_ok_flow_control_ ? "<< OK\n" : "\n";
+        if (first) {
+            log_->Printf("%6d\t%.*s %s", request.line_no, request_len,
+                         request.text.data(), ok);
+        } else {
+            log_->Printf("%s", ok);
+        }
+    } else {
+        if (first) {
+            log_->Printf("%6d\t%.*s ", request.line_no, request_len,
+                         request.text.data());
+        }
+        log_->Printf("\n%s%.*s%s", options_.message_on, (int)message.size(),
+                     message.data(), options_.message_off);
+    }
+}
+
+JobStreamer::Outcome JobStreamer::AwaitResponse(AdvancedOk *buffer_state) {
+    // Now looking at the expected response for the oldest outstanding
+    // block to confirm success.
+    // Response to a gcode-block can be multiple lines and are expected
+    // to finish with either "ok" or "error".
+    // If communication printing requested, print the lines together with
+    // their corresponding response.
+    //
+    // The watchdog gives each block its allowance until acknowledged; a
+    // busy keepalive of the machine starts it over (status reports and
+    // Marlin's idle 'wait' don't). Independent of that, it
+    // stops if no block is acknowledged for the stall timeout.
+    const Block &request = blocks_.at(0);
+    bool request_line_already_printed = false;
+    const bool watchdog =
+        options_.ack_timeout_ms > 0 || options_.stall_timeout_ms > 0;
+    const int64_t extra_allowance =
+        watchdog ? ExtraAllowanceMs(request.text, options_.homing_timeout_ms) *
+                       1000
+                 : 0;
+    int64_t wait_start = GetMonotonicMicros();
+    bool probe_pending = false;  // Sent probe, waiting for any response.
+    for (;;) {
+        // Wait until the earliest deadline.
+        int64_t ack_deadline = -1;
+        if (options_.ack_timeout_ms > 0) {
+            ack_deadline = wait_start +
+                           options_.ack_timeout_ms * int64_t{1000} +
+                           (probe_pending ? 0 : extra_allowance);
+        }
+        int64_t stall_deadline = -1;
+        if (options_.stall_timeout_ms > 0) {
+            stall_deadline = last_progress_ +
+                             options_.stall_timeout_ms * int64_t{1000} +
+                             extra_allowance;
+        }
+        int timeout_ms = ignored_resend_ ? kResendSettleMs : -1;
+        const int64_t now = GetMonotonicMicros();
+        for (const int64_t deadline : {ack_deadline, stall_deadline}) {
+            if (deadline < 0) continue;
+            const int ms = std::max<int64_t>(0, (deadline - now + 999) / 1000);
+            timeout_ms = (timeout_ms < 0) ? ms : std::min(timeout_ms, ms);
+        }
+
+        std::string_view print_msg;
+        ResponseType response = ReadResponseLine(timeout_ms, &print_msg);
+
+        int timeout_resend_from = -1;  // Resend without request.
+        if (response == ResponseType::kTimeout) {
+            const int64_t expired = GetMonotonicMicros();
+            if (stall_deadline >= 0 && expired >= stall_deadline) {
+                timeout_message_ = "(No progress in " +
+                                   std::to_string(options_.stall_timeout_ms /
+                                                  1000) +
+                                   "s)";
+                return TimedOut(request, timeout_message_.c_str(),
+                                &request_line_already_printed);
+            }
+            if (ack_deadline >= 0 && expired >= ack_deadline) {
+                if (probe_pending) {
+                    return TimedOut(request, "(No response to probe)",
+                                    &request_line_already_printed);
+                }
+                if (++timeouts_ > kMaxTimeoutRetries ||
+                    options_.on_timeout == TimeoutPolicy::kAbort) {
+                    return TimedOut(request, "(No 'ok' in time)",
+                                    &request_line_already_printed);
+                }
+                if (options_.on_timeout == TimeoutPolicy::kProbe) {
+                    LogResponse(request, ResponseType::kMessage,
+                                "(No 'ok' in time; probing)",
+                                &request_line_already_printed);
+                    // Realtime queries go ahead of the blocks in flight.
+                    const bool realtime = (probe_line_.back() != '\n');
+                    if (!(realtime ? machine_->SendRealtime(probe_line_)
+                                   : machine_->WriteBlocks({probe_line_}))) {
+                        return TimedOut(request, "(Couldn't write probe)",
+                                        &request_line_already_printed);
+                    }
+                    if (!realtime) ++swallow_oks_;
+                    probe_pending = true;
+                    wait_start = expired;
+                    continue;
+                }
+                ignored_resend_ = false;
+                ignore_resends_ = 0;
+                timeout_resend_from = first_line_number_;
+                print_msg = "(No 'ok' in time; resending)";
+            } else if (ignored_resend_) {
+                // An ignored request was real: handle it now.
+                ignored_resend_ = false;
+                ignore_resends_ = 0;
+                timeout_resend_from = last_resend_;
+                print_msg = "(No response; resending)";
+            } else {
+                continue;  // Woke up early or settled already.
+            }
+            response = ResponseType::kResend;
+        }
+        if (probe_pending) {
+            // Any response: the machine is alive, give the block its
+            // allowance again.
+            probe_pending = false;
+            wait_start = GetMonotonicMicros();
+        }
+        if (response == ResponseType::kBusy ||
+            response == ResponseType::kStatus) {
+            // Keepalive chatter: still waiting for 'ok'.
+            if (response == ResponseType::kBusy) {
+                wait_start = GetMonotonicMicros();
+            }
+            continue;
+        }
+        if (!options_.use_line_numbers && response == ResponseType::kResend) {
+            response = ResponseType::kMessage;  // Nothing we can do.
+        }
+        const bool resend_timeout = (timeout_resend_from >= 0);
+        if (response == ResponseType::kOk && swallow_oks_ > 0) {
+            --swallow_oks_;  // Completing a resend request.
+            continue;
+        }
+        // Line number and checksum errors are followed by a resend
+        // request that we can answer.
+        if (options_.use_line_numbers && response == ResponseType::kError &&
+            print_msg.find("Last Line") != std::string_view::npos) {
+            response = ResponseType::kMessage;
+        }
+        if (options_.adaptive_window && response == ResponseType::kOk) {
+            ParseAdvancedOk(print_msg, buffer_state);
+        }
+
+        // Now we know enough if we should print the original
+        // request. Whenever there is some unusual stuff going on, we
+        // want to print the original message first before the response.
+        const bool needs_printing =
+            (options_.print_communication ||      // regular chatter
+             response == ResponseType::kError ||  // always print error
+             (options_.print_unusual_messages &&
+              response != ResponseType::kOk));
+        if (needs_printing) {
+            LogResponse(request, response, print_msg,
+                        &request_line_already_printed);
+        }
+
+        if (response == ResponseType::kError && !HandleError()) {
+            return Outcome::kFailed;
+        }
+
+        if (response == ResponseType::kResend) {
+            ++swallow_oks_;  // The request is finished with an 'ok'.
+            const int resend_from = resend_timeout
+                                        ? timeout_resend_from
+                                        : ParseResendRequest(print_msg);
+            if (resend_from == last_resend_ && ignore_resends_ > 0) {
+                // Blocks after a lost one also fail; already handled.
+                --ignore_resends_;
+                ignored_resend_ = true;
+                continue;
+            }
+            if (resend_timeout) --swallow_oks_;  // No request, no 'ok'.
+            if (resend_from < first_line_number_ ||
+                resend_from >=
+                    first_line_number_ + (int)blocks_in_flight_) {
+                log_->Printf("\n%s%sCan't resend N%d: not in flight.\n",
+                             name_.c_str(), name_.empty() ? "" : ": ",
+                             resend_from);
+                if (!HandleError()) return Outcome::kFailed;
+                continue;
+            }
+            // Rewind: the blocks starting with the requested one are
+            // not in flight anymore and will be sent again.
+            const size_t keep = resend_from - first_line_number_;
+            ignore_resends_ = blocks_in_flight_ - keep - 1;
+            ignored_resend_ = false;
+            last_resend_ = resend_from;
+            stats_.BlocksRewound(blocks_in_flight_ - keep);
+            for (size_t i = keep; i < blocks_in_flight_; ++i) {
+                bytes_in_flight_ -= wire_size(i);
+            }
+            blocks_in_flight_ = keep;
+            return Outcome::kRewound;
+        }
+        if (response == ResponseType::kOk ||
+            response == ResponseType::kError) {
+            return Outcome::kAcknowledged;
+        }
+    }
+}
+
+void JobStreamer::Acknowledged(int64_t wait_start,
+                               const AdvancedOk &buffer_state) {
+    const Block &request = blocks_.at(0);
+    const int64_t acknowledge_time = GetMonotonicMicros();
+    stats_.AddFlowControlStall(acknowledge_time - wait_start);
+    stats_.BlockAcknowledged(acknowledge_time);
+    last_progress_ = acknowledge_time;
+    timeouts_ = 0;
+    progress_.block = request.line_no;
+    progress_.position = request.position;
+    // Written and synced to disk by the writer thread.
+    if (checkpoint_writer_ &&
+        acknowledge_time - last_checkpoint_ >= kCheckpointIntervalMicros) {
+        checkpoint_writer_->Save(progress_);
+        last_checkpoint_ = acknowledge_time;
+    }
+    bytes_in_flight_ -= wire_size(0);
+    ++wire_sizes_first_;
+    --blocks_in_flight_;
+    blocks_.PopFront();
+    ++first_line_number_;
+    if (first_line_number_ > last_resend_) {  // Resent successfully.
+        ignore_resends_ = 0;
+        ignored_resend_ = false;
+    }
+
+    // Adaptive window: as many blocks as the machine's command buffer
+    // holds. The free slots are reported as of the time of the 'ok', not
+    // counting the blocks still on their way, so adding them to the blocks
+    // in flight would overflow the buffer. But the most free slots seen,
+    // e.g. with the buffer empty at the first 'ok', are its size: learned
+    // once, not tracked. Without the buffer state reported, there is
+    // nothing to learn; the free planner slots say nothing about the
+    // command buffer, so keep to the static window.
+    if (options_.adaptive_window) {
+        if (buffer_state.rx_free >= 0) {
+            machine_slots_ =
+                std::max(machine_slots_, (size_t)buffer_state.rx_free);
+            window_ = std::clamp(machine_slots_, (size_t)1, max_window_);
+        } else if (machine_slots_ == 0) {
+            window_ = std::min(options_.static_window, max_window_);
+        }
+    }
+}
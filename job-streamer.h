@@ -0,0 +1,213 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#ifndef JOB_STREAMER_H
+#define JOB_STREAMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "async-log-writer.h"
+#include "block-ring.h"
+#include "checkpoint.h"
+#include "machine-connection.h"
+#include "response-classifier.h"
+#include "stream-stats.h"
+
+// What to do if the machine doesn't acknowledge a block in time.
+enum class TimeoutPolicy {
+    kResend,  // Re-send the blocks in flight (needs line numbers).
+    kProbe,   // Send a status query to see if the machine is still alive.
+    kAbort,   // Stop streaming.
+};
+
+// How to stream a job. The same for all machines a job is sent to.
+struct StreamOptions {
+    bool use_ok_flow_control = true;  // Wait for 'ok' response.
+    size_t max_window = 1;            // Max number of blocks in flight.
+    int byte_budget = 0;              // Max bytes in flight; 0: no limit
+    bool adaptive_window = false;     // Learn from Marlin ADVANCED_OK.
+    size_t static_window = 1;  // Adaptive, but no buffer state reported.
+    bool use_line_numbers = false;    // N<line> ... *<checksum>
+    bool print_communication = true;     // Log every block and response.
+    bool print_unusual_messages = true;  // Messages outside handshake.
+    bool ask_on_error = false;  // Ask user to continue; otherwise stop.
+    bool keep_trace = false;    // Keep send/acknowledge time of each block.
+    const ResponseClassifier *classifier = nullptr;
+    const char *checkpoint_file = nullptr;  // Progress for resume.
+    uint64_t total_blocks = 0;              // Of the job; 0: unknown.
+    const char *message_on = "";   // Highlight unusual messages...
+    const char *message_off = "";  // ...with these terminal escapes.
+
+    // Watchdog. Timeouts of 0 wait forever.
+    int ack_timeout_ms = 0;      // For the 'ok' of each block...
+    int homing_timeout_ms = 0;   // ...of homing and waiting for heat-up.
+    int stall_timeout_ms = 0;    // No block acknowledged at all: abort.
+    TimeoutPolicy on_timeout = TimeoutPolicy::kAbort;
+    // Status query of TimeoutPolicy::kProbe. A single non-alphanumeric
+    // character is sent as realtime command, e.g. Grbl '?'.
+    const char *probe_query = "M105";
+};
+
+// Streams the blocks of a job to one machine with sliding window flow
+// control, handling its responses, resend requests and errors.
+//
+// The blocks come through the ring, fed by a producer thread that reads the
+// input; blocks sent but not acknowledged yet stay in the ring until their
+// 'ok' arrives. To send one job to multiple machines, the producer reads and
+// tokenizes the input once and feeds the rings of all streamers, which each
+// run in their own thread with their own window and error handling.
+class JobStreamer {
+   public:
+    // Stream to "machine", or just read all blocks if it is nullptr
+    // (dry-run). If "name" is not empty, log lines are prefixed with it to
+    // tell apart multiple machines. "progress" is the block the job starts
+    // after, kept up to date with the acknowledged blocks.
+    JobStreamer(const std::string &name, MachineConnection *machine,
+                const StreamOptions &options, size_t ring_capacity,
+                const Checkpoint &progress, AsyncLogWriter *log);
+
+    // Get the machine into a clean state to start: discard initial chatter
+    // until "squash_chatter_ms" of silence, then reset line numbers if
+    // needed. Returns success.
+    bool Connect(int squash_chatter_ms, FILE *echo_chatter);
+
+    // Stream all blocks pushed into blocks() until it is closed. Returns
+    // true if all have been sent and acknowledged, false if streaming
+    // stopped on an error.
+    bool Run();
+
+    // Discard whatever the machine still says after the job.
+    void DiscardRemaining(int timeout_ms, FILE *echo);
+
+    // Answer a command of the control socket. Called from the event loop
+    // of the machine connection, i.e. in the thread running the streamer.
+    //   status             : progress, window and throughput; with the
+    //                        total of the job also the time remaining
+    //   window <count>     : change the maximum number of blocks in flight
+    //   pause, resume      : stop and continue sending new blocks
+    //   realtime <byte>... : send realtime commands, e.g. '!' or 0x91
+    std::string HandleCommand(std::string_view command);
+
+    BlockRing *blocks() { return &blocks_; }  // Producer side.
+
+    // Run() has returned, so the ring does not need to be fed anymore.
+    bool done() const { return done_.load(std::memory_order_acquire); }
+
+    // Streaming stopped because the machine did not respond in time.
+    bool timed_out() const { return timed_out_; }
+
+    const std::string &name() const { return name_; }
+    bool is_dry_run() const { return machine_ == nullptr; }
+    const Checkpoint &progress() const { return progress_; }
+    const StreamStats &stats() const { return stats_; }
+
+   private:
+    enum class Outcome { kAcknowledged, kRewound, kFailed };
+
+    // Send as many of the not yet sent blocks as the window allows.
+    bool SendWindow();
+
+    // Wait for the response to the oldest block in flight.
+    Outcome AwaitResponse(AdvancedOk *buffer_state);
+
+    // The oldest block is acknowledged; make room for the next.
+    void Acknowledged(int64_t wait_start, const AdvancedOk &buffer_state);
+
+    // Discard initial chatter, then tell the machine the next line number.
+    bool ResetLineNumber(int squash_chatter_ms, FILE *echo_chatter);
+
+    // Paused with nothing in flight: keep the event loop running.
+    void WaitWhilePaused();
+
+    // Read one response line; kOk without flow control. Lines are read in
+    // batches: all already received, e.g. a burst of 'ok's for a deep
+    // window, come out of one read() and are classified together.
+    ResponseType ReadResponseLine(int timeout_ms, std::string_view *message);
+
+    // Log response to "request". The request line is printed before the first
+    // response that needs printing; "request_printed" keeps track of it.
+    void LogResponse(const Block &request, ResponseType response,
+                     std::string_view message, bool *request_printed);
+
+    // Error from the machine: ask the user to continue if possible.
+    // Returns true if streaming should continue.
+    bool HandleError();
+
+    // Flush the log and write the checkpoint before stopping.
+    void SaveProgress();
+
+    // The machine didn't respond in time: report and stop.
+    Outcome TimedOut(const Block &request, const char *what,
+                     bool *request_printed);
+
+    // Bytes sent for block at(i), which is in flight.
+    uint32_t &wire_size(size_t i) {
+        return wire_sizes_[(wire_sizes_first_ + i) & (wire_sizes_.size() - 1)];
+    }
+
+    const std::string name_;
+    MachineConnection *const machine_;
+    const StreamOptions options_;
+    const bool use_ok_flow_control_;
+    const ResponseClassifier &classifier_;
+    AsyncLogWriter *const log_;
+
+    // Responses read, but not handled yet; valid until the next read.
+    static constexpr size_t kResponseBatch = 64;
+    std::string_view responses_[kResponseBatch];
+    ResponseType response_types_[kResponseBatch];
+    size_t response_count_ = 0;
+    size_t response_next_ = 0;
+
+    BlockRing blocks_;
+    StreamStats stats_;
+    Checkpoint progress_;     // Last acknowledged block.
+    std::unique_ptr<CheckpointWriter> checkpoint_writer_;  // With -C.
+    int64_t last_checkpoint_ = 0;
+    std::atomic<bool> done_{false};
+
+    // Limit of blocks in flight; max_window, unless changed with the
+    // control socket. With adaptive flow control, window_ is the current
+    // number of blocks allowed in flight; otherwise always max_window_.
+    size_t max_window_;
+    size_t window_;
+    size_t machine_slots_ = 0;  // Buffer size as reported with ADVANCED_OK.
+    bool paused_ = false;  // Don't send new blocks.
+
+    // The first "blocks_in_flight_" in the ring have been sent to the
+    // machine, but are not acknowledged yet.
+    size_t blocks_in_flight_ = 0;
+    size_t bytes_in_flight_ = 0;  // Sum of sizes of blocks in flight.
+    // Sizes as sent, with line number and checksum; a ring like blocks_.
+    std::vector<uint32_t> wire_sizes_;
+    size_t wire_sizes_first_ = 0;  // Of blocks_.at(0).
+    std::vector<std::string_view> to_send_;
+
+    // With line numbers, the block at(i) in the ring is sent with line
+    // number first_line_number_ + i. The blocks in flight stay in the ring
+    // until acknowledged, so they can be re-sent from there on request.
+    int first_line_number_ = 1;
+    std::vector<std::string> numbered_blocks_;
+    int swallow_oks_ = 0;          // 'ok's that belong to resend requests.
+    int last_resend_ = -1;         // Line number of last resend request.
+    int ignore_resends_ = 0;       // Repeated requests due to blocks in flight.
+    bool ignored_resend_ = false;  // Might need to re-send after timeout.
+
+    // Watchdog state.
+    const std::string probe_line_;  // Probe query as sent.
+    int64_t last_progress_ = 0;     // Time of last acknowledged block.
+    int timeouts_ = 0;              // Since last acknowledged block.
+    bool timed_out_ = false;
+    std::string timeout_message_;
+};
+
+#endif  // JOB_STREAMER_H
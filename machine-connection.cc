@@ -4,22 +4,31 @@
 
 #include "machine-connection.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <charconv>
 #include <map>
 #include <string>
 
+#include "monotonic-clock.h"
+
 #if defined(__APPLE__)
 #include <IOKit/serial/ioss.h>
 #endif
@@ -99,7 +108,116 @@ static bool SetTTYSpeed(int fd, tty_termios_t *tty, int speed_number) {
     return true;
 }
 
-static bool SetTTYParams(int fd, std::string_view parameters) {
+// Bit rates tried with "bauto", fastest first.
+static constexpr int kProbeBitRates[] = {1000000, 500000, 250000, 230400,
+                                         115200,  57600,  38400,  19200,
+                                         9600};
+
+// Time to wait for a clean response at each bit rate probed.
+static constexpr int kProbeTimeoutMs = 1500;
+static constexpr int kProbeSilenceMs = 100;  // Until the response is over.
+
+// Harmless query answered by most controllers: temperatures on Marlin,
+// 'ok' on Smoothie, an error on Grbl. Any clean response counts.
+static constexpr char kProbeQuery[] = "M105\n";
+
+// Minimum pacing limit, so that small blocks don't go out byte by byte.
+static constexpr int kMinPacedBytes = 16;
+
+// Serial link options of the connection string beyond the termios flags.
+struct LinkOptions {
+    int bit_rate = 115200;
+    std::vector<int> probe_bit_rates;  // Non-empty: "bauto"
+    int pace_ms = 0;  // Limit of the output queue in wire time; 0: none.
+    int output_queue_limit = 0;  // Bytes in the kernel queue; 0: no limit.
+    bool sync_writes = false;    // O_SYNC: each write() waits.
+};
+
+static bool ApplyTTYParams(int fd, const tty_termios_t &tty) {
+#ifdef USE_TERMIOS
+    if (tcsetattr(fd, TCSANOW, &tty) != 0) {
+        printf("Error from tcsetattr: %s\n", strerror(errno));
+        return false;
+    }
+#else
+    if (ioctl(fd, TCSETS2, &tty)) {
+        printf("ioctl(TCSETS2) failed: %s\n", strerror(errno));
+        return false;
+    }
+#endif
+    return true;
+}
+
+static void FlushTTY(int fd) {
+#ifdef USE_TERMIOS
+    tcflush(fd, TCIOFLUSH);
+#else
+    ioctl(fd, TCFLSH, TCIOFLUSH);
+#endif
+}
+
+// Wait until everything is transmitted.
+static bool DrainTTY(int fd) {
+#ifdef USE_TERMIOS
+    return tcdrain(fd) == 0;
+#else
+    return ioctl(fd, TCSBRK, 1) == 0;  // What tcdrain() does.
+#endif
+}
+
+// Is everything received at the probed bit rate plain text with at least
+// one complete line ? At the wrong rate, it is mostly garbage.
+static bool IsCleanResponse(std::string_view received) {
+    for (const char c : received) {
+        const bool printable = (c >= ' ' && c <= '~');
+        if (!printable && c != '\r' && c != '\n' && c != '\t') return false;
+    }
+    const size_t eol = received.find_first_of("\r\n");
+    return eol != std::string_view::npos &&
+           received.find_first_not_of(" \t\r\n") < eol;
+}
+
+// Send the probe query at each of "bit_rates" and return the first one
+// that gets a clean response, or -1 if none does.
+static int ProbeBitRate(int fd, tty_termios_t *tty,
+                        const std::vector<int> &bit_rates) {
+#ifdef USE_TERMIOS
+    const std::map<int, speed_t> selectable_speeds = AvailableTTYSpeeds();
+#endif
+    for (const int rate : bit_rates) {
+#ifdef USE_TERMIOS
+        if (selectable_speeds.find(rate) == selectable_speeds.end()) continue;
+#endif
+        if (!SetTTYSpeed(fd, tty, rate) || !ApplyTTYParams(fd, *tty)) {
+            continue;
+        }
+        FlushTTY(fd);
+        if (write(fd, kProbeQuery, strlen(kProbeQuery)) < 0) {
+            perror("Probing bit rate");
+            return -1;
+        }
+        std::string received;
+        int timeout_ms = kProbeTimeoutMs;
+        bool clean = false;
+        struct pollfd pfd = {fd, POLLIN, 0};
+        while (poll(&pfd, 1, timeout_ms) > 0) {
+            char buffer[256];
+            const ssize_t r = read(fd, buffer, sizeof(buffer));
+            if (r <= 0) break;
+            received.append(buffer, r);
+            clean = IsCleanResponse(received);
+            if (clean) timeout_ms = kProbeSilenceMs;  // Rest of the response.
+        }
+        if (clean && IsCleanResponse(received)) {
+            FlushTTY(fd);
+            return rate;
+        }
+    }
+    return -1;
+}
+
+static bool SetTTYParams(int fd, std::string_view parameters,
+                         LinkOptions *link) {
     tty_termios_t tty;
 
 #ifdef USE_TERMIOS
@@ -131,19 +249,69 @@ static bool SetTTYParams(int fd, std::string_view parameters) {
     tty.c_cc[VMIN] = 1;
     tty.c_cc[VTIME] = 1;
 
-    SetTTYSpeed(fd, &tty, 115200);
+    SetTTYSpeed(fd, &tty, link->bit_rate);
     while (!parameters.empty()) {
         const auto pos = parameters.find(',');
-        const auto part_len =
-            (pos != std::string_view::npos) ? pos + 1 : parameters.size();
-        std::string_view param = parameters.substr(0, part_len);
-        parameters.remove_prefix(part_len);
+        std::string_view param = parameters.substr(0, pos);
+        parameters.remove_prefix(
+            (pos != std::string_view::npos) ? pos + 1 : parameters.size());
+        if (param.empty()) continue;
+
+        // Probe list "bauto" or "bauto:250000:115200".
+        if (param.substr(0, 5) == "bauto") {
+            link->probe_bit_rates.clear();
+            for (param.remove_prefix(5); !param.empty();) {
+                int rate;
+                auto r = std::from_chars(param.begin() + 1, param.end(), rate);
+                if (param[0] != ':' || r.ec != std::errc() || rate <= 0) {
+                    fprintf(stderr, "Invalid bit rate list\n");
+                    return false;
+                }
+                link->probe_bit_rates.push_back(rate);
+                param.remove_prefix(r.ptr - param.begin());
+            }
+            if (link->probe_bit_rates.empty()) {
+                link->probe_bit_rates.assign(std::begin(kProbeBitRates),
+                                             std::end(kProbeBitRates));
+            }
+            continue;
+        }
 
         if (param[0] == 'b' || param[0] == 'B') {
             int s;
             if (auto r = std::from_chars(param.begin() + 1, param.end(), s);
                 r.ec == std::errc()) {
                 if (!SetTTYSpeed(fd, &tty, s)) return false;
+                link->bit_rate = s;
+            }
+            continue;
+        }
+
+        if (param.substr(0, 5) == "outq=") {
+            if (auto r = std::from_chars(param.begin() + 5, param.end(),
+                                         link->output_queue_limit);
+                r.ec != std::errc() || r.ptr != param.end() ||
+                link->output_queue_limit <= 0) {
+                fprintf(stderr, "Invalid output queue limit %.*s\n",
+                        (int)param.size(), param.data());
+                return false;
+            }
+            continue;
+        }
+
+        if (param == "sync") {
+            link->sync_writes = true;
+            continue;
+        }
+
+        if (param.substr(0, 5) == "pace=") {
+            if (auto r = std::from_chars(param.begin() + 5, param.end(),
+                                         link->pace_ms);
+                r.ec != std::errc() || r.ptr != param.end() ||
+                link->pace_ms <= 0) {
+                fprintf(stderr, "Invalid pace %.*s\n", (int)param.size(),
+                        param.data());
+                return false;
             }
             continue;
         }
@@ -170,38 +338,29 @@ static bool SetTTYParams(int fd, std::string_view parameters) {
         }
     }
 
-#ifdef USE_TERMIOS
-    if (tcsetattr(fd, TCSANOW, &tty) != 0) {
-        printf("Error from tcsetattr: %s\n", strerror(errno));
-        return false;
-    }
-#else
-    if (ioctl(fd, TCSETS2, &tty)) {
-        printf("ioctl(TCSETS2) failed: %s\n", strerror(errno));
-        return false;
+    if (!ApplyTTYParams(fd, tty)) return false;
+    if (!link->probe_bit_rates.empty()) {
+        link->bit_rate = ProbeBitRate(fd, &tty, link->probe_bit_rates);
+        if (link->bit_rate < 0) {
+            fprintf(stderr, "No clean response at any probed bit rate\n");
+            return false;
+        }
+        fprintf(stderr, "Probed bit rate %d\n", link->bit_rate);
     }
-#endif
     return true;
 }
 
-// Wait for input to become ready for read or timeout reached.
-// If the file-descriptor becomes readable, returns number of milli-seconds
-// left.
-// Returns 0 on timeout (i.e. no millis left and nothing to be read).
-// Returns -1 on error.
-static int AwaitReadReady(int fd, int timeout_millis) {
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
-    FD_SET(fd, &read_fds);
-
-    struct timeval tv;
-    tv.tv_sec = timeout_millis / 1000;
-    tv.tv_usec = (timeout_millis % 1000) * 1000;
+// Remaining millis to "deadline"; -1 (forever) stays -1.
+static int RemainingMillis(int64_t deadline) {
+    if (deadline < 0) return -1;
+    return std::max<int64_t>(0, deadline - GetMonotonicMillis());
+}
 
-    FD_SET(fd, &read_fds);
-    int s = select(fd + 1, &read_fds, NULL, NULL, &tv);
-    if (s < 0) return -1;
-    return tv.tv_usec / 1000;
+// Switch file descriptor to non-blocking; returns previous flags.
+static int SetNonBlocking(int fd) {
+    const int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    return flags;
 }
 
 /*
@@ -210,58 +369,240 @@ static int AwaitReadReady(int fd, int timeout_millis) {
  *
  */
 
-int OpenTCPSocket(const char *host) {
-    char *host_copy = NULL;
-    const char *port = "8888";
-    const char *colon_pos;
-    if ((colon_pos = strchr(host, ':')) != NULL) {
-        port = colon_pos + 1;
-        host_copy = strdup(host);
-        host_copy[colon_pos - host] = '\0';
-        host = host_copy;
+// Socket options of the connection string "host:port,<options>".
+struct TCPOptions {
+    bool nodelay = true;  // No Nagle delay for small blocks.
+    bool keepalive = false;
+    int send_buffer = 0;     // SO_SNDBUF; 0: system default.
+    int receive_buffer = 0;  // SO_RCVBUF
+};
+
+// While connecting to one address, the next one is tried after this time
+// in parallel (RFC 8305 "happy eyeballs"), so that an unreachable first
+// address of a dual-stack host does not hold up the connection.
+static constexpr int kConnectAttemptDelayMs = 250;
+static constexpr int kConnectTimeoutMs = 10000;
+
+static bool ParseTCPParams(std::string_view parameters, TCPOptions *options) {
+    while (!parameters.empty()) {
+        const auto pos = parameters.find(',');
+        std::string_view param = parameters.substr(0, pos);
+        parameters.remove_prefix(
+            (pos != std::string_view::npos) ? pos + 1 : parameters.size());
+        if (param.empty()) continue;
+
+        int *size = nullptr;
+        if (param.substr(0, 7) == "sndbuf=") size = &options->send_buffer;
+        if (param.substr(0, 7) == "rcvbuf=") size = &options->receive_buffer;
+        if (size) {
+            if (auto r = std::from_chars(param.begin() + 7, param.end(), *size);
+                r.ec != std::errc() || r.ptr != param.end() || *size <= 0) {
+                fprintf(stderr, "Invalid buffer size %.*s\n",
+                        (int)param.size(), param.data());
+                return false;
+            }
+            continue;
+        }
+
+        // Flags can be with optional positive or negative prefix.
+        bool flag_positive = true;
+        if (param[0] == '+') {
+            param = param.substr(1);
+        } else if (param[0] == '-') {
+            flag_positive = false;
+            param = param.substr(1);
+        }
+        if (param == "nodelay") {
+            options->nodelay = flag_positive;
+        } else if (param == "keepalive") {
+            options->keepalive = flag_positive;
+        } else {
+            fprintf(stderr, "Unknown option %.*s\n", (int)param.size(),
+                    param.data());
+            return false;
+        }
+    }
+    return true;
+}
+
+static void SetTCPOptions(int fd, const TCPOptions &options) {
+    const int nodelay = options.nodelay;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    const int keepalive = options.keepalive;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
+    // Before connect(), so that the window scale is negotiated to match.
+    if (options.send_buffer > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &options.send_buffer,
+                   sizeof(options.send_buffer));
+    }
+    if (options.receive_buffer > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &options.receive_buffer,
+                   sizeof(options.receive_buffer));
+    }
+}
+
+// Connect to the first of "addresses" that answers. Attempts are started
+// one after another with kConnectAttemptDelayMs, alternating the address
+// families, and run in parallel. Returns the connected socket or -1.
+static int ConnectFirst(const struct addrinfo *addresses,
+                        const TCPOptions &options) {
+    // Alternate families, starting with the one getaddrinfo() prefers.
+    std::vector<const struct addrinfo *> primary, secondary;
+    for (const struct addrinfo *a = addresses; a; a = a->ai_next) {
+        (a->ai_family == addresses->ai_family ? primary : secondary)
+            .push_back(a);
+    }
+    std::vector<const struct addrinfo *> order;
+    for (size_t i = 0; i < std::max(primary.size(), secondary.size()); ++i) {
+        if (i < primary.size()) order.push_back(primary[i]);
+        if (i < secondary.size()) order.push_back(secondary[i]);
+    }
+
+    std::vector<struct pollfd> pending;
+    size_t next = 0;
+    int last_error = ETIMEDOUT;
+    const int64_t deadline = GetMonotonicMillis() + kConnectTimeoutMs;
+    int64_t next_attempt = 0;
+    int connected = -1;
+    while (connected < 0) {
+        const int64_t now = GetMonotonicMillis();
+        if (now >= deadline) break;
+        if (next < order.size() && (pending.empty() || now >= next_attempt)) {
+            const struct addrinfo *a = order[next++];
+            next_attempt = now + kConnectAttemptDelayMs;
+            const int fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (fd < 0) {
+                last_error = errno;
+                continue;
+            }
+            SetTCPOptions(fd, options);
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+                connected = fd;
+                break;
+            }
+            if (errno != EINPROGRESS) {
+                last_error = errno;
+                close(fd);
+                continue;
+            }
+            pending.push_back({fd, POLLOUT, 0});
+        }
+        if (pending.empty()) {
+            if (next >= order.size()) break;  // All failed.
+            continue;
+        }
+        int64_t wait_until = deadline;
+        if (next < order.size()) {
+            wait_until = std::min(wait_until, next_attempt);
+        }
+        if (poll(pending.data(), pending.size(),
+                 std::max<int64_t>(0, wait_until - now)) < 0) {
+            if (errno == EINTR) continue;
+            last_error = errno;
+            break;
+        }
+        for (size_t i = 0; i < pending.size();) {
+            if (pending[i].revents == 0) {
+                ++i;
+                continue;
+            }
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &error, &len);
+            if (error == 0 && connected < 0) {
+                connected = pending[i].fd;
+            } else {
+                if (error) last_error = error;
+                close(pending[i].fd);
+                next_attempt = 0;  // Failed: try the next one right away.
+            }
+            pending.erase(pending.begin() + i);
+        }
+    }
+    for (const struct pollfd &p : pending) close(p.fd);
+    if (connected < 0) {
+        fprintf(stderr, "TCP connect(): %s\n", strerror(last_error));
+        return -1;
+    }
+    fcntl(connected, F_SETFL, fcntl(connected, F_GETFL) & ~O_NONBLOCK);
+    return connected;
+}
+
+// Connect to "host:port,<options>"; IPv6 addresses in brackets:
+// "[::1]:4444".
+int OpenTCPSocket(const char *descriptor) {
+    std::string_view address = descriptor;
+    const size_t comma = address.find(',');
+    TCPOptions options;
+    if (comma != std::string_view::npos) {
+        if (!ParseTCPParams(address.substr(comma + 1), &options)) return -1;
+        address = address.substr(0, comma);
     }
+    std::string host(address);
+    std::string port = "8888";
+    size_t colon;
+    if (!address.empty() && address[0] == '[') {  // "[IPv6]:port"
+        const size_t bracket = address.find(']');
+        if (bracket == std::string_view::npos) {
+            fprintf(stderr, "Invalid address %s\n", host.c_str());
+            return -1;
+        }
+        host = address.substr(1, bracket - 1);
+        colon = (address.substr(bracket + 1, 1) == ":")
+                    ? bracket + 1
+                    : std::string_view::npos;
+    } else {
+        // More than one colon: plain IPv6 address without port.
+        colon = address.find(':');
+        if (colon != address.rfind(':')) colon = std::string_view::npos;
+        if (colon != std::string_view::npos) host = address.substr(0, colon);
+    }
+    if (colon != std::string_view::npos) port = address.substr(colon + 1);
     struct addrinfo addr_hints = {};
-    addr_hints.ai_family = AF_INET;
+    addr_hints.ai_family = AF_UNSPEC;
     addr_hints.ai_socktype = SOCK_STREAM;
 
     struct addrinfo *addr_result = NULL;
     int rc;
-    if ((rc = getaddrinfo(host, port, &addr_hints, &addr_result)) != 0) {
+    if ((rc = getaddrinfo(host.c_str(), port.c_str(), &addr_hints,
+                          &addr_result)) != 0) {
         // We're in OpenTCPSocket(), because opening as a tty failed before,
         // so make reference of that in this error message.
         fprintf(stderr,
                 "Not a tty and "
                 "can't resolve as TCP endpoint '%s' (port %s): %s\n",
-                host, port, gai_strerror(rc));
-        free(host_copy);
+                host.c_str(), port.c_str(), gai_strerror(rc));
         return -1;
     }
-    free(host_copy);
     if (addr_result == NULL) return -1;
-    int fd = socket(addr_result->ai_family, addr_result->ai_socktype,
-                    addr_result->ai_protocol);
-    if (fd >= 0 &&
-        connect(fd, addr_result->ai_addr, addr_result->ai_addrlen) < 0) {
-        perror("TCP connect()");
-        close(fd);
-        fd = -1;
-    }
-
+    const int fd = ConnectFirst(addr_result, options);
     freeaddrinfo(addr_result);
     return fd;
 }
 
-static int OpenTTY(std::string_view descriptor) {
+static int OpenTTY(std::string_view descriptor, LinkOptions *link) {
     auto first_comma = descriptor.find(',');
     const std::string path(descriptor.substr(0, first_comma));
     const std::string_view tty_params = (first_comma != std::string_view::npos)
                                             ? descriptor.substr(first_comma + 1)
                                             : "";
-    const int fd = open(path.c_str(), O_RDWR | O_NOCTTY | O_SYNC);
+    // Writes don't wait until the data is handed off; that would hold up
+    // queuing the next block. Use "sync" to get that anyway; O_SYNC can
+    // only be given to open(), not set later with fcntl().
+    bool sync_writes = false;
+    for (std::string_view params = tty_params; !params.empty();) {
+        const size_t end = std::min(params.find(','), params.size());
+        sync_writes |= (params.substr(0, end) == "sync");
+        params.remove_prefix(std::min(end + 1, params.size()));
+    }
+    const int fd =
+        open(path.c_str(), O_RDWR | O_NOCTTY | (sync_writes ? O_SYNC : 0));
     if (fd < 0) {
         return -1;
     }
-    if (!SetTTYParams(fd, tty_params)) {
+    if (!SetTTYParams(fd, tty_params, link)) {
+        close(fd);
         return -1;
     }
     return fd;
@@ -270,17 +611,44 @@ static int OpenTTY(std::string_view descriptor) {
 MachineConnection::MachineConnection(int to_machine, int from_machine)
     : output_fd_(to_machine),
       input_fd_(from_machine),
-      reader_(input_fd_, (1 << 16), false) {}
+      saved_output_flags_(SetNonBlocking(output_fd_)),
+      saved_input_flags_(SetNonBlocking(input_fd_)),
+      in_buffer_(1 << 16) {
+    if (pipe(realtime_pipe_) == 0) {
+        for (const int fd : realtime_pipe_) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+        poller_.Set(realtime_pipe_[0], FDPoller::kReadable);
+    } else {
+        perror("Realtime command pipe");
+    }
+    UpdateWatchedEvents();
+}
 
-MachineConnection::~MachineConnection() { close(output_fd_); }
+MachineConnection::~MachineConnection() {
+    // stdin/stdout might be shared with other processes; restore flags.
+    if (saved_input_flags_ >= 0) fcntl(input_fd_, F_SETFL, saved_input_flags_);
+    if (saved_output_flags_ >= 0) {
+        fcntl(output_fd_, F_SETFL, saved_output_flags_);
+    }
+    close(output_fd_);
+    for (const int fd : realtime_pipe_) {
+        if (fd >= 0) close(fd);
+    }
+}
 
 MachineConnection *MachineConnection::Open(const char *descriptor) {
     if (descriptor == nullptr) return nullptr;
     if (strcmp(descriptor, "-") == 0) {
         return new MachineConnection(STDOUT_FILENO, STDIN_FILENO);
     }
-    if (const int fd = OpenTTY(descriptor); fd >= 0) {
-        return new MachineConnection(fd, fd);
+    LinkOptions link;
+    if (const int fd = OpenTTY(descriptor, &link); fd >= 0) {
+        MachineConnection *const connection = new MachineConnection(fd, fd);
+        connection->SetLink(link.bit_rate, link.pace_ms,
+                            link.output_queue_limit);
+        return connection;
     }
     if (const int fd = OpenTCPSocket(descriptor); fd >= 0) {
         return new MachineConnection(fd, fd);
@@ -288,49 +656,386 @@ MachineConnection *MachineConnection::Open(const char *descriptor) {
     return nullptr;
 }
 
+void MachineConnection::SetLink(int bit_rate, int pace_ms,
+                                int output_queue_limit) {
+    is_tty_ = true;
+    wire_bytes_per_us_ = bit_rate / 10.0 / 1e6;  // Start, 8 data, stop bit.
+    if (pace_ms > 0) {
+        pace_limit_ = std::max<double>(kMinPacedBytes,
+                                       wire_bytes_per_us_ * pace_ms * 1000);
+    }
+    output_queue_limit_ = output_queue_limit;
+    pace_time_us_ = GetMonotonicMicros();
+}
+
+size_t MachineConnection::WriteAllowance() {
+    size_t allowance = SIZE_MAX;
+    if (pace_limit_ > 0) {
+        const int64_t now = GetMonotonicMicros();
+        pace_queued_ = std::max(
+            0.0, pace_queued_ - (now - pace_time_us_) * wire_bytes_per_us_);
+        pace_time_us_ = now;
+        allowance = (pace_queued_ < pace_limit_) ? pace_limit_ - pace_queued_
+                                                 : 0;
+    }
+    if (output_queue_limit_ > 0) {
+        int queued = 0;
+        if (ioctl(output_fd_, TIOCOUTQ, &queued) == 0) {
+            allowance = std::min<size_t>(
+                allowance, std::max(0, output_queue_limit_ - queued));
+        }
+    }
+    return allowance;
+}
+
+int MachineConnection::WriteWaitMillis() {
+    if (pace_limit_ <= 0 && output_queue_limit_ <= 0) return -1;
+    if (out_pos_ == out_buffer_.size()) return -1;
+    if (WriteAllowance() > 0) return 0;
+    // Until half of the limit is on the wire.
+    const double limit = (pace_limit_ > 0) ? pace_limit_ : output_queue_limit_;
+    return limit / 2 / wire_bytes_per_us_ / 1000 + 1;
+}
+
 int MachineConnection::DiscardPendingInput(int timeout_ms,
                                            FILE *echo_discarded) {
-    if (input_fd_ < 0) return 0;
+    ReleaseLines();
     int total_bytes = 0;
-    char buf[128];
-    while (AwaitReadReady(input_fd_, timeout_ms) > 0) {
-        int r = read(input_fd_, buf, sizeof(buf));
-        if (r < 0) {
-            perror("reading trouble");
-            return -1;
+    auto discard_buffered = [&]() {
+        const size_t len = in_end_ - in_begin_;
+        if (len > 0 && echo_discarded) {
+            fwrite(in_buffer_.data() + in_begin_, len, 1, echo_discarded);
         }
-        total_bytes += r;
-        if (r > 0 && echo_discarded) {
-            fwrite(buf, r, 1, echo_discarded);
+        total_bytes += len;
+        in_begin_ = in_end_ = in_kept_ = 0;
+    };
+    discard_buffered();
+    int64_t deadline = GetMonotonicMillis() + timeout_ms;
+    int remaining;
+    while (!closed_ && (remaining = RemainingMillis(deadline)) > 0) {
+        bool got_input = false;
+        if (!HandleIO(remaining, &got_input)) break;
+        if (got_input) {
+            discard_buffered();
+            deadline = GetMonotonicMillis() + timeout_ms;  // Not silent yet.
         }
     }
+    discard_buffered();
     return total_bytes;
 }
 
-// Write buffer to fd.
-static bool reliable_write(int fd, const char *buffer, int len) {
-    while (len) {
-        int w = write(fd, buffer, len);
-        if (w < 0) return false;
-        len -= w;
-        buffer += w;
+// Maximum number of iovecs passed to writev() at once.
+#if defined(IOV_MAX) && IOV_MAX < 1024
+static constexpr int kMaxIovecs = IOV_MAX;
+#else
+static constexpr int kMaxIovecs = 1024;
+#endif
+
+bool MachineConnection::SendRealtime(std::string_view bytes) {
+    if (realtime_pipe_[1] < 0) return false;
+    // Tells WriteBlocks() to look; the event loop sees the pipe readable.
+    realtime_sent_.fetch_add(1, std::memory_order_release);
+    while (!bytes.empty()) {
+        const ssize_t w = write(realtime_pipe_[1], bytes.data(), bytes.size());
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        bytes.remove_prefix(w);
     }
     return true;
 }
 
-// Write the sequence of string-views to file-descriptor.
-// Needs "scratch_buffer" to be large enough to contain all of them.
+void MachineConnection::TakeRealtime() {
+    char buffer[256];
+    ssize_t r;
+    while ((r = read(realtime_pipe_[0], buffer, sizeof(buffer))) > 0 ||
+           (r < 0 && errno == EINTR)) {
+        if (r > 0) realtime_out_.append(buffer, r);
+    }
+}
+
 bool MachineConnection::WriteBlocks(
-    char *scratch_buffer, const std::vector<std::string_view> &blocks) {
-    // Note: not using writev(), as snippets can be a lot and writev() has a
-    // bunch of limitations (e.g. UIO_MAXIOV == 1024). Thus simply
-    // reassmbling into buffer.
-    char *pos = scratch_buffer;
-    for (auto block : blocks) {
-        memcpy(pos, block.data(), block.size());
-        pos += block.size();
-    }
-    return reliable_write(output_fd_, scratch_buffer, pos - scratch_buffer);
+    const std::vector<std::string_view> &blocks) {
+    // Realtime commands waiting go first.
+    if (realtime_sent_.exchange(0, std::memory_order_acquire) > 0) {
+        TakeRealtime();
+    }
+    if (!realtime_out_.empty() && !WriteQueued()) return false;
+
+    if (out_pos_ == out_buffer_.size()) {
+        out_buffer_.clear();  // Keeps capacity; no allocations once warm.
+        out_pos_ = 0;
+    }
+
+    // Write the blocks straight from where they are, without copying them
+    // together first. As writev() can only handle a limited number of
+    // iovecs, this is done in chunks.
+    // If there is still data queued, we have to go behind it.
+    size_t first = 0;   // First block not fully written yet.
+    size_t offset = 0;  // Bytes of that block already written.
+    while (realtime_out_.empty() && out_pos_ == out_buffer_.size() &&
+           first < blocks.size()) {
+        // With pacing or a queue limit, only as much as may be queued.
+        size_t allowance = WriteAllowance();
+        if (allowance == 0) break;
+        struct iovec iov[kMaxIovecs];
+        int count = 0;
+        for (size_t i = first; i < blocks.size() && count < kMaxIovecs &&
+                               allowance > 0;
+             ++i) {
+            const size_t skip = (i == first) ? offset : 0;
+            iov[count].iov_base = (void *)(blocks[i].data() + skip);
+            iov[count].iov_len =
+                std::min(blocks[i].size() - skip, allowance);
+            allowance -= iov[count].iov_len;
+            ++count;
+        }
+        ssize_t w = writev(output_fd_, iov, count);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            perror("Writing to machine");
+            return false;
+        }
+        pace_queued_ += w;
+        // Partial writes can end anywhere, also in the middle of a block.
+        while (w > 0) {
+            const size_t left_in_block = blocks[first].size() - offset;
+            if ((size_t)w < left_in_block) {
+                offset += w;
+                break;
+            }
+            w -= left_in_block;
+            ++first;
+            offset = 0;
+        }
+    }
+
+    // Whatever the machine could not take right now is queued to be written
+    // in the event loop. Only this part needs a copy.
+    for (size_t i = first; i < blocks.size(); ++i) {
+        const size_t skip = (i == first) ? offset : 0;
+        out_buffer_.append(blocks[i].data() + skip, blocks[i].size() - skip);
+    }
+    const bool success = WriteQueued();
+    UpdateWatchedEvents();
+    return success;
+}
+
+bool MachineConnection::Flush(int timeout_ms) {
+    const int64_t deadline =
+        (timeout_ms < 0) ? -1 : GetMonotonicMillis() + timeout_ms;
+    while (out_pos_ < out_buffer_.size()) {
+        const int remaining = RemainingMillis(deadline);
+        if (remaining == 0) return false;
+        if (!HandleIO(remaining, nullptr)) return false;
+    }
+    return true;
+}
+
+bool MachineConnection::Drain(int timeout_ms) {
+    const int64_t deadline =
+        (timeout_ms < 0) ? -1 : GetMonotonicMillis() + timeout_ms;
+    if (!Flush(timeout_ms)) return false;
+    if (!is_tty_) return true;
+    // Keep reading while the kernel queue is transmitted; don't tcdrain()
+    // right away, which might block forever if the machine holds CTS.
+    int queued;
+    while (ioctl(output_fd_, TIOCOUTQ, &queued) == 0 && queued > 0) {
+        int wait_ms = queued / wire_bytes_per_us_ / 1000 + 1;
+        const int remaining = RemainingMillis(deadline);
+        if (remaining == 0) return false;
+        if (remaining > 0) wait_ms = std::min(wait_ms, remaining);
+        if (!HandleIO(wait_ms, nullptr)) return false;
+    }
+    return DrainTTY(output_fd_);
+}
+
+bool MachineConnection::ReadLine(int timeout_ms, std::string_view *line) {
+    ReleaseLines();
+    const int64_t deadline =
+        (timeout_ms < 0) ? -1 : GetMonotonicMillis() + timeout_ms;
+    for (;;) {
+        if (ExtractLine(line)) return true;
+        if (closed_) return false;
+        const int remaining = RemainingMillis(deadline);
+        if (remaining == 0) return false;
+        if (!HandleIO(remaining, nullptr)) return false;
+    }
+}
+
+size_t MachineConnection::ReadLines(int timeout_ms, std::string_view *lines,
+                                    size_t max_lines) {
+    if (max_lines == 0 || !ReadLine(timeout_ms, &lines[0])) return 0;
+    in_kept_ = lines[0].data() - in_buffer_.data();  // Until next call.
+    size_t count = 1;
+    while (count < max_lines && ExtractLine(&lines[count])) ++count;
+    return count;
+}
+
+void MachineConnection::WatchReadable(int fd, std::function<void()> handler) {
+    if (handler) {
+        other_handlers_[fd] = std::move(handler);
+        poller_.Set(fd, FDPoller::kReadable);
+    } else {
+        other_handlers_.erase(fd);
+        poller_.Set(fd, 0);
+    }
+}
+
+bool MachineConnection::HandleIO(int timeout_ms, bool *got_input) {
+    bool success = true;
+    // Held back blocks are due once the queue drained.
+    const int pace_wait_ms = WriteWaitMillis();
+    if (pace_wait_ms >= 0 && (timeout_ms < 0 || pace_wait_ms < timeout_ms)) {
+        timeout_ms = pace_wait_ms;
+    }
+    if (poller_.Wait(timeout_ms) < 0) {
+        perror("Waiting for machine connection");
+        success = false;
+    }
+    if (pace_wait_ms >= 0) success &= WriteQueued();
+    for (const auto &[fd, events] : poller_.ready()) {
+        if (fd == realtime_pipe_[0]) {
+            TakeRealtime();
+            success &= WriteQueued();
+        }
+        if (fd == output_fd_ && (events & FDPoller::kWritable)) {
+            success &= WriteQueued();
+        }
+        if (fd == input_fd_ &&
+            (events & (FDPoller::kReadable | FDPoller::kHangup))) {
+            success &= ReadAvailable(got_input);
+        }
+        if (const auto found = other_handlers_.find(fd);
+            found != other_handlers_.end()) {
+            // Copy, as the handler might remove itself.
+            const std::function<void()> handler = found->second;
+            handler();
+        }
+    }
+    if (!success) closed_ = true;
+    UpdateWatchedEvents();
+    return success;
+}
+
+void MachineConnection::UpdateWatchedEvents() {
+    // Only read if there is space in the buffer, or room to be made (see
+    // ReadAvailable()); if nobody consumes the input, we leave it to the
+    // kernel buffers to hold on to it.
+    const bool room = in_end_ < in_buffer_.size() ||
+                      (in_kept_ > 0 && in_kept_ == in_begin_);
+    const uint32_t input_events = (!closed_ && room) ? FDPoller::kReadable : 0;
+    // Held back blocks are written after WriteWaitMillis().
+    const uint32_t output_events =
+        ((out_pos_ < out_buffer_.size() && WriteAllowance() > 0) ||
+         !realtime_out_.empty())
+            ? FDPoller::kWritable
+            : 0;
+    if (input_events == watched_input_events_ &&
+        output_events == watched_output_events_) {
+        return;  // Nothing changed.
+    }
+    watched_input_events_ = input_events;
+    watched_output_events_ = output_events;
+    if (input_fd_ == output_fd_) {
+        poller_.Set(input_fd_, input_events | output_events);
+    } else {
+        poller_.Set(input_fd_, input_events);
+        poller_.Set(output_fd_, output_events);
+    }
+}
+
+bool MachineConnection::WriteQueued() {
+    while (!realtime_out_.empty()) {
+        const ssize_t w =
+            write(output_fd_, realtime_out_.data(), realtime_out_.size());
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            perror("Writing to machine");
+            return false;
+        }
+        realtime_out_.erase(0, w);
+        pace_queued_ += w;  // Not held back, but it's on the wire as well.
+    }
+    while (out_pos_ < out_buffer_.size()) {
+        const size_t allowance = WriteAllowance();
+        if (allowance == 0) return true;  // Again after WriteWaitMillis().
+        const ssize_t w =
+            write(output_fd_, out_buffer_.data() + out_pos_,
+                  std::min(out_buffer_.size() - out_pos_, allowance));
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            perror("Writing to machine");
+            return false;
+        }
+        out_pos_ += w;
+        pace_queued_ += w;
+    }
+    return true;
+}
+
+bool MachineConnection::ReadAvailable(bool *got_input) {
+    for (;;) {
+        if (in_kept_ == in_end_) {  // All consumed: start over, no copy.
+            in_begin_ = in_end_ = in_kept_ = 0;
+        } else if (in_end_ == in_buffer_.size() && in_kept_ > 0 &&
+                   in_kept_ == in_begin_) {
+            // Make room by moving the rest to the front; not while lines
+            // of ReadLines() point into the buffer.
+            memmove(in_buffer_.data(), in_buffer_.data() + in_kept_,
+                    in_end_ - in_kept_);
+            in_begin_ -= in_kept_;
+            in_end_ -= in_kept_;
+            in_kept_ = 0;
+        }
+        if (in_end_ == in_buffer_.size()) return true;  // Full.
+        const size_t space = in_buffer_.size() - in_end_;
+        const ssize_t r = read(input_fd_, in_buffer_.data() + in_end_, space);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            perror("Reading from machine");
+            return false;
+        }
+        if (r == 0) {
+            closed_ = true;  // Machine closed the connection.
+            return true;
+        }
+        in_end_ += r;
+        if (got_input) *got_input = true;
+        // Everything there was fit, so no need to ask again.
+        if ((size_t)r < space) return true;
+    }
+}
+
+bool MachineConnection::ExtractLine(std::string_view *line) {
+    char *const buffer = in_buffer_.data();
+    for (;;) {
+        char *const begin = buffer + in_begin_;
+        char *const end = buffer + in_end_;
+        char *eol = std::find_if(begin, end,
+                                 [](char c) { return c == '\n' || c == '\r'; });
+        if (eol == end) {
+            // A line filling the entire buffer is returned as-is.
+            if (in_begin_ > 0 || in_end_ < in_buffer_.size()) return false;
+        }
+        in_begin_ = std::min(eol + 1, end) - buffer;
+        std::string_view result(begin, eol - begin);
+        while (!result.empty() && isspace(result.front())) {
+            result.remove_prefix(1);
+        }
+        while (!result.empty() && isspace(result.back())) {
+            result.remove_suffix(1);
+        }
+        if (!result.empty()) {
+            *line = result;
+            return true;
+        }
+    }
 }
 
 #ifdef USE_TERMIOS
@@ -5,12 +5,17 @@
 #ifndef MACHINE_CONN_H
 #define MACHINE_CONN_H
 
+#include <stdint.h>
 #include <stdio.h>
 
+#include <atomic>
+#include <functional>
+#include <map>
+#include <string>
 #include <string_view>
 #include <vector>
 
-#include "buffered-line-reader.h"
+#include "fd-poller.h"
 
 class MachineConnection {
    public:
@@ -18,8 +23,15 @@ class MachineConnection {
     // the connection to the machine. This can be different ways to connect to
     // a machine.
     // Supported formats
-    //   - terminal: path, optional speed "/dev/ttyUSB0,b115200"
-    //   - "hostname:port"  (in fact: not yet supported, but needed for BeagleG)
+    //   - terminal: path, optional speed "/dev/ttyUSB0,b115200"; "bauto"
+    //     probes for the fastest rate the machine responds to. "pace=<ms>"
+    //     holds back blocks so that no more than that wire time is queued
+    //     in the operating system, keeping realtime commands responsive;
+    //     "outq=<bytes>" limits the bytes in the kernel's output queue.
+    //     Writes don't wait for the device unless "sync" is given.
+    //   - "hostname:port" or "[ipv6]:port", optionally followed by socket
+    //     options "-nodelay", "+keepalive", "sndbuf=<n>", "rcvbuf=<n>".
+    //     All addresses of the host are tried, in parallel if slow.
     // Can return nullptr on failure.
     static MachineConnection *Open(const char *descriptor);
 
@@ -33,21 +45,132 @@ class MachineConnection {
     // Returns number of bytes discarded.
     int DiscardPendingInput(int timeout_ms, FILE *echo_discarded);
 
-    // Write all provided blocks to the machine.
-    // Needs "scratch_buffer" to be large enough to contain all of them.
-    // (TODO: remove scratch buffer, that looks like leaking implementation
-    // details)
-    bool WriteBlocks(char *scratch_buffer,
-                     const std::vector<std::string_view> &blocks);
+    // Write blocks to the machine. As much as possible is written right away
+    // with writev() straight from the blocks' memory. What the machine can't
+    // take right now is copied and written whenever it is ready to receive,
+    // while waiting in ReadLine() or Flush(). So writes never have to wait
+    // behind reads, and the blocks don't need to outlive this call.
+    // Returns false if the connection is broken.
+    bool WriteBlocks(const std::vector<std::string_view> &blocks);
 
-    // Get a line buffer reader returning responses from the machine.
-    BufferedLineReader &ResponseLines() { return reader_; }
+    // Send realtime commands, such as Grbl's '?' status query, '!' feed
+    // hold, '~' cycle resume or the feed overrides 0x90 and up. They bypass
+    // the queued blocks and are written as soon as the machine can take
+    // them, possibly in the middle of a block; only what is already handed
+    // to the operating system is in front of them.
+    // Can be called from any thread, also from a signal handler: the bytes
+    // are passed through a pipe that wakes up the event loop.
+    // Returns false if they could not be passed on.
+    bool SendRealtime(std::string_view bytes);
+
+    // Wait up to "timeout_ms" (-1: forever) until all queued blocks are
+    // written. Returns false on timeout or error.
+    bool Flush(int timeout_ms);
+
+    // Synchronization point, e.g. at the end of the job or before holding
+    // the machine: Flush(), then wait until the operating system has
+    // transmitted everything to a terminal, while still reading responses.
+    // Returns false on timeout or error.
+    bool Drain(int timeout_ms);
+
+    // Wait up to "timeout_ms" (-1: forever) for the next non-empty line
+    // of response from the machine, writing out queued blocks meanwhile.
+    // Leading and trailing whitespace including the newline is removed.
+    // The returned "line" is valid until the next call.
+    // Returns false on timeout or if the connection is closed (is_closed()).
+    bool ReadLine(int timeout_ms, std::string_view *line);
+
+    // Batch variant of ReadLine(): wait up to "timeout_ms" (-1: forever)
+    // for at least one line, then return all complete lines received, at
+    // most "max_lines". Under a deep window, many acknowledgements arrive
+    // at once and are taken with a single read(). The lines are valid
+    // until the next ReadLine(), ReadLines() or DiscardPendingInput();
+    // Flush(), Drain() or Poll() meanwhile read on behind them but never
+    // move them. While they are held, reading stops once the buffer fills.
+    // Returns 0 on timeout or if the connection is closed.
+    size_t ReadLines(int timeout_ms, std::string_view *lines,
+                     size_t max_lines);
+
+    // Call "handler" from the event loop while waiting in ReadLine(),
+    // Flush() or DiscardPendingInput() whenever "fd" is readable, e.g. to
+    // serve a control socket without a thread of its own. An empty
+    // "handler" stops watching "fd". Handlers may change watched fds.
+    void WatchReadable(int fd, std::function<void()> handler);
+
+    // One round of the event loop without waiting for anything in
+    // particular, e.g. to serve watched fds while there is nothing to send:
+    // wait up to "timeout_ms" for events and handle them. Input is kept for
+    // ReadLine(). Returns false on error.
+    bool Poll(int timeout_ms) { return HandleIO(timeout_ms, nullptr); }
+
+    // Returns true if the machine closed the connection or it broke.
+    // Blocks might still be written if only the reading side is closed.
+    bool is_closed() const { return closed_; }
 
    private:
     MachineConnection(int to_machine, int from_machine);
+
+    // One round of the event loop: wait up to "timeout_ms" until the
+    // connection is ready to write queued data or to read new data, then do
+    // both as much as possible without blocking.
+    // If "got_input" is not null, it is set to whether new data was read.
+    // Returns false on error.
+    bool HandleIO(int timeout_ms, bool *got_input);
+
+    // Update events to watch for depending on the state of the buffers.
+    void UpdateWatchedEvents();
+
+    void TakeRealtime();  // Move realtime bytes from the pipe to the queue.
+    bool WriteQueued();   // Non-blocking write of queued data.
+
+    // Serial link with "bit_rate". Pacing: keep the bytes written but not
+    // yet on the wire, as estimated from the bit rate, below "pace_ms"
+    // wire time. The kernel's output queue is limited to
+    // "output_queue_limit" bytes. 0: no limit.
+    void SetLink(int bit_rate, int pace_ms, int output_queue_limit);
+    size_t WriteAllowance();  // Bytes that may be written now.
+    int WriteWaitMillis();    // Until held back blocks are due; -1: none.
+    bool ReadAvailable(bool *got_input);  // Non-blocking read of new data.
+    void ReleaseLines() { in_kept_ = in_begin_; }  // Of ReadLines().
+
+    // Get next complete non-empty line from input buffer if available.
+    bool ExtractLine(std::string_view *line);
+
     const int output_fd_;
     const int input_fd_;
-    BufferedLineReader reader_;
+    const int saved_output_flags_;
+    const int saved_input_flags_;
+
+    FDPoller poller_;
+    uint32_t watched_input_events_ = 0;
+    uint32_t watched_output_events_ = 0;
+
+    std::string out_buffer_;  // Queued data to be written.
+    size_t out_pos_ = 0;      // Data up to here is written.
+
+    // Realtime lane: written to the pipe by SendRealtime(), then queued
+    // here to go out before anything in out_buffer_.
+    int realtime_pipe_[2] = {-1, -1};
+    std::atomic<int> realtime_sent_{0};  // Calls to SendRealtime() since.
+    std::string realtime_out_;
+
+    std::map<int, std::function<void()>> other_handlers_;  // By fd.
+
+    bool is_tty_ = false;
+    double wire_bytes_per_us_ = 0;  // Of a terminal's bit rate.
+    double pace_limit_ = 0;         // Bytes; 0: no pacing.
+    double pace_queued_ = 0;        // Estimated bytes not on the wire yet...
+    int64_t pace_time_us_ = 0;      // ...at this time.
+    int output_queue_limit_ = 0;    // Bytes; 0: no limit.
+
+    // Data read from machine, used as ring: only moved to the front when
+    // there is no space left after it.
+    std::vector<char> in_buffer_;
+    size_t in_begin_ = 0;  // Start of not yet consumed data.
+    size_t in_end_ = 0;    // End of data read.
+    size_t in_kept_ = 0;   // Start of lines returned by ReadLines().
+
+    bool closed_ = false;
 };
 
 #endif  // MACHINE_CONN_H
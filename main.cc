@@ -2,13 +2,15 @@
  * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
  */
 
+#include <ctype.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <inttypes.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
-#include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -16,42 +18,150 @@
 #include <memory>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
 
+#include "async-log-writer.h"
+#include "block-minifier.h"
+#include "block-ring.h"
+#include "block-transform.h"
 #include "buffered-line-reader.h"
+#include "byte-source.h"
+#include "checkpoint.h"
+#include "compiled-job.h"
+#include "control-socket.h"
+#include "job-streamer.h"
 #include "machine-connection.h"
+#include "preflight.h"
+#include "response-classifier.h"
+#include "stream-stats.h"
 
-static int64_t get_time_ms() {
-    struct timeval tv;
-    gettimeofday(&tv, nullptr);
-    return (int64_t)tv.tv_sec * 1000 + (int64_t)tv.tv_usec / 1000;
+// Number of blocks the input producer can read ahead of the machine.
+static constexpr size_t kBlockReadAhead = 4096;
+
+// Number of lines the producer fetches from the reader at once.
+static constexpr size_t kProducerBatch = 256;
+
+// Upper limit of blocks in flight with adaptive flow control if not given.
+static constexpr int kMaxAdaptiveWindow = 128;
+
+// Buffer for communication logging written in the background.
+static constexpr size_t kLogBufferSize = 1 << 16;
+
+// Machines that SIGUSR1 and SIGUSR2 send realtime commands to. Not changed
+// while the signal handler is installed.
+static std::vector<MachineConnection *> realtime_signal_machines;
+
+// Grbl feed hold on SIGUSR1, cycle resume on SIGUSR2.
+static void SendRealtimeOnSignal(int signo) {
+    const char command = (signo == SIGUSR1) ? '!' : '~';
+    for (MachineConnection *machine : realtime_signal_machines) {
+        machine->SendRealtime(std::string_view(&command, 1));
+    }
 }
 
 static int usage(const char *progname, const char *message) {
     fprintf(stderr,
             "%sUsage:\n"
-            "%s [options] <gcode-file> [<connection-string>]\n"
+            "%s [options] <gcode-file> [<connection-string>...]\n"
+            "%s [options] compile <gcode-file> <job-file>\n"
             "Options:\n"
             "\t-s <millis> : Wait this time for init "
             "chatter from machine to subside.\n"
             "\t              Default: 2500\n"
-            "\t-b <count>  : Number of blocks sent out buffered before \n"
-            "\t              checking the returning flow-control 'ok'.\n"
+            "\t-b <count>  : Number of blocks in flight, i.e. sent out but\n"
+            "\t              not yet acknowledged by flow-control 'ok'.\n"
             "\t              Careful, low memory machines might drop data.\n"
             "\t              Default: 1\n"
+            "\t-B <bytes>  : Character-counting flow control: keep the sum\n"
+            "\t              of bytes in flight below the size of the\n"
+            "\t              machine's receive buffer (e.g. 128 for Grbl).\n"
+            "\t              If no -b is given, the number of blocks is\n"
+            "\t              only limited by this byte budget.\n"
+            "\t-A : Adaptive window for Marlin with ADVANCED_OK: learn the\n"
+            "\t     buffer size as the most free slots (B) the machine\n"
+            "\t     reported with an 'ok' and keep that many blocks in\n"
+            "\t     flight; it does not shrink again. -b is the upper\n"
+            "\t     limit (default 128), and the window as without -A if\n"
+            "\t     no free slots are reported.\n"
+            "\t-N : Send blocks with line number and checksum; resend\n"
+            "\t     from the blocks in flight if the machine asks for it.\n"
             "\t-c : Include semicolon end-of-line comments (they are stripped\n"
             "\t     by default)\n"
-            "\t-n : Dry-run. Read GCode but don't actually send anything.\n"
+            "\t-n : Dry-run. Don't send anything, but check the gcode file\n"
+            "\t     and estimate the job time. Exit code 2 if there are\n"
+            "\t     problems. With -q, only the pre-flight report is printed.\n"
+            "\t--envelope=X<min>:<max>,Y<min>:<max>,Z<min>:<max> : Machine\n"
+            "\t     envelope in mm for -n; any of the axes.\n"
+            "\t--max-feed=<mm/min> : Maximum feed for -n; default no limit.\n"
+            "\t     The feed of G0 moves in the estimate (default 5000).\n"
+            "\t--acceleration=<mm/s^2> : For the estimate of -n. "
+            "Default 1000\n"
             "\t-q : Quiet. Don't output diagnostic messages or "
             "echo regular communication.\n"
             "\t     Apply -q twice to even suppress "
             "non-handshake communication.\n"
             "\t-F : Disable waiting for 'ok'-acknowledge flow-control.\n"
+            "\t-r <prefix>=<type> : Classify machine responses starting\n"
+            "\t     with prefix as one of ok, error, busy, status, message.\n"
+            "\t     Busy and status lines are keepalives, not printed.\n"
+            "\t     Can be given multiple times.\n"
+            "\t-C <file> : Write checkpoint file with the progress of\n"
+            "\t     the job every second; removed when finished.\n"
+            "\t--resume : Resume job after the block in checkpoint file.\n"
+            "\t--resume=<block> : Resume job starting at given block\n"
+            "\t     number. Uses an index of the file in\n"
+            "\t     $XDG_CACHE_HOME/gcode-cli (made on first send or\n"
+            "\t     first use) to quickly get there.\n"
+            "\t--ack-timeout=<seconds> : Watchdog: maximum time until a\n"
+            "\t     block is acknowledged, plus the dwell time of G4.\n"
+            "\t     Should cover the longest move. Default: no limit.\n"
+            "\t--homing-timeout=<seconds> : Instead, for homing, bed\n"
+            "\t     leveling and waiting for temperature or moves (G28,\n"
+            "\t     G29, M109, M190, M191, M400, $H). Default 180\n"
+            "\t--on-timeout=<resend|probe|abort> : What to do if the ack\n"
+            "\t     timeout expires: re-send the blocks in flight (-N),\n"
+            "\t     send the --probe query and wait for any response,\n"
+            "\t     or stop. Stops after three times. Default: abort\n"
+            "\t--probe=<query> : Default M105; '?' for Grbl.\n"
+            "\t--stall-timeout=<seconds> : Stop if no block at all is\n"
+            "\t     acknowledged in that time, plus the allowance of dwell\n"
+            "\t     and homing blocks.\n"
+            "\t--realtime-signals : Send Grbl realtime commands feed hold\n"
+            "\t     '!' on SIGUSR1 and resume '~' on SIGUSR2 right away,\n"
+            "\t     not behind the blocks in flight.\n"
+            "\t--control=<socket> : Unix domain socket to monitor and\n"
+            "\t     control the running job with one-line commands:\n"
+            "\t     status, window <count>, pause, resume and\n"
+            "\t     realtime <byte>... (e.g. '?' or 0x91).\n"
+            "\t--coalesce=<mm> : Combine consecutive G1 moves that are\n"
+            "\t     collinear within this tolerance into one move, so that\n"
+            "\t     tiny CAM segments don't cost an 'ok' each.\n"
+            "\t--arc-tolerance=<mm> : Replace G2/G3 arcs by G1 segments\n"
+            "\t     with at most this chord error.\n"
+            "\t     Both only apply in G90 absolute mode and the G17 plane.\n"
+            "\t--minify : Send blocks with the fewest bytes: no spaces or\n"
+            "\t     redundant zeros, no F or axis words that don't change.\n"
+            "\t--minify=modal : Also leave out repeated G0..G3, for\n"
+            "\t     controllers with modal motion (Grbl, LinuxCNC).\n"
+            "\t-d : Drop communication log messages instead of slowing\n"
+            "\t     down sending if the terminal can't keep up.\n"
+            "\t-t : Print telemetry at the end: round-trip latency\n"
+            "\t     percentiles, throughput and time stalled.\n"
+            "\t-T <file> : Write telemetry as JSON to file, including\n"
+            "\t     the send and acknowledge time of each block.\n"
+            "\n"
+            "Exit code 1 if the job did not complete, 3 if a machine\n"
+            "did not respond in time.\n"
             "\n"
             "<gcode-file> is either a filename or '-' for stdin\n"
+            "It can also be a compiled job (see 'compile' below).\n"
+            "gzip or zstd compressed input is decompressed on the fly.\n"
             "\n"
             "\n<connection-string> is either a path to a tty device, a "
             "host:port or '-'\n"
+            "With multiple connection strings, the job is sent to all of\n"
+            "these machines at the same time.\n"
             " * Serial connection\n"
             "   A path to the device name with an optional bit-rate and flow\n"
             "   control settings separated by comma.\n\n"
@@ -66,6 +176,17 @@ static int usage(const char *progname, const char *message) {
 #else
             " (any value allowed supported by system).\n"
 #endif
+            "   With 'bauto', the fastest bit-rate the machine responds to\n"
+            "   cleanly is probed by sending M105, also from a list:\n"
+            "   \t/dev/ttyACM0,bauto:250000:115200\n"
+            "\n  Send pacing\n"
+            "   With pace=<millis>, blocks are held back so that no more\n"
+            "   than that time on the wire is queued in the operating\n"
+            "   system; realtime commands don't wait behind a large window:\n"
+            "   \t/dev/ttyACM0,b115200,pace=20\n"
+            "   outq=<bytes> limits the bytes queued in the operating\n"
+            "   system, measured with TIOCOUTQ. Writes don't wait until\n"
+            "   the data is transmitted; with 'sync' they do (O_SYNC).\n"
             "\n  Serial Flow Control\n"
             "   A +crtscts enables hardware flow control RTS/CTS handshaking:\n"
             "   \t/dev/ttyACM0,b115200,+crtscts\n"
@@ -77,99 +198,112 @@ static int usage(const char *progname, const char *message) {
             "   For devices that receive gcode via tcp "
             "(e.g. http://beagleg.org/)\n"
             "   you specify the connection string as host:port. Example:\n"
-            "   \tlocalhost:4444\n\n"
+            "   \tlocalhost:4444\n"
+            "   IPv6 addresses go in brackets: [::1]:4444. All addresses\n"
+            "   of a host are tried, in parallel after 250ms each.\n"
+            "   Socket options can follow separated by comma:\n"
+            "   -nodelay (Nagle's algorithm; no delay is default),\n"
+            "   +keepalive, sndbuf=<bytes> and rcvbuf=<bytes>:\n"
+            "   \tmy-cnc-machine.local:4444,sndbuf=4096,+keepalive\n\n"
             " * stdin/stdout\n"
             "   For a simple communication writing to the machine to stdout\n"
             "   and read responses from stdin, use '-'\n"
-            "   This is useful for debugging or wiring up using e.g. socat.\n",
-            message, progname);
+            "   This is useful for debugging or wiring up using e.g. socat.\n"
+            "\n"
+            "compile <gcode-file> <job-file>\n"
+            "   Preprocess the gcode once into a compiled job file that can\n"
+            "   be sent repeatedly without the need to re-tokenize; useful\n"
+            "   for jobs sent many times. If the gcode-file changes, sending\n"
+            "   the stale job file is refused.\n",
+            message, progname, progname);
 
     fprintf(stderr,
             "\nExamples:\n"
             "%s file.gcode /dev/ttyACM0,b115200\n"
-            "%s file.gcode localhost:4444\n",
-            progname, progname);
+            "%s file.gcode localhost:4444\n"
+            "%s compile file.gcode file.job && %s file.job /dev/ttyACM0\n",
+            progname, progname, progname, progname);
     return 1;
 }
 
-// Very crude error handling 'ui'. If this is an interactive session we can ask
-// the user to decide.
-static void handle_error_or_exit() {
-#define ALERT_ON  "\033[41m\033[30m"
-#define ALERT_OFF "\033[0m"
-
-    if (isatty(STDIN_FILENO)) {  // interactive.
-        fprintf(stderr, ALERT_ON
-                "[ Didn't get OK. Continue: ENTER; stop: CTRL-C ]" ALERT_OFF
-                "\n");
-        getchar();
-    } else {
-        fprintf(stderr,
-                "[ Received error. Non-interactive session "
-                "does not allow for user feedback. Bailing out.]"
-                "\n");
-        exit(1);
+// Parse envelope such as "X0:200,Y0:200,Z-10:100" into limits.
+static bool ParseEnvelope(const char *spec, MachineLimits *limits) {
+    for (;;) {
+        const char axis = toupper(*spec);
+        double min, max;
+        int len = 0;
+        if (axis < 'X' || axis > 'Z' ||
+            sscanf(spec + 1, "%lf:%lf%n", &min, &max, &len) != 2 ||
+            min >= max) {
+            return false;
+        }
+        limits->min[axis - 'X'] = min;
+        limits->max[axis - 'X'] = max;
+        spec += 1 + len;
+        if (*spec == '\0') return true;
+        if (*spec++ != ',') return false;
     }
 }
 
-// Check for case-insensitive prefix
-static bool hasPrefixIgnoreCase(std::string_view msg, std::string_view prefix) {
-    return (msg.length() >= prefix.length() &&
-            strncasecmp(msg.data(), prefix.data(), prefix.length()) == 0);
-}
-
-// Read and classify response from machine. Currently, we expect a line with
-// 'ok' at the beginning for an acknowledged block, 'error' at the beginning
-// for some kind of error, and everything else a message (e.g. output of
-// current temperature values.
-enum class AckResponse { kOk, kError, kMessage };
-static AckResponse ReadResponseLine(bool use_flow_control,
-                                    MachineConnection *machine,
-                                    std::string_view *return_message) {
-    if (!use_flow_control) {
-        return AckResponse::kOk;  // Don't read, always assume 'ok'.
-    }
-
-    const std::string_view ack_msg = machine->ResponseLines().ReadLine();
-    if (machine->ResponseLines().is_eof()) {
-        *return_message = "Nothing received from machine: Connection closed";
-        return AckResponse::kError;
-    }
-
-    // TODO: there might be other ways machines report ok or errors.
-
-    // OK response.
-    if (hasPrefixIgnoreCase(ack_msg, "ok")) {
-        return AckResponse::kOk;
-    }
-
-    // Any non-ok messages are useful to print. Return.
-    *return_message = ack_msg;
-
-    // ERROR response.
-    if (hasPrefixIgnoreCase(ack_msg, "error") ||
-        hasPrefixIgnoreCase(ack_msg, "alarm")) {
-        return AckResponse::kError;
+// Build the block index of the gcode file by reading it once, and save it
+// to "index_file" if given. Returns false if the file can't be read.
+static bool BuildBlockIndex(const char *filename,
+                            const SourceIdentity &identity, size_t buffer_size,
+                            const std::string &index_file, FILE *log_info,
+                            BlockIndex *index) {
+    if (log_info) fprintf(log_info, "Indexing %s\n", filename);
+    const int fd = open(filename, O_RDONLY);
+    std::string error;
+    std::unique_ptr<ByteSource> source =
+        (fd < 0) ? nullptr : ByteSource::Create(fd, &error);
+    if (source) {
+        BufferedLineReader reader(std::move(source), buffer_size,
+                                  identity.remove_comments);
+        index->Build(&reader);
+        if (!index_file.empty() && !index->Save(index_file.c_str(), identity)) {
+            fprintf(stderr, "Note: could not write index %s\n",
+                    index_file.c_str());
+        }
     }
-
-    // Neither one or the other, so regard this as just a line that is not
-    // a completed response yet.
-    return AckResponse::kMessage;
+    if (fd >= 0) close(fd);
+    return source != nullptr;
 }
 
 int main(int argc, char *argv[]) {
     // -- Command line options.
     bool is_dry_run = false;                // Don't send anything if enabled.
     bool use_ok_flow_control = true;        // wait for 'ok' response
-    int block_buffer_count = 1;             // Number of blocks sent at once.
+    int block_buffer_count = 1;             // Number of blocks in flight.
+    bool block_buffer_count_given = false;  // -b explicitly set.
+    int byte_budget = 0;                    // Max bytes in flight; 0: no limit
+    bool adaptive_window = false;           // Follow Marlin ADVANCED_OK.
+    bool use_line_numbers = false;          // N<line> ... *<checksum>
     bool remove_semicolon_comments = true;  // Not all machines understand them
     int initial_squash_chatter_ms = 2500;   // Start after start machine prompt.
+    bool print_telemetry = false;           // Latency/throughput summary.
+    const char *telemetry_json = nullptr;   // Write telemetry to this file.
+    const char *checkpoint_file = nullptr;  // Progress for resume.
+    bool resume = false;
+    MachineLimits limits;  // Pre-flight check of dry-run.
+    int resume_block = 0;  // Start at this block; 0: from checkpoint.
+    int ack_timeout_ms = 0;             // Watchdog; 0: wait forever.
+    int homing_timeout_ms = 180000;     // Homing, heat-up.
+    int stall_timeout_ms = 0;           // No progress at all.
+    TimeoutPolicy on_timeout = TimeoutPolicy::kAbort;
+    const char *probe_query = "M105";   // Status query of probe policy.
+    bool realtime_signals = false;      // SIGUSR1/2: feed hold/resume.
+    const char *control_socket_path = nullptr;  // Monitoring and control.
+    BlockTransform::Options transform;  // Coalesce moves, linearize arcs.
+    bool minify = false;                // Fewest bytes on the wire.
+    BlockMinifier::Options minify_options;
 
     bool print_communication = true;     // print line+block to $log_gcode
     bool print_unusual_messages = true;  // messages outside handshake
+    bool drop_log_if_slow = false;       // Drop log messages if stalled.
+    ResponseClassifier classifier;       // Built-in and -r response rules.
 
     // No cli options for the following yet. Make configurable ?
-    const size_t buffer_size = (1 << 20);  // Input buffer in bytes
+    const size_t buffer_size = (1 << 20);  // Input buffer if not mmap()ed
     FILE *const log_gcode = stderr;        // Log gcode communication here.
     FILE *log_info = stderr;               // info log, switched off with -q
 
@@ -179,8 +313,26 @@ int main(int argc, char *argv[]) {
         EXTRA_MESSAGE_ON = EXTRA_MESSAGE_OFF = "";
     }
 
+    static const struct option long_options[] = {
+        {"resume", optional_argument, nullptr, 'R'},
+        {"envelope", required_argument, nullptr, 'E'},
+        {"max-feed", required_argument, nullptr, 'V'},
+        {"acceleration", required_argument, nullptr, 'a'},
+        {"ack-timeout", required_argument, nullptr, 'K'},
+        {"homing-timeout", required_argument, nullptr, 'H'},
+        {"stall-timeout", required_argument, nullptr, 'W'},
+        {"on-timeout", required_argument, nullptr, 'O'},
+        {"probe", required_argument, nullptr, 'P'},
+        {"realtime-signals", no_argument, nullptr, 'G'},
+        {"control", required_argument, nullptr, 'S'},
+        {"coalesce", required_argument, nullptr, 'L'},
+        {"arc-tolerance", required_argument, nullptr, 'X'},
+        {"minify", optional_argument, nullptr, 'm'},
+        {nullptr, 0, nullptr, 0},
+    };
     int opt;
-    while ((opt = getopt(argc, argv, "b:cFhnqs:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "AB:b:C:cdFhNnqr:s:tT:",
+                              long_options, nullptr)) != -1) {
         switch (opt) {
         case 'n': is_dry_run = true; break;
         case 'q':
@@ -190,12 +342,100 @@ int main(int argc, char *argv[]) {
             print_communication = false;  // Make separate option ?
             break;
         case 'F': use_ok_flow_control = false; break;
+        case 'd': drop_log_if_slow = true; break;
+        case 'r':
+            if (!classifier.AddRuleFromString(optarg))
+                return usage(argv[0], "Invalid response rule\n");
+            break;
         case 'b':
             block_buffer_count = atoi(optarg);
             if (block_buffer_count < 1)
                 return usage(argv[0], "Invalid block buffer\n");
+            block_buffer_count_given = true;
+            break;
+        case 'B':
+            byte_budget = atoi(optarg);
+            if (byte_budget < 1)
+                return usage(argv[0], "Invalid byte budget\n");
+            break;
+        case 'A': adaptive_window = true; break;
+        case 'N': use_line_numbers = true; break;
+        case 'C': checkpoint_file = optarg; break;
+        case 'R':
+            resume = true;
+            if (optarg) {
+                resume_block = atoi(optarg);
+                if (resume_block < 1)
+                    return usage(argv[0], "Invalid resume block\n");
+            }
+            break;
+        case 'E':
+            if (!ParseEnvelope(optarg, &limits))
+                return usage(argv[0], "Invalid envelope\n");
+            break;
+        case 'V':
+            limits.max_feed = atof(optarg);
+            if (limits.max_feed <= 0)
+                return usage(argv[0], "Invalid maximum feed\n");
+            break;
+        case 'a':
+            limits.acceleration = atof(optarg);
+            if (limits.acceleration <= 0)
+                return usage(argv[0], "Invalid acceleration\n");
+            break;
+        case 'K':
+            ack_timeout_ms = atof(optarg) * 1000;
+            if (ack_timeout_ms <= 0)
+                return usage(argv[0], "Invalid ack timeout\n");
+            break;
+        case 'H':
+            homing_timeout_ms = atof(optarg) * 1000;
+            if (homing_timeout_ms <= 0)
+                return usage(argv[0], "Invalid homing timeout\n");
+            break;
+        case 'W':
+            stall_timeout_ms = atof(optarg) * 1000;
+            if (stall_timeout_ms <= 0)
+                return usage(argv[0], "Invalid stall timeout\n");
+            break;
+        case 'O':
+            if (strcmp(optarg, "resend") == 0) {
+                on_timeout = TimeoutPolicy::kResend;
+            } else if (strcmp(optarg, "probe") == 0) {
+                on_timeout = TimeoutPolicy::kProbe;
+            } else if (strcmp(optarg, "abort") == 0) {
+                on_timeout = TimeoutPolicy::kAbort;
+            } else {
+                return usage(argv[0], "Invalid timeout policy\n");
+            }
+            break;
+        case 'P':
+            probe_query = optarg;
+            if (!*probe_query) return usage(argv[0], "Invalid probe\n");
+            break;
+        case 'G': realtime_signals = true; break;
+        case 'S': control_socket_path = optarg; break;
+        case 'L':
+            transform.coalesce_tolerance = atof(optarg);
+            if (transform.coalesce_tolerance <= 0)
+                return usage(argv[0], "Invalid coalesce tolerance\n");
+            break;
+        case 'X':
+            transform.arc_tolerance = atof(optarg);
+            if (transform.arc_tolerance <= 0)
+                return usage(argv[0], "Invalid arc tolerance\n");
+            break;
+        case 'm':
+            minify = true;
+            if (optarg) {
+                if (strcmp(optarg, "modal") != 0)
+                    return usage(argv[0], "Invalid minify mode\n");
+                minify_options.modal_motion = true;
+            }
             break;
         case 'c': remove_semicolon_comments = false; break;
+        case 't': print_telemetry = true; break;
+        case 'T': telemetry_json = optarg; break;
         case 's':
             initial_squash_chatter_ms = atoi(optarg);
             if (initial_squash_chatter_ms < 0) {
@@ -211,137 +451,493 @@ int main(int argc, char *argv[]) {
         return usage(argv[0], "Expected filename\n");
     }
 
+    if (resume && resume_block == 0 && !checkpoint_file) {
+        return usage(argv[0], "--resume needs a checkpoint file (-C)\n");
+    }
+
+    // Without line numbers, the machine might execute re-sent blocks twice.
+    if (on_timeout == TimeoutPolicy::kResend && !use_line_numbers) {
+        return usage(argv[0], "--on-timeout=resend needs -N\n");
+    }
+
+    // Machines don't include comments in the checksum.
+    if (use_line_numbers && !remove_semicolon_comments) {
+        return usage(argv[0], "-N can't be combined with -c\n");
+    }
+
+    // With a byte budget only, the number of blocks is not limited other
+    // than by the budget. Each block is at least one character plus newline.
+    if (byte_budget > 0 && !block_buffer_count_given) {
+        block_buffer_count = std::max(1, byte_budget / 2);
+    }
+    // The adaptive window keeps to this if the machine doesn't report its
+    // buffer state.
+    const int static_window = block_buffer_count;
+    if (adaptive_window && !block_buffer_count_given && byte_budget <= 0) {
+        block_buffer_count = kMaxAdaptiveWindow;
+    }
+
+    // Compile mode: preprocess a gcode file once into a compiled job.
+    if (strcmp(argv[optind], "compile") == 0) {
+        if (optind + 2 >= argc) {
+            return usage(argv[0], "compile: expected gcode and job file\n");
+        }
+        const char *const source = argv[optind + 1];
+        const char *const job_file = argv[optind + 2];
+        if (!CompileJob(source, job_file, remove_semicolon_comments,
+                        buffer_size)) {
+            return 1;
+        }
+        if (log_info) {
+            fprintf(log_info, "Compiled '%s' into '%s'\n", source, job_file);
+        }
+        return 0;
+    }
+
+    // Output: one or more machines to send the job to.
+    std::vector<const char *> connect_strs(argv + optind + 1, argv + argc);
+    if (connect_strs.empty()) connect_strs.push_back("/dev/ttyACM0,b115200");
+    const bool fan_out = connect_strs.size() > 1;
+    if (fan_out && (checkpoint_file || resume)) {
+        return usage(argv[0], "-C and --resume need a single connection\n");
+    }
+    // The control socket is served in the event loop of the machine.
+    if (control_socket_path && (fan_out || is_dry_run)) {
+        return usage(argv[0], "--control needs a single machine\n");
+    }
+
     // Input: Open GCode file
     const char *const filename = argv[optind];
-    const int input_fd = (filename == std::string("-"))
-                             ? STDIN_FILENO
-                             : open(filename, O_RDONLY);
+
+    // Dry-run: pre-flight check of the whole file as quickly as possible.
+    // With -q, there would be nothing to show of sending to nowhere. If the
+    // blocks are listed, they are checked on the way instead, so that the
+    // input is only read once; that also works on stdin.
+    const bool list_dry_run =
+        print_communication || print_telemetry || telemetry_json;
+    const bool from_stdin = (strcmp(filename, "-") == 0);
+    bool preflight_problems = false;
+    PreflightReport preflight_report;
+    std::unique_ptr<PreflightChecker> preflight;
+    if (is_dry_run && !resume && (list_dry_run || from_stdin)) {
+        preflight.reset(new PreflightChecker(limits, &preflight_report));
+    } else if (is_dry_run && !from_stdin) {
+        if (!RunPreflight(filename, remove_semicolon_comments, buffer_size,
+                          limits, &preflight_report)) {
+            return 1;
+        }
+        preflight_report.Print(stdout);
+        fflush(stdout);
+        preflight_problems = (preflight_report.problems > 0);
+        if (!list_dry_run) return preflight_problems ? 2 : 0;
+    } else if (is_dry_run && log_info) {
+        fprintf(log_info, "Note: the pre-flight check needs a file.\n");
+    }
+
+    const int input_fd = from_stdin ? STDIN_FILENO : open(filename, O_RDONLY);
     if (input_fd < 0) {
         fprintf(stderr, "Can't open input %s: %s\n", filename, strerror(errno));
         return 1;
     }
 
-    // Output: open machine connection.
-    const char *const connect_str = (optind < argc - 1)  // destination as arg
-                                        ? argv[optind + 1]
-                                        : "/dev/ttyACM0,b115200";
-    is_dry_run |= (strcmp(connect_str, "/dev/null") == 0);
-
-    std::unique_ptr<MachineConnection> machine;
-    if (!is_dry_run) {
-        machine.reset(MachineConnection::Open(connect_str));
-        if (!machine) {
-            fprintf(stderr, "Failed to connect to machine %s\n", connect_str);
+    // Compiled jobs are already preprocessed, so no need to tokenize again.
+    std::unique_ptr<BlockSource> gcode_reader;
+    BufferedLineReader *line_reader = nullptr;  // Can parse words.
+    const bool is_compiled_job = IsCompiledJob(input_fd);
+    bool blocks_without_comments = remove_semicolon_comments;
+    JobStats job_stats;  // As far as known.
+    if (is_compiled_job) {
+        std::string error;
+        CompiledJobReader *job = CompiledJobReader::Open(input_fd, &error);
+        if (!job) {
+            fprintf(stderr, "%s: %s\n", filename, error.c_str());
+            return 1;
+        }
+        if (job->removed_comments() != remove_semicolon_comments) {
+            fprintf(stderr, "Note: %s was compiled %s -c; using that.\n",
+                    filename, job->removed_comments() ? "without" : "with");
+        }
+        blocks_without_comments = job->removed_comments();
+        job_stats.blocks = job->block_count();
+        gcode_reader.reset(job);
+    } else {
+        // Transparently decompress gzip or zstd input.
+        std::string error;
+        std::unique_ptr<ByteSource> source =
+            ByteSource::Create(input_fd, &error);
+        if (!source) {
+            fprintf(stderr, "%s: %s\n", filename, error.c_str());
             return 1;
         }
+        BufferedLineReader *reader = new BufferedLineReader(
+            std::move(source), buffer_size, remove_semicolon_comments);
+        gcode_reader.reset(reader);
+        line_reader = reader;
     }
 
-    // In a dry-run, we also will not read anything.
-    use_ok_flow_control &= !is_dry_run;
-
-    // If there is some initial chatter, ignore it, until there is some time
-    // silence on the wire.
-    // That way, we only get OK responses to our requests.
-    // Even without OK flow control, we need to wait as machine might
-    // just reset on connect.
-    if (machine) {
-        machine->DiscardPendingInput(initial_squash_chatter_ms,
-                                     print_communication ? log_gcode : nullptr);
+    // Resume: position the reader after the blocks already done.
+    const SourceIdentity identity =
+        SourceIdentity::FromFd(input_fd, blocks_without_comments);
+
+    // The totals of a plain file come with its index, so that repeated
+    // sends know them without reading the file first. The index is not
+    // built up front, which would delay the first block by a pass through
+    // the whole file: the producer collects it on the first send, and it is
+    // saved once all blocks are read. Only resuming at a block number needs
+    // it right away.
+    BlockIndex index;
+    std::string index_file;
+    bool have_index = false;
+    bool collect_index = false;
+    struct stat input_stat;
+    if (!is_compiled_job && input_fd != STDIN_FILENO &&
+        fstat(input_fd, &input_stat) == 0 && S_ISREG(input_stat.st_mode)) {
+        index_file = BlockIndexFile(filename);
+        have_index =
+            !index_file.empty() && index.Load(index_file.c_str(), identity);
+        if (!have_index && resume && resume_block > 0) {
+            have_index = BuildBlockIndex(filename, identity, buffer_size,
+                                         index_file, log_info, &index);
+        }
+        if (have_index) job_stats = index.stats();
+        collect_index = !have_index && !resume && !index_file.empty();
     }
-
-    if (log_info) {
-        fprintf(log_info, "\n---- Sending file '%s' to '%s'%s -----\n",
-                filename, connect_str, is_dry_run ? " (Dry-run)" : "");
+    if (have_index && log_info) {
+        fprintf(log_info,
+                "Job: %" PRIu64 " blocks, %" PRIu64 " bytes, longest block %"
+                PRIu64 " bytes\n", job_stats.blocks, job_stats.bytes,
+                job_stats.longest_block);
+    }
+    if (byte_budget > 0 && job_stats.longest_block > (uint64_t)byte_budget) {
+        fprintf(stderr,
+                "Warning: the longest block has %" PRIu64 " bytes, more "
+                "than the byte budget of %d; it might overflow the receive "
+                "buffer of the machine.\n",
+                job_stats.longest_block, byte_budget);
     }
 
-    BufferedLineReader gcode_reader(input_fd, buffer_size,
-                                    remove_semicolon_comments);
-    char *scratch_buffer = new char[buffer_size];
-    int line_no = 0;
-    const int64_t start_time = get_time_ms();
-    while (!gcode_reader.is_eof()) {
-        const auto lines = gcode_reader.ReadNextLines(block_buffer_count);
-
-        // Send all block_buffer_count blocks at once.
-        if (!is_dry_run && !machine->WriteBlocks(scratch_buffer, lines)) {
-            fprintf(stderr, "Couldn't write!\n");
+    Checkpoint progress;  // Last acknowledged block.
+    progress.source = identity;
+    if (resume) {
+        uint64_t skipped = 0;  // Blocks before the position.
+        if (resume_block == 0) {
+            std::string error;
+            if (!ReadCheckpoint(checkpoint_file, &progress, &error)) {
+                fprintf(stderr, "Can't resume from %s: %s\n", checkpoint_file,
+                        error.c_str());
+                return 1;
+            }
+            if (!(progress.source == identity)) {
+                fprintf(stderr, "Checkpoint %s is not for this version of %s\n",
+                        checkpoint_file, filename);
+                return 1;
+            }
+            skipped = progress.block;
+        } else {
+            progress.block = resume_block - 1;
+            progress.position = 0;
+            if (is_compiled_job) {
+                progress.position = skipped = progress.block;
+            } else if (have_index) {
+                skipped = index.Lookup(progress.block, &progress.position);
+            }
+        }
+        if (!gcode_reader->Seek(progress.position)) {
+            fprintf(stderr, "Can't seek to resume position in %s\n", filename);
             return 1;
         }
+        std::string_view lines[kProducerBatch];
+        for (uint64_t remaining = progress.block - skipped;
+             remaining > 0 && !gcode_reader->is_eof();) {
+            remaining -= gcode_reader->ReadNextLines(
+                lines, std::min<uint64_t>(remaining, kProducerBatch));
+        }
+        if (log_info) {
+            fprintf(log_info, "Resuming after block %d\n", progress.block);
+        }
+    }
 
-        // We've sent all the lines above at once, now looking at the
-        // expected responses for each block to confirm success.
-        // Respons to a gcode-block can be multiple lines and are expected
-        // to finish with either "ok" or "error".
-        // If communication printing requested, print the lines together with
-        // their corresponding response.
-        for (const auto request : lines) {
-            line_no++;
-            bool request_line_already_printed = false;
-            AckResponse response;
-            do {
-                std::string_view print_msg;
-                response = ReadResponseLine(use_ok_flow_control, machine.get(),
-                                            &print_msg);
-
-                // Now we know enough if we should print the original
-                // request. Whenever there is some unusual stuff going on, we
-                // want to print the original message first before the response.
-                const bool needs_printing =
-                    (print_communication ||              // regular chatter
-                     response == AckResponse::kError ||  // always print error
-                     (print_unusual_messages && response != AckResponse::kOk));
-
-                if (needs_printing) {
-                    if (!request_line_already_printed) {
-                        fprintf(log_gcode, "%6d\t%.*s ", line_no,
-                                (int)request.size() - 1, request.data());
-                        request_line_already_printed = true;
-                    }
-                    if (response == AckResponse::kOk) {
-                        fprintf(log_gcode,
-                                use_ok_flow_control ? "<< OK\n" : "\n");
-                    } else {
-                        while (!print_msg.empty() &&
-                               isspace(*(print_msg.end() - 1))) {
-                            print_msg.remove_suffix(1);
-                        }
-                        fprintf(log_gcode, "\n%s%.*s%s", EXTRA_MESSAGE_ON,
-                                (int)print_msg.size(), print_msg.data(),
-                                EXTRA_MESSAGE_OFF);
+    // Optional transform and minifier between reading and sending. The
+    // tokenizer parses the words for them on the way.
+    std::unique_ptr<BlockTransform> block_transform;
+    if (transform.coalesce_tolerance > 0 || transform.arc_tolerance > 0) {
+        block_transform.reset(new BlockTransform(transform,
+                                                 progress.position));
+    }
+    std::unique_ptr<BlockMinifier> block_minifier;
+    if (minify) block_minifier.reset(new BlockMinifier(minify_options));
+    if (line_reader && (block_transform || block_minifier || preflight)) {
+        line_reader->set_parse_words(true);
+    }
+
+    StreamOptions options;
+    options.use_ok_flow_control = use_ok_flow_control;
+    options.max_window = block_buffer_count;
+    options.byte_budget = byte_budget;
+    options.adaptive_window = adaptive_window;
+    options.static_window = static_window;
+    options.use_line_numbers = use_line_numbers;
+    options.print_communication = print_communication;
+    options.print_unusual_messages = print_unusual_messages;
+    // Asking the user only works with one machine to ask about.
+    options.ask_on_error = isatty(STDIN_FILENO) && !fan_out;
+    options.keep_trace = (telemetry_json != nullptr);
+    options.classifier = &classifier;
+    options.checkpoint_file = checkpoint_file;
+    options.message_on = EXTRA_MESSAGE_ON;
+    options.message_off = EXTRA_MESSAGE_OFF;
+    options.ack_timeout_ms = ack_timeout_ms;
+    options.homing_timeout_ms = homing_timeout_ms;
+    options.stall_timeout_ms = stall_timeout_ms;
+    options.on_timeout = on_timeout;
+    options.probe_query = probe_query;
+    options.total_blocks = job_stats.blocks;
+
+    // Communication is logged in the background, so that writing to
+    // a slow terminal does not cost a system call per block.
+    AsyncLogWriter gcode_log(log_gcode, kLogBufferSize, drop_log_if_slow);
+
+    // Open all machine connections. With multiple machines, the job is sent
+    // to the ones that could be connected.
+    std::vector<std::unique_ptr<MachineConnection>> machines;
+    std::vector<std::unique_ptr<JobStreamer>> streamers;
+    bool all_connected = true;
+    for (const char *connect_str : connect_strs) {
+        MachineConnection *machine = nullptr;
+        if (!is_dry_run && strcmp(connect_str, "/dev/null") != 0) {
+            machine = MachineConnection::Open(connect_str);
+            if (!machine) {
+                fprintf(stderr, "Failed to connect to machine %s\n",
+                        connect_str);
+                if (!fan_out) return 1;
+                all_connected = false;
+                continue;
+            }
+        }
+        machines.emplace_back(machine);
+        streamers.emplace_back(new JobStreamer(fan_out ? connect_str : "",
+                                               machine, options,
+                                               kBlockReadAhead, progress,
+                                               &gcode_log));
+    }
+    if (streamers.empty()) return 1;
+
+    std::unique_ptr<ControlSocket> control_socket;
+    if (control_socket_path && machines[0]) {
+        JobStreamer *const streamer = streamers[0].get();
+        control_socket.reset(ControlSocket::Create(
+            control_socket_path, machines[0].get(),
+            [streamer](std::string_view command) {
+                return streamer->HandleCommand(command);
+            }));
+        if (!control_socket) return 1;
+    }
+
+    // Realtime commands bypass the blocks queued for the machines.
+    if (realtime_signals) {
+        for (auto &machine : machines) {
+            if (machine) realtime_signal_machines.push_back(machine.get());
+        }
+        struct sigaction action = {};
+        action.sa_handler = SendRealtimeOnSignal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR1, &action, nullptr);
+        sigaction(SIGUSR2, &action, nullptr);
+    }
+
+    // Reading and preprocessing the input happens in a separate producer
+    // thread, so that a stalled read() on the input (slow pipe, network
+    // file system) never delays sending to the machine. Blocks are handed
+    // over in a lock-free ring per machine. The input is read and tokenized
+    // once, however many machines it is sent to; the slowest one determines
+    // how far the producer can read ahead.
+    std::thread producer([&]() {
+        int input_line_no = progress.block;
+        std::string_view lines[kProducerBatch];
+        uint64_t positions[kProducerBatch];
+        // Blocks to send after the transform; minified if enabled.
+        std::vector<std::string_view> texts;
+        std::vector<int> line_numbers;
+        std::vector<uint64_t> text_positions;
+        auto take_transformed = [&](size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                texts.push_back(block_transform->text(i));
+                line_numbers.push_back(block_transform->line_no(i));
+                text_positions.push_back(block_transform->position(i));
+            }
+        };
+        // Blocks of a mapped input are sent from the mapping; the output of
+        // the transform and minifier only lives until the next batch.
+        const bool stable_texts = gcode_reader->blocks_stay_valid() &&
+                                  !block_transform && !block_minifier;
+        auto send = [&](const WordTable *words) {
+            if (block_minifier) {
+                block_minifier->Process(texts.data(), texts.size(), words);
+            }
+            for (size_t i = 0; i < texts.size(); ++i) {
+                const std::string_view text =
+                    block_minifier ? block_minifier->text(i) : texts[i];
+                for (auto &streamer : streamers) {
+                    int backoff = 0;
+                    while (!streamer->blocks()->Push(line_numbers[i],
+                                                     text_positions[i], text,
+                                                     stable_texts)) {
+                        if (streamer->done()) break;  // Stopped on error.
+                        BackoffWait(&backoff);
                     }
-                    fflush(log_gcode);
                 }
-
-                if (response == AckResponse::kError) {
-                    handle_error_or_exit();
+            }
+            texts.clear();
+            line_numbers.clear();
+            text_positions.clear();
+        };
+        bool any_receiving = true;
+        while (any_receiving && !gcode_reader->is_eof()) {
+            const size_t count =
+                gcode_reader->ReadNextLines(lines, kProducerBatch, positions);
+            if (collect_index) index.Add(lines, positions, count);
+            const WordTable *words =
+                line_reader ? &line_reader->words() : nullptr;
+            if (preflight) preflight->Check(lines, count, words);
+            if (block_transform) {
+                take_transformed(block_transform->Process(
+                    lines, positions, count, input_line_no + 1, words));
+                words = nullptr;  // Not of the transformed blocks.
+            } else {
+                for (size_t i = 0; i < count; ++i) {
+                    texts.push_back(lines[i]);
+                    line_numbers.push_back(input_line_no + 1 + i);
+                    text_positions.push_back(positions[i]);
                 }
-            } while (response == AckResponse::kMessage);  // more to come
+            }
+            input_line_no += count;
+            send(words);
+            any_receiving = std::any_of(
+                streamers.begin(), streamers.end(),
+                [](const std::unique_ptr<JobStreamer> &s) { return !s->done(); });
+        }
+        if (block_transform && any_receiving) {
+            take_transformed(block_transform->Finish());
+            send(nullptr);
+        }
+        for (auto &streamer : streamers) streamer->blocks()->Close();
+        if (collect_index && gcode_reader->is_eof() &&
+            !index.Save(index_file.c_str(), identity)) {
+            fprintf(stderr, "Note: could not write index %s\n",
+                    index_file.c_str());
+        }
+    });
+
+    // Connect and stream to one machine.
+    auto stream_job = [&](JobStreamer *streamer) {
+        const char *const connect_str =
+            fan_out ? streamer->name().c_str() : connect_strs[0];
+        if (!streamer->Connect(initial_squash_chatter_ms,
+                               print_communication ? log_gcode : nullptr)) {
+            fprintf(stderr, "Could not reset line number of machine %s.\n",
+                    connect_str);
+            return false;
         }
-    }
 
-    const int64_t duration = get_time_ms() - start_time;
+        if (log_info) {
+            fprintf(log_info, "\n---- Sending file '%s' to '%s'%s -----\n",
+                    filename, connect_str,
+                    streamer->is_dry_run() ? " (Dry-run)" : "");
+        }
 
-    if (log_info) {
-        fprintf(log_info, "---- Finished file '%s' -----\n", filename);
-    }
+        const bool success = streamer->Run();
+        gcode_log.Flush();
+        if (!success) return false;
+        if (checkpoint_file) unlink(checkpoint_file);  // Job is done.
 
-    // We don't really expect anything coming afterwards from the machine, but
-    // if there is an imbalance of sent commands vs. acknowledge flow control
-    // tokens, we'd see it now.
-    if (!is_dry_run) {
-        if (log_info)
-            fprintf(log_info, "Discarding remaining machine responses.\n");
-        machine->DiscardPendingInput(
-            initial_squash_chatter_ms,
-            print_unusual_messages ? log_gcode : nullptr);
-    }
+        if (log_info) {
+            fprintf(log_info, "%s%s---- Finished file '%s' -----\n",
+                    streamer->name().c_str(), fan_out ? ": " : "", filename);
+        }
+
+        // We don't really expect anything coming afterwards from the machine,
+        // but if there is an imbalance of sent commands vs. acknowledge flow
+        // control tokens, we'd see it now.
+        if (!streamer->is_dry_run()) {
+            if (log_info) {
+                fprintf(log_info,
+                        "%s%sDiscarding remaining machine responses.\n",
+                        streamer->name().c_str(), fan_out ? ": " : "");
+            }
+            streamer->DiscardRemaining(
+                initial_squash_chatter_ms,
+                print_unusual_messages ? log_gcode : nullptr);
+        }
+        return true;
+    };
 
+    // With multiple machines, each is streamed to in its own thread.
+    bool all_success = all_connected;
+    if (!fan_out) {
+        all_success &= stream_job(streamers[0].get());
+    } else {
+        std::vector<char> success(streamers.size());
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < streamers.size(); ++i) {
+            workers.emplace_back([&, i]() {
+                success[i] = stream_job(streamers[i].get());
+            });
+        }
+        for (std::thread &worker : workers) worker.join();
+        for (size_t i = 0; i < streamers.size(); ++i) {
+            if (!success[i]) {
+                fprintf(stderr, "Job on %s did not complete.\n",
+                        streamers[i]->name().c_str());
+                all_success = false;
+            }
+        }
+    }
+    producer.join();
     close(input_fd);
+    if (preflight) {
+        preflight->Finish();
+        preflight_report.Print(stdout);
+        fflush(stdout);
+        preflight_problems = (preflight_report.problems > 0);
+    }
+    if (realtime_signals) {  // Machines are going away.
+        signal(SIGUSR1, SIG_IGN);
+        signal(SIGUSR2, SIG_IGN);
+    }
 
-    if (log_info) {
-        fprintf(log_info,
-                "Sent total of %d non-empty lines in "
-                "%" PRId64 ".%03" PRId64 "s\n",
-                line_no, duration / 1000, duration % 1000);
+    for (size_t i = 0; i < streamers.size(); ++i) {
+        const JobStreamer &streamer = *streamers[i];
+        const int64_t duration = streamer.stats().duration() / 1000;
+        if (log_info) {
+            fprintf(log_info,
+                    "%s%sSent total of %d non-empty lines in "
+                    "%" PRId64 ".%03" PRId64 "s\n",
+                    streamer.name().c_str(), fan_out ? ": " : "",
+                    streamer.progress().block - progress.block,
+                    duration / 1000, duration % 1000);
+        }
+        if (print_telemetry) {
+            streamer.stats().PrintSummary(log_info ? log_info : stderr);
+        }
+        // With multiple machines, the files are numbered.
+        if (telemetry_json) {
+            const std::string json_file =
+                fan_out ? std::string(telemetry_json) + "." +
+                              std::to_string(i + 1)
+                        : std::string(telemetry_json);
+            if (!streamer.stats().WriteJson(json_file.c_str())) {
+                all_success = false;
+            }
+        }
+    }
+    if (!all_success) {
+        const bool timed_out =
+            std::any_of(streamers.begin(), streamers.end(),
+                        [](const std::unique_ptr<JobStreamer> &s) {
+                            return s->timed_out();
+                        });
+        return timed_out ? 3 : 1;
     }
+    return preflight_problems ? 2 : 0;
 }
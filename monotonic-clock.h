@@ -0,0 +1,21 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#ifndef MONOTONIC_CLOCK_H
+#define MONOTONIC_CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Monotonic time; not affected by wall-clock changes. All timing, deadlines
+// and telemetry use this one clock.
+inline int64_t GetMonotonicMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+inline int64_t GetMonotonicMillis() { return GetMonotonicMicros() / 1000; }
+
+#endif  // MONOTONIC_CLOCK_H
@@ -0,0 +1,616 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "preflight.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "buffered-line-reader.h"
+#include "byte-source.h"
+#include "compiled-job.h"
+#include "gcode-words.h"
+
+// Size of the chunks a plain file is split into to check them in parallel.
+static constexpr uint64_t kChunkBytes = 4 << 20;
+
+// A chunk ends at the first newline this far after its nominal end.
+static constexpr size_t kMaxBoundarySearch = 1 << 16;
+
+// Blocks checked at a time before they are interpreted if the input is
+// read sequentially.
+static constexpr uint64_t kSequentialChunkBlocks = 1 << 16;
+
+static constexpr size_t kReadBatch = 256;
+
+// Details are kept of this many problems.
+static constexpr size_t kMaxProblemDetails = 10;
+
+// Feed of G0 moves if no maximum feed is given; mm/min.
+static constexpr double kDefaultRapidFeed = 5000;
+
+static constexpr double kMillimeterPerInch = 25.4;
+
+// G-codes of common controllers (RS274NGC, Grbl, Marlin) in tenths, so that
+// G28.1 is 281. Sorted.
+static constexpr int kKnownGCodes[] = {
+    0,   10,  20,  30,  40,  50,  60,  100, 110, 120, 170, 180, 190,
+    200, 210, 260, 270, 280, 281, 290, 300, 301, 310, 320, 330, 340,
+    350, 381, 382, 383, 384, 385, 400, 410, 411, 420, 421, 430, 431,
+    490, 530, 540, 550, 560, 570, 580, 590, 591, 592, 593, 600, 610,
+    611, 640, 760, 800, 810, 820, 830, 840, 850, 860, 870, 880, 890,
+    900, 901, 910, 911, 920, 921, 922, 923, 930, 940, 950, 960, 970,
+    980, 990, 4250};
+
+// Words the sequential pass follows the modal state and moves with; all
+// others are only checked in the parallel pass.
+static bool IsInterpretedLetter(char letter) {
+    switch (letter) {
+    case 'G': case 'X': case 'Y': case 'Z': case 'I': case 'J': case 'R':
+    case 'F': case 'P': case 'S': return true;
+    default: return false;
+    }
+}
+
+namespace {
+// Result of checking a chunk of blocks in parallel: the interpreted words of
+// all blocks and the problems found.
+struct ChunkResult {
+    uint64_t blocks = 0;
+    std::vector<uint32_t> first_word = {0};  // One more than blocks.
+    std::vector<char> letters;
+    std::vector<int64_t> values;
+    uint64_t problems = 0;
+    std::vector<std::pair<uint64_t, std::string>> details;  // Block in chunk.
+};
+}  // namespace
+
+static void AddProblem(uint64_t problem_block, std::string message,
+                       uint64_t *problems,
+                       std::vector<std::pair<uint64_t, std::string>> *details) {
+    ++*problems;
+    if (details->size() < kMaxProblemDetails) {
+        details->emplace_back(problem_block, std::move(message));
+    }
+}
+
+// Text not parsed as words that is expected: arguments of commands taking a
+// string (e.g. M117 messages or M23 filenames), checksums, Grbl system
+// commands and program delimiters.
+static bool IsExpectedRawText(const WordTable &words, size_t b, size_t w) {
+    const char first = words.word_text(b, w)[0];
+    if (first == '*' || first == '$' || first == '%') return true;
+    if (w == words.first_word(b) || words.letter(w - 1) != 'M') return false;
+    switch (words.value(w - 1) / WordTable::kValueScale) {
+    case 23: case 28: case 30: case 32: case 117: case 118: case 928:
+        return true;
+    default: return false;
+    }
+}
+
+static void CheckBlock(const WordTable &words, size_t b, ChunkResult *result) {
+    for (size_t w = words.first_word(b); w < words.first_word(b + 1); ++w) {
+        const char letter = words.letter(w);
+        if (letter == WordTable::kRawText) {
+            if (!IsExpectedRawText(words, b, w)) {
+                const std::string text(words.word_text(b, w));
+                AddProblem(result->blocks, "can't parse '" + text + "'",
+                           &result->problems, &result->details);
+            }
+            continue;
+        }
+        if (letter == 'G') {
+            const int64_t value = words.value(w);
+            const int tenths = value / (WordTable::kValueScale / 10);
+            if (value % (WordTable::kValueScale / 10) != 0 ||
+                !std::binary_search(std::begin(kKnownGCodes),
+                                    std::end(kKnownGCodes), tenths)) {
+                AddProblem(result->blocks,
+                           "unknown " + std::string(words.word_text(b, w)),
+                           &result->problems, &result->details);
+            }
+        }
+        if (IsInterpretedLetter(letter)) {
+            result->letters.push_back(letter);
+            result->values.push_back(words.value(w));
+        }
+    }
+    result->first_word.push_back(result->letters.size());
+    ++result->blocks;
+}
+
+// Check all blocks of "source".
+static void CheckChunk(BlockSource *source, ChunkResult *result) {
+    WordTable words;
+    std::string_view lines[kReadBatch];
+    while (!source->is_eof()) {
+        const size_t count = source->ReadNextLines(lines, kReadBatch);
+        words.Clear();
+        for (size_t i = 0; i < count; ++i) {
+            words.Add(lines[i]);
+            CheckBlock(words, i, result);
+        }
+    }
+}
+
+// Start positions of chunks of about kChunkBytes of the "size" bytes at
+// "data", each at the beginning of a line, plus the end of the file.
+static std::vector<uint64_t> FindChunkBoundaries(const char *data,
+                                                 uint64_t size) {
+    std::vector<uint64_t> boundaries = {0};
+    for (uint64_t nominal = kChunkBytes; nominal < size;
+         nominal += kChunkBytes) {
+        if (nominal <= boundaries.back()) continue;
+        const size_t len = std::min<uint64_t>(kMaxBoundarySearch,
+                                              size - nominal);
+        const char *newline = (const char *)memchr(data + nominal, '\n', len);
+        if (!newline) continue;  // Very long line; make this chunk longer.
+        const uint64_t boundary = newline + 1 - data;
+        if (boundary < size) boundaries.push_back(boundary);
+    }
+    boundaries.push_back(size);
+    return boundaries;
+}
+
+namespace {
+// The sequential pass: follows the modal state through the blocks, checks
+// moves against the limits and estimates the time.
+//
+// Moves are planned with trapezoidal velocity profiles and one move of look
+// ahead: the speed at the junction of two moves is the lower of their feeds
+// scaled by the cosine of the angle between them.
+class JobInterpreter {
+   public:
+    JobInterpreter(const MachineLimits &limits, PreflightReport *report)
+        : limits_(limits), report_(report) {}
+
+    void Run(const ChunkResult &chunk, uint64_t first_block);
+    void Finish();
+
+   private:
+    void Block(const char *letters, const int64_t *values, size_t count,
+               uint64_t block);
+    void Move(const double target[3], double length, double feed,
+              uint64_t block);
+    void PlanPending(double exit_speed);  // mm/s
+    void Problem(uint64_t block, std::string message) {
+        AddProblem(block, std::move(message), &report_->problems, &details_);
+    }
+
+    const MachineLimits &limits_;
+    PreflightReport *const report_;
+    std::vector<std::pair<uint64_t, std::string>> details_;
+
+    // Modal state.
+    int motion_mode_ = -1;  // G0..G3
+    bool absolute_ = true;
+    double unit_ = 1;       // mm per program unit.
+    double feed_ = 0;       // mm/min
+    double position_[3] = {0, 0, 0};
+    double offset_[3] = {0, 0, 0};  // G92: position - program coordinate.
+    bool reported_missing_feed_ = false;
+    double reported_feed_ = 0;  // Last feed reported over the limit.
+
+    // The move last seen, planned once the next one is known.
+    bool has_pending_ = false;
+    double pending_length_;
+    double pending_speed_;  // mm/s
+    double pending_direction_[3];
+    double entry_speed_ = 0;
+};
+}  // namespace
+
+void JobInterpreter::Run(const ChunkResult &chunk, uint64_t first_block) {
+    for (const auto &detail : chunk.details) {
+        details_.emplace_back(first_block + detail.first, detail.second);
+    }
+    report_->problems += chunk.problems;
+    for (uint64_t b = 0; b < chunk.blocks; ++b) {
+        const uint32_t first = chunk.first_word[b];
+        const uint32_t count = chunk.first_word[b + 1] - first;
+        if (count) {
+            Block(&chunk.letters[first], &chunk.values[first], count,
+                  first_block + b);
+        }
+    }
+    report_->blocks += chunk.blocks;
+}
+
+static double TrapezoidSeconds(double v0, double v1, double v_max,
+                               double acceleration, double length) {
+    v0 = std::min(v0, v_max);
+    v1 = std::min(v1, v_max);
+    const double accelerate = (v_max * v_max - v0 * v0) / (2 * acceleration);
+    const double decelerate = (v_max * v_max - v1 * v1) / (2 * acceleration);
+    if (accelerate + decelerate <= length) {
+        return (v_max - v0) / acceleration + (v_max - v1) / acceleration +
+               (length - accelerate - decelerate) / v_max;
+    }
+    // Not reaching full speed: triangle profile.
+    const double peak =
+        sqrt((2 * acceleration * length + v0 * v0 + v1 * v1) / 2);
+    if (peak < std::max(v0, v1)) return 2 * length / (v0 + v1);
+    return (peak - v0) / acceleration + (peak - v1) / acceleration;
+}
+
+void JobInterpreter::PlanPending(double exit_speed) {
+    if (!has_pending_) return;
+    const double a = limits_.acceleration;
+    const double reachable =
+        sqrt(entry_speed_ * entry_speed_ + 2 * a * pending_length_);
+    exit_speed = std::min(exit_speed, reachable);
+    report_->estimated_seconds += TrapezoidSeconds(
+        entry_speed_, exit_speed, pending_speed_, a, pending_length_);
+    entry_speed_ = exit_speed;
+    has_pending_ = false;
+}
+
+void JobInterpreter::Move(const double target[3], double length, double feed,
+                          uint64_t block) {
+    for (int i = 0; i < 3; ++i) {
+        if (limits_.min[i] < limits_.max[i] &&
+            (target[i] < limits_.min[i] || target[i] > limits_.max[i])) {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "%c%.3f outside of envelope", 'X' + i,
+                     target[i]);
+            Problem(block, msg);
+        }
+        if (report_->moves == 0) {
+            report_->min[i] = report_->max[i] = position_[i];
+        }
+        report_->min[i] = std::min(report_->min[i], target[i]);
+        report_->max[i] = std::max(report_->max[i], target[i]);
+    }
+    ++report_->moves;
+    if (length <= 0) return;
+    report_->distance += length;
+
+    double direction[3];
+    double chord = 0;
+    for (int i = 0; i < 3; ++i) {
+        direction[i] = target[i] - position_[i];
+        chord += direction[i] * direction[i];
+        position_[i] = target[i];
+    }
+    chord = sqrt(chord);
+    for (double &d : direction) d = (chord > 0) ? d / chord : 0;
+
+    const double speed = feed / 60;
+    if (has_pending_) {
+        double cosine = 0;
+        for (int i = 0; i < 3; ++i) {
+            cosine += direction[i] * pending_direction_[i];
+        }
+        PlanPending(std::min(speed, pending_speed_) * std::max(0.0, cosine));
+    }
+    has_pending_ = true;
+    pending_length_ = length;
+    pending_speed_ = speed;
+    std::copy(direction, direction + 3, pending_direction_);
+}
+
+void JobInterpreter::Block(const char *letters, const int64_t *values,
+                           size_t count, uint64_t block) {
+    double axis[3];
+    bool has_axis[3] = {false, false, false};
+    bool any_axis = false;
+    double i_offset = 0, j_offset = 0, radius = 0;
+    bool has_radius = false;
+    double feed = -1, p = -1, s = -1;
+    bool dwell = false, set_position = false, home = false;
+    for (size_t w = 0; w < count; ++w) {
+        const double v = WordTable::ToDouble(values[w]);
+        switch (letters[w]) {
+        case 'G':
+            switch (values[w] / (WordTable::kValueScale / 10)) {
+            case 0: case 10: case 20: case 30:
+                motion_mode_ = values[w] / WordTable::kValueScale;
+                break;
+            case 40: dwell = true; break;
+            case 200: unit_ = kMillimeterPerInch; break;
+            case 210: unit_ = 1; break;
+            case 280: home = true; break;
+            case 900: absolute_ = true; break;
+            case 910: absolute_ = false; break;
+            case 920: set_position = true; break;
+            }
+            break;
+        case 'X': case 'Y': case 'Z':
+            axis[letters[w] - 'X'] = v;
+            has_axis[letters[w] - 'X'] = any_axis = true;
+            break;
+        case 'I': i_offset = v; break;
+        case 'J': j_offset = v; break;
+        case 'R': radius = v; has_radius = true; break;
+        case 'F': feed = v; break;
+        case 'P': p = v; break;
+        case 'S': s = v; break;
+        }
+    }
+    if (feed >= 0) feed_ = feed * unit_;
+
+    if (dwell) {  // Marlin: P milliseconds, S seconds.
+        PlanPending(0);
+        entry_speed_ = 0;
+        report_->estimated_seconds += (p >= 0) ? p / 1000 : (s > 0 ? s : 0);
+        return;
+    }
+    if (home) {  // Move to the origin; the time is not known.
+        PlanPending(0);
+        entry_speed_ = 0;
+        for (int i = 0; i < 3; ++i) {
+            if (has_axis[i] || !any_axis) position_[i] = offset_[i] = 0;
+        }
+        return;
+    }
+    if (set_position) {
+        for (int i = 0; i < 3; ++i) {
+            if (has_axis[i]) offset_[i] = position_[i] - axis[i] * unit_;
+        }
+        return;
+    }
+    if (!any_axis || motion_mode_ < 0) return;
+
+    double target[3];
+    for (int i = 0; i < 3; ++i) {
+        if (!has_axis[i]) {
+            target[i] = position_[i];
+        } else {
+            target[i] = absolute_ ? axis[i] * unit_ + offset_[i]
+                                  : position_[i] + axis[i] * unit_;
+        }
+    }
+
+    double move_feed = feed_;
+    const double rapid =
+        (limits_.max_feed > 0) ? limits_.max_feed : kDefaultRapidFeed;
+    if (motion_mode_ == 0) {
+        move_feed = rapid;
+    } else if (move_feed <= 0) {
+        if (!reported_missing_feed_) Problem(block, "move without feed");
+        reported_missing_feed_ = true;
+        move_feed = rapid;
+    } else if (limits_.max_feed > 0 && move_feed > limits_.max_feed) {
+        if (move_feed != reported_feed_) {  // Once, not for every move.
+            char msg[64];
+            snprintf(msg, sizeof(msg), "feed %.0f over limit", move_feed);
+            Problem(block, msg);
+            reported_feed_ = move_feed;
+        }
+        move_feed = limits_.max_feed;
+    }
+
+    const double dx = target[0] - position_[0];
+    const double dy = target[1] - position_[1];
+    const double dz = target[2] - position_[2];
+    double length = sqrt(dx * dx + dy * dy + dz * dz);
+    if (motion_mode_ >= 2) {  // Arc in the XY plane.
+        const bool clockwise = (motion_mode_ == 2);
+        const double chord = sqrt(dx * dx + dy * dy);
+        double arc_radius, sweep;
+        if (has_radius) {
+            arc_radius = fabs(radius * unit_);
+            const double half = std::min(1.0, chord / (2 * arc_radius));
+            sweep = 2 * asin(half);
+            if (radius < 0) sweep = 2 * M_PI - sweep;  // The long way.
+        } else {
+            const double cx = position_[0] + i_offset * unit_;
+            const double cy = position_[1] + j_offset * unit_;
+            arc_radius = hypot(i_offset * unit_, j_offset * unit_);
+            const double start = atan2(position_[1] - cy, position_[0] - cx);
+            const double end = atan2(target[1] - cy, target[0] - cx);
+            sweep = clockwise ? start - end : end - start;
+            if (sweep <= 1e-9) sweep += 2 * M_PI;  // Full circle if same.
+        }
+        length = hypot(arc_radius * sweep, dz);
+    }
+    Move(target, length, move_feed, block);
+}
+
+void JobInterpreter::Finish() {
+    PlanPending(0);
+    std::sort(details_.begin(), details_.end());
+    for (const auto &detail : details_) {
+        if (report_->first_problems.size() >= kMaxProblemDetails) break;
+        report_->first_problems.push_back(
+            "block " + std::to_string(detail.first + 1) + ": " + detail.second);
+    }
+}
+
+// Check chunks of the memory mapped file on all cores, while interpreting the
+// finished ones in order. All chunks are read from one mapping; each reader
+// only writes newlines within the lines of its own chunk.
+// Returns false and prints an error if the file can't be mapped.
+static bool RunParallel(const char *filename, int fd, uint64_t size,
+                        bool remove_comments, JobInterpreter *interpreter) {
+    if (size == 0) return true;
+    // Private writable mapping: the readers place fresh newlines into it.
+    void *const m =
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED) {
+        fprintf(stderr, "Can't map %s: %s\n", filename, strerror(errno));
+        return false;
+    }
+    char *const mapped = (char *)m;
+    const std::vector<uint64_t> boundaries = FindChunkBoundaries(mapped, size);
+    const size_t chunks = boundaries.size() - 1;
+    const size_t threads =
+        std::max<size_t>(1, std::thread::hardware_concurrency());
+    const size_t max_ahead = 2 * threads;  // Limit memory of waiting results.
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<std::unique_ptr<ChunkResult>> results(chunks);
+    size_t next_chunk = 0;
+    size_t interpreted = 0;
+
+    auto worker = [&]() {
+        for (;;) {
+            size_t k;
+            {
+                std::unique_lock<std::mutex> l(mutex);
+                changed.wait(l, [&]() {
+                    return next_chunk >= chunks ||
+                           next_chunk < interpreted + max_ahead;
+                });
+                if (next_chunk >= chunks) break;
+                k = next_chunk++;
+            }
+            auto result = std::make_unique<ChunkResult>();
+            BufferedLineReader reader(mapped + boundaries[k],
+                                      boundaries[k + 1] - boundaries[k],
+                                      boundaries[k], remove_comments);
+            CheckChunk(&reader, result.get());
+            {
+                std::lock_guard<std::mutex> l(mutex);
+                results[k] = std::move(result);
+            }
+            changed.notify_all();
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < threads; ++i) workers.emplace_back(worker);
+
+    uint64_t first_block = 0;
+    for (size_t k = 0; k < chunks; ++k) {
+        std::unique_ptr<ChunkResult> result;
+        {
+            std::unique_lock<std::mutex> l(mutex);
+            changed.wait(l, [&]() { return results[k] != nullptr; });
+            result = std::move(results[k]);
+        }
+        interpreter->Run(*result, first_block);
+        first_block += result->blocks;
+        {
+            std::lock_guard<std::mutex> l(mutex);
+            ++interpreted;
+        }
+        changed.notify_all();
+    }
+    for (std::thread &t : workers) t.join();
+    munmap(m, size);
+    return true;
+}
+
+struct PreflightChecker::State {
+    State(const MachineLimits &limits, PreflightReport *report)
+        : interpreter(limits, report) {}
+
+    void Interpret() {
+        interpreter.Run(chunk, first_block);
+        first_block += chunk.blocks;
+        chunk = ChunkResult();
+    }
+
+    JobInterpreter interpreter;
+    ChunkResult chunk;  // Checked blocks not interpreted yet.
+    uint64_t first_block = 0;
+    WordTable own_words;  // If not given parsed words.
+};
+
+PreflightChecker::PreflightChecker(const MachineLimits &limits,
+                                   PreflightReport *report) {
+    *report = PreflightReport();
+    state_.reset(new State(limits, report));
+}
+
+PreflightChecker::~PreflightChecker() {}
+
+void PreflightChecker::Check(const std::string_view *lines, size_t count,
+                             const WordTable *words) {
+    if (!words) {
+        state_->own_words.Clear();
+        for (size_t i = 0; i < count; ++i) state_->own_words.Add(lines[i]);
+        words = &state_->own_words;
+    }
+    for (size_t i = 0; i < count; ++i) CheckBlock(*words, i, &state_->chunk);
+    if (state_->chunk.blocks >= kSequentialChunkBlocks) state_->Interpret();
+}
+
+void PreflightChecker::Finish() {
+    state_->Interpret();
+    state_->interpreter.Finish();
+}
+
+bool RunPreflight(const char *filename, bool remove_comments,
+                  size_t buffer_size, const MachineLimits &limits,
+                  PreflightReport *report) {
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Can't open input %s: %s\n", filename, strerror(errno));
+        return false;
+    }
+    // Compressed input and compiled jobs can't be split up: sequential.
+    std::unique_ptr<BlockSource> source;
+    std::string error;
+    if (IsCompiledJob(fd)) {
+        source.reset(CompiledJobReader::Open(fd, &error));
+    } else {
+        std::unique_ptr<ByteSource> bytes = ByteSource::Create(fd, &error);
+        struct stat st;
+        if (bytes && bytes->mappable_fd() >= 0 && fstat(fd, &st) == 0) {
+            *report = PreflightReport();
+            JobInterpreter interpreter(limits, report);
+            const bool success = RunParallel(filename, fd, st.st_size,
+                                             remove_comments, &interpreter);
+            interpreter.Finish();
+            close(fd);
+            return success;
+        }
+        if (bytes) {
+            source.reset(new BufferedLineReader(std::move(bytes), buffer_size,
+                                                remove_comments));
+        }
+    }
+    if (!source) {
+        fprintf(stderr, "%s: %s\n", filename, error.c_str());
+        close(fd);
+        return false;
+    }
+    PreflightChecker checker(limits, report);
+    std::string_view lines[kReadBatch];
+    while (!source->is_eof()) {
+        checker.Check(lines, source->ReadNextLines(lines, kReadBatch),
+                      nullptr);
+    }
+    checker.Finish();
+    source.reset();
+    close(fd);
+    return true;
+}
+
+void PreflightReport::Print(FILE *out) const {
+    const int64_t seconds = llround(estimated_seconds);
+    fprintf(out, "Blocks: %" PRIu64 ", moves: %" PRIu64 ", travel: %.3fm\n",
+            blocks, moves, distance / 1000);
+    if (moves) {
+        fprintf(out, "Bounding box: X %.3f..%.3f  Y %.3f..%.3f  Z %.3f..%.3f\n",
+                min[0], max[0], min[1], max[1], min[2], max[2]);
+    }
+    fprintf(out, "Estimated time: %" PRId64 ":%02d:%02d\n", seconds / 3600,
+            (int)(seconds / 60 % 60), (int)(seconds % 60));
+    if (problems == 0) {
+        fprintf(out, "No problems found.\n");
+        return;
+    }
+    fprintf(out, "%" PRIu64 " problem%s found%s\n", problems,
+            problems == 1 ? "" : "s",
+            problems > first_problems.size() ? "; the first are:" : ":");
+    for (const std::string &problem : first_problems) {
+        fprintf(out, "  %s\n", problem.c_str());
+    }
+}
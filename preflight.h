@@ -0,0 +1,75 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#ifndef PREFLIGHT_H
+#define PREFLIGHT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "gcode-words.h"
+
+// What the job is checked against and the parameters of the time estimate.
+struct MachineLimits {
+    // Envelope of X, Y and Z in mm; checked where min < max.
+    double min[3] = {0, 0, 0};
+    double max[3] = {0, 0, 0};
+    double max_feed = 0;         // mm/min; 0: no limit. Also used for G0.
+    double acceleration = 1000;  // mm/s^2
+};
+
+struct PreflightReport {
+    uint64_t blocks = 0;
+    uint64_t moves = 0;
+    double distance = 0;           // mm
+    double estimated_seconds = 0;  // Motion and dwell.
+    double min[3] = {0, 0, 0};     // Bounding box of all moves.
+    double max[3] = {0, 0, 0};
+
+    uint64_t problems = 0;
+    std::vector<std::string> first_problems;  // Details of the first few.
+
+    void Print(FILE *out) const;
+};
+
+// Validate the gcode file and estimate its run time: unknown words,
+// moves outside the envelope and feeds over the limit are reported.
+//
+// Plain files are split into chunks on line boundaries, which are tokenized
+// and checked on all cores; a fast sequential pass over the extracted words
+// then follows the modal state and plans the moves with trapezoidal
+// velocity profiles. Compressed inputs and compiled jobs are read
+// sequentially.
+// Returns false and prints an error if the file can't be read.
+bool RunPreflight(const char *filename, bool remove_comments,
+                  size_t buffer_size, const MachineLimits &limits,
+                  PreflightReport *report);
+
+// The same check of blocks read elsewhere, one batch after another; for a
+// dry-run that goes through the whole input anyway, so that it is only
+// read and tokenized once.
+class PreflightChecker {
+   public:
+    PreflightChecker(const MachineLimits &limits, PreflightReport *report);
+    ~PreflightChecker();
+
+    // Check the next "count" blocks "lines". "words" are their parsed
+    // words if available, otherwise they are parsed here.
+    void Check(const std::string_view *lines, size_t count,
+               const WordTable *words);
+
+    // After the last block: complete the report.
+    void Finish();
+
+   private:
+    struct State;
+    std::unique_ptr<State> state_;
+};
+
+#endif  // PREFLIGHT_H
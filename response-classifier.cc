@@ -0,0 +1,134 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "response-classifier.h"
+
+#include <ctype.h>
+#include <stdint.h>
+
+#include <algorithm>
+
+namespace {
+struct BuiltinRule {
+    const char *prefix;
+    ResponseType type;
+};
+}  // namespace
+
+static constexpr BuiltinRule kBuiltinRules[] = {
+    {"ok", ResponseType::kOk},  // Also covers "ok T:..." temperature reports.
+    {"error", ResponseType::kError},
+    {"alarm", ResponseType::kError},
+    {"!!", ResponseType::kError},            // RepRap/Smoothie halt.
+    {"echo:busy", ResponseType::kBusy},      // Marlin host keepalive.
+    {"busy:", ResponseType::kBusy},          // Marlin without echo prefix.
+    {"wait", ResponseType::kStatus},         // Marlin idle, awaiting input.
+    {"<", ResponseType::kStatus},            // Grbl status "<Idle|...>"
+    {"resend:", ResponseType::kResend},      // Marlin, RepRapFirmware.
+    {"rs ", ResponseType::kResend},          // Repetier, Teacup.
+};
+
+// Case-folding without locale lookup.
+static constexpr char ToLower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+ResponseClassifier::ResponseClassifier() {
+    for (const BuiltinRule &rule : kBuiltinRules) {
+        AddRule(rule.prefix, rule.type);
+    }
+}
+
+void ResponseClassifier::AddRule(std::string_view prefix, ResponseType type) {
+    if (prefix.empty()) return;
+    std::string lower(prefix);
+    std::transform(lower.begin(), lower.end(), lower.begin(), ToLower);
+    std::vector<Rule> &bucket = rules_[(uint8_t)lower[0]];
+    for (Rule &rule : bucket) {
+        if (rule.prefix == lower) {
+            rule.type = type;
+            return;
+        }
+    }
+    bucket.push_back({lower, type});
+    std::stable_sort(bucket.begin(), bucket.end(),
+                     [](const Rule &a, const Rule &b) {
+                         return a.prefix.size() > b.prefix.size();
+                     });
+}
+
+bool ResponseClassifier::AddRuleFromString(std::string_view spec) {
+    static constexpr struct {
+        const char *name;
+        ResponseType type;
+    } kTypeNames[] = {
+        {"ok", ResponseType::kOk},         {"error", ResponseType::kError},
+        {"busy", ResponseType::kBusy},     {"status", ResponseType::kStatus},
+        {"resend", ResponseType::kResend},
+        {"message", ResponseType::kMessage},
+    };
+    const size_t separator = spec.rfind('=');
+    if (separator == std::string_view::npos || separator == 0) return false;
+    const std::string_view type_name = spec.substr(separator + 1);
+    for (const auto &t : kTypeNames) {
+        if (type_name == t.name) {
+            AddRule(spec.substr(0, separator), t.type);
+            return true;
+        }
+    }
+    return false;
+}
+
+ResponseType ResponseClassifier::Classify(std::string_view line) const {
+    if (line.empty()) return ResponseType::kMessage;
+    for (const Rule &rule : rules_[(uint8_t)ToLower(line[0])]) {
+        if (rule.prefix.size() > line.size()) continue;
+        size_t i = 1;
+        while (i < rule.prefix.size() && ToLower(line[i]) == rule.prefix[i]) {
+            ++i;
+        }
+        if (i == rule.prefix.size()) return rule.type;
+    }
+    return ResponseType::kMessage;
+}
+
+void ResponseClassifier::Classify(const std::string_view *lines, size_t count,
+                                  ResponseType *types) const {
+    for (size_t i = 0; i < count; ++i) types[i] = Classify(lines[i]);
+}
+
+bool ParseAdvancedOk(std::string_view ok_line, AdvancedOk *result) {
+    *result = AdvancedOk();
+    bool found = false;
+    // Words after the 'ok'; stop at anything unexpected such as "T:".
+    size_t pos = 2;
+    for (;;) {
+        while (pos < ok_line.size() && ok_line[pos] == ' ') ++pos;
+        if (pos + 1 >= ok_line.size()) break;
+        const char letter = ok_line[pos++];
+        if (!isdigit(ok_line[pos])) break;
+        int value = 0;
+        while (pos < ok_line.size() && isdigit(ok_line[pos])) {
+            value = value * 10 + (ok_line[pos++] - '0');
+        }
+        switch (letter) {
+        case 'N': result->line_no = value; break;
+        case 'P': result->planner_free = value; break;
+        case 'B': result->rx_free = value; break;
+        default: return found;
+        }
+        found = true;
+    }
+    return found;
+}
+
+int ParseResendRequest(std::string_view resend_line) {
+    size_t pos = resend_line.find_first_of("0123456789");
+    if (pos == std::string_view::npos) return -1;
+    int value = 0;
+    while (pos < resend_line.size() && isdigit(resend_line[pos])) {
+        value = value * 10 + (resend_line[pos++] - '0');
+    }
+    return value;
+}
@@ -0,0 +1,71 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#ifndef RESPONSE_CLASSIFIER_H
+#define RESPONSE_CLASSIFIER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+enum class ResponseType {
+    kOk,       // Block acknowledged, e.g. "ok" or Marlin "ok T:..."
+    kError,    // Block failed, e.g. "error:..." or "alarm"
+    kBusy,     // Keepalive while still working, e.g. "echo:busy: processing"
+    kStatus,   // Unsolicited status report, e.g. Grbl "<Idle|...>"
+    kResend,   // Request to resend from line number, e.g. "Resend: 42"
+    kMessage,  // Anything else, e.g. output of a command.
+    kTimeout,  // Not a classification: nothing received in time.
+};
+
+// Classifies lines received from the machine by their case-insensitive
+// prefix; the longest matching prefix wins.
+//
+// Rules are indexed by their first character, so classifying a line is
+// a single comparison against very few candidates.
+class ResponseClassifier {
+   public:
+    // Classifier with built-in rules for the common dialects (Marlin,
+    // RepRap, Grbl, Smoothie, BeagleG).
+    ResponseClassifier();
+
+    // Add rule or replace the existing one with the same prefix.
+    void AddRule(std::string_view prefix, ResponseType type);
+
+    // Parse rule given as "<prefix>=<type>" with type one of
+    // "ok", "error", "busy", "status", "resend" or "message".
+    // Returns success.
+    bool AddRuleFromString(std::string_view spec);
+
+    ResponseType Classify(std::string_view line) const;
+
+    // Classify "count" lines at once into "types".
+    void Classify(const std::string_view *lines, size_t count,
+                  ResponseType *types) const;
+
+   private:
+    struct Rule {
+        std::string prefix;  // lower-case
+        ResponseType type;
+    };
+    // Rules by first character, longest prefix first.
+    std::vector<Rule> rules_[256];
+};
+
+// Buffer state Marlin reports with ADVANCED_OK: "ok N<line> P<planner> B<rx>"
+struct AdvancedOk {
+    int line_no = -1;       // Line number of the acknowledged block if given.
+    int planner_free = -1;  // Free slots in the planner buffer.
+    int rx_free = -1;       // Free slots in the command (receive) buffer.
+};
+
+// Parse the ADVANCED_OK fields of an 'ok' response. Fields not present
+// are left at -1. Returns true if any of them was found.
+bool ParseAdvancedOk(std::string_view ok_line, AdvancedOk *result);
+
+// Line number requested in a resend response such as "Resend: 42" or
+// "rs N42". Returns -1 if there is none.
+int ParseResendRequest(std::string_view resend_line);
+
+#endif  // RESPONSE_CLASSIFIER_H
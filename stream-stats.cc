@@ -0,0 +1,158 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#include "stream-stats.h"
+
+#include <inttypes.h>
+
+#include <algorithm>
+
+// Each power of two range is divided into 2^kSubBucketBits linear buckets.
+// Values are clamped to kMaxValueBits (~12 days in microseconds).
+static constexpr int kSubBucketBits = 6;
+static constexpr int64_t kSubBuckets = 1 << kSubBucketBits;
+static constexpr int kMaxValueBits = 40;
+static constexpr int64_t kMaxValue = (int64_t{1} << kMaxValueBits) - 1;
+
+LatencyHistogram::LatencyHistogram()
+    : counts_(IndexOf(kMaxValue) + 1) {}
+
+size_t LatencyHistogram::IndexOf(int64_t value) {
+    if (value < kSubBuckets) return value;
+    // Top kSubBucketBits+1 bits determine the bucket: the highest bit the
+    // power of two, the following ones the linear subdivision of it.
+    const int shift = (63 - __builtin_clzll(value)) - kSubBucketBits;
+    const int64_t sub_bucket = (value >> shift) - kSubBuckets;
+    return (shift + 1) * kSubBuckets + sub_bucket;
+}
+
+int64_t LatencyHistogram::HighestValueOf(size_t index) {
+    if (index < (size_t)kSubBuckets) return index;
+    const int shift = index / kSubBuckets - 1;
+    const int64_t sub_bucket = index % kSubBuckets;
+    return ((kSubBuckets + sub_bucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Record(int64_t value) {
+    value = std::clamp<int64_t>(value, 0, kMaxValue);
+    ++counts_[IndexOf(value)];
+    ++count_;
+    sum_ += value;
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+}
+
+int64_t LatencyHistogram::Percentile(double p) const {
+    if (count_ == 0) return 0;
+    const uint64_t target = std::max<uint64_t>(1, (uint64_t)(p * count_ + 0.5));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts_.size(); ++i) {
+        seen += counts_[i];
+        if (seen >= target) return std::min(HighestValueOf(i), max_);
+    }
+    return max_;
+}
+
+StreamStats::StreamStats(size_t max_in_flight, bool keep_trace)
+    : in_flight_(std::max<size_t>(1, max_in_flight)), keep_trace_(keep_trace) {}
+
+void StreamStats::Start() { start_time_ = finish_time_ = GetMonotonicMicros(); }
+void StreamStats::Finish() { finish_time_ = GetMonotonicMicros(); }
+
+void StreamStats::BlockSent(int line_no, size_t bytes, int64_t now) {
+    const size_t pos = (in_flight_first_ + in_flight_count_) % in_flight_.size();
+    in_flight_[pos] = {line_no, (uint32_t)bytes, now, 0};
+    ++in_flight_count_;
+    ++blocks_sent_;
+    bytes_sent_ += bytes;
+}
+
+void StreamStats::BlockAcknowledged(int64_t now) {
+    if (in_flight_count_ == 0) return;
+    BlockTiming &block = in_flight_[in_flight_first_];
+    block.acknowledged = now;
+    latency_.Record(now - block.sent);
+    if (keep_trace_) trace_.push_back(block);
+    in_flight_first_ = (in_flight_first_ + 1) % in_flight_.size();
+    --in_flight_count_;
+}
+
+void StreamStats::BlocksRewound(size_t count) {
+    count = std::min(count, in_flight_count_);
+    in_flight_count_ -= count;
+    blocks_resent_ += count;
+}
+
+static double PerSecond(uint64_t count, int64_t micros) {
+    return micros > 0 ? count * 1e6 / micros : 0;
+}
+
+void StreamStats::PrintSummary(FILE *out) const {
+    const int64_t micros = duration();
+    fprintf(out,
+            "Round-trip latency over %" PRIu64 " blocks: "
+            "p50 %.3fms, p99 %.3fms, p99.9 %.3fms, max %.3fms\n",
+            latency_.count(), latency_.Percentile(0.5) / 1e3,
+            latency_.Percentile(0.99) / 1e3, latency_.Percentile(0.999) / 1e3,
+            latency_.max() / 1e3);
+    fprintf(out, "Throughput: %.1f blocks/s, %.0f bytes/s\n",
+            PerSecond(blocks_sent_, micros), PerSecond(bytes_sent_, micros));
+    fprintf(out, "Stalled: %.3fs waiting for flow control, %.3fs for input\n",
+            flow_control_stall_ / 1e6, input_stall_ / 1e6);
+    if (blocks_resent_) {
+        fprintf(out, "Resent %" PRIu64 " blocks on request.\n", blocks_resent_);
+    }
+}
+
+bool StreamStats::WriteJson(const char *filename) const {
+    FILE *out = fopen(filename, "w");
+    if (!out) {
+        perror(filename);
+        return false;
+    }
+    const int64_t micros = duration();
+    fprintf(out,
+            "{\n  \"duration_us\": %" PRId64 ",\n"
+            "  \"blocks\": %" PRIu64 ",\n  \"bytes\": %" PRIu64 ",\n"
+            "  \"blocks_per_s\": %.3f,\n  \"bytes_per_s\": %.3f,\n"
+            "  \"flow_control_stall_us\": %" PRId64 ",\n"
+            "  \"input_stall_us\": %" PRId64 ",\n"
+            "  \"blocks_resent\": %" PRIu64 ",\n",
+            micros, blocks_sent_, bytes_sent_, PerSecond(blocks_sent_, micros),
+            PerSecond(bytes_sent_, micros), flow_control_stall_, input_stall_,
+            blocks_resent_);
+    fprintf(out,
+            "  \"latency_us\": {\"count\": %" PRIu64 ", \"min\": %" PRId64
+            ", \"mean\": %.1f, \"p50\": %" PRId64 ", \"p90\": %" PRId64
+            ", \"p99\": %" PRId64 ", \"p999\": %" PRId64 ", \"max\": %" PRId64
+            "},\n",
+            latency_.count(), latency_.min(), latency_.mean(),
+            latency_.Percentile(0.5), latency_.Percentile(0.9),
+            latency_.Percentile(0.99), latency_.Percentile(0.999),
+            latency_.max());
+
+    // Non-empty buckets as [highest value in bucket, count].
+    fprintf(out, "  \"latency_histogram\": [");
+    const char *separator = "";
+    latency_.ForEachBucket([&](int64_t value, uint64_t count) {
+        fprintf(out, "%s[%" PRId64 ", %" PRIu64 "]", separator, value, count);
+        separator = ", ";
+    });
+    fprintf(out, "]");
+
+    if (keep_trace_) {
+        // Per block [line, bytes, sent, acknowledged]; times relative to start.
+        fprintf(out, ",\n  \"blocks_trace\": [");
+        separator = "\n    ";
+        for (const BlockTiming &b : trace_) {
+            fprintf(out, "%s[%d, %u, %" PRId64 ", %" PRId64 "]", separator,
+                    b.line_no, b.bytes, b.sent - start_time_,
+                    b.acknowledged - start_time_);
+            separator = ",\n    ";
+        }
+        fprintf(out, "\n  ]");
+    }
+    fprintf(out, "\n}\n");
+    return fclose(out) == 0;
+}
@@ -0,0 +1,112 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) h.zeller@acm.org. Free Software. GNU Public License v3.0 and above
+ */
+
+#ifndef STREAM_STATS_H
+#define STREAM_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <vector>
+
+#include "monotonic-clock.h"
+
+// HDR-style histogram of latencies in microseconds: logarithmic buckets,
+// each linearly subdivided, so that any recorded value is represented with
+// better than 2% precision over the full range in constant memory.
+class LatencyHistogram {
+   public:
+    LatencyHistogram();
+
+    void Record(int64_t value);
+
+    // Value at or below which the fraction "p" (0..1) of recorded values is.
+    int64_t Percentile(double p) const;
+
+    uint64_t count() const { return count_; }
+    int64_t min() const { return count_ ? min_ : 0; }
+    int64_t max() const { return max_; }
+    double mean() const { return count_ ? (double)sum_ / count_ : 0; }
+
+    // Call "fun(highest_value_in_bucket, count)" for all non-empty buckets.
+    template <typename Fun>
+    void ForEachBucket(Fun fun) const {
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            if (counts_[i]) fun(HighestValueOf(i), counts_[i]);
+        }
+    }
+
+   private:
+    static size_t IndexOf(int64_t value);
+    static int64_t HighestValueOf(size_t index);
+
+    std::vector<uint64_t> counts_;
+    uint64_t count_ = 0;
+    int64_t sum_ = 0;
+    int64_t min_ = INT64_MAX;
+    int64_t max_ = 0;
+};
+
+// Telemetry of a streaming session: per-block round-trip between sending
+// and acknowledge, throughput and where the time is spent waiting.
+// Blocks are acknowledged in the order they are sent.
+class StreamStats {
+   public:
+    // "max_in_flight" is the maximum number of blocks sent but not yet
+    // acknowledged. If "keep_trace" is set, each block's timing is kept for
+    // the JSON output.
+    StreamStats(size_t max_in_flight, bool keep_trace);
+
+    void Start();   // Start of streaming.
+    void Finish();  // All blocks acknowledged.
+
+    void BlockSent(int line_no, size_t bytes, int64_t now);
+    void BlockAcknowledged(int64_t now);
+
+    // The newest "count" blocks in flight are going to be sent again.
+    void BlocksRewound(size_t count);
+
+    // Time spent waiting for the machine to acknowledge (flow control) and
+    // waiting for the input to provide the next blocks.
+    void AddFlowControlStall(int64_t micros) { flow_control_stall_ += micros; }
+    void AddInputStall(int64_t micros) { input_stall_ += micros; }
+
+    int64_t duration() const { return finish_time_ - start_time_; }
+    int64_t start_time() const { return start_time_; }
+    uint64_t blocks_acknowledged() const { return latency_.count(); }
+
+    // Human readable summary.
+    void PrintSummary(FILE *out) const;
+
+    // Write all statistics (and the trace if kept) as JSON.
+    bool WriteJson(const char *filename) const;
+
+   private:
+    struct BlockTiming {
+        int line_no;
+        uint32_t bytes;
+        int64_t sent;
+        int64_t acknowledged;
+    };
+
+    // Blocks in flight, oldest first, in a ring of max_in_flight elements.
+    std::vector<BlockTiming> in_flight_;
+    size_t in_flight_first_ = 0;
+    size_t in_flight_count_ = 0;
+
+    const bool keep_trace_;
+    std::vector<BlockTiming> trace_;
+
+    LatencyHistogram latency_;
+    int64_t start_time_ = 0;
+    int64_t finish_time_ = 0;
+    uint64_t blocks_sent_ = 0;
+    uint64_t bytes_sent_ = 0;
+    uint64_t blocks_resent_ = 0;
+    int64_t flow_control_stall_ = 0;
+    int64_t input_stall_ = 0;
+};
+
+#endif  // STREAM_STATS_H